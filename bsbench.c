@@ -0,0 +1,615 @@
+// bsbench puts jobs into a beanstalkd server at a fixed rate over
+// many connections, has workers reserve and finish them, and prints
+// the latencies as a JSON object.
+//
+// The load is open loop: job k is due at start + k/rate, whether or
+// not the server has answered earlier puts, and every latency is
+// measured from the time the job was due. A stall in the server or
+// in bsbench itself then shows up as latency for every job that
+// waited behind it, not as a lower rate (coordinated omission).
+
+#include "dat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum
+{
+    Stampsize = 20,       // digits of the due time at the start of a body
+    Maxbody   = 1 << 20,
+    Retry     = 50000000, // ns to wait after DEADLINE_SOON
+};
+
+typedef struct Client Client;
+
+struct Client {
+    int    fd;
+    int    worker;
+    char   *out;
+    size_t nout, capout;
+    char   *in;
+    size_t nin, capin;
+
+    // Producers: due times of the puts not yet answered, in a ring.
+    int64  *due;
+    size_t head, ndue, capdue;
+
+    // Workers: the due time of the job being finished, if any,
+    // and when to reserve again after DEADLINE_SOON, if at all.
+    int    acting;
+    int64  actdue;
+    int64  retry;
+};
+
+const char *progname;
+
+static char   *host = "127.0.0.1", *port = "11300";
+static double rate = 1000, duration = 10, grace = 10;
+static int    nprod = 4, nwork = 4, ntube = 1;
+static char   *sizearg = "100";
+static int    sizekind, size0, size1;
+static int    ttr = 60;
+static double pexpire, prelease, pbury;
+static long   seed = 1;
+
+static struct {
+    int64 due, inserted, puterr;
+    int64 reserved, deleted, released, buried, expired;
+    int64 timedout, deadline, acterr;
+} st;
+
+static Hist  hput, hreserve, hdone;
+static int64 maxput, maxreserve, maxdone;
+
+static void
+usage(int code)
+{
+    fprintf(stderr, "Use: %s [OPTIONS]\n"
+            "\n"
+            "Options:\n"
+            " -a ADDR  server address (default 127.0.0.1)\n"
+            " -p PORT  server port (default 11300)\n"
+            " -r RATE  puts per second (default 1000)\n"
+            " -d SECS  how long to put jobs (default 10)\n"
+            " -g SECS  how long to wait for the workers to finish (default 10)\n"
+            " -c NUM   producer connections (default 4)\n"
+            " -w NUM   worker connections (default 4)\n"
+            " -t NUM   tubes, bsbench.0 and up (default 1)\n"
+            " -s SIZE  body size in bytes: N, MIN-MAX for uniform,\n"
+            "          or exp:MEAN for exponential (default 100)\n"
+            " -x SECS  time to run of each job (default 60)\n"
+            " -E FRAC  fraction of jobs a worker lets time out\n"
+            " -R FRAC  fraction of jobs a worker releases\n"
+            " -B FRAC  fraction of jobs a worker buries\n"
+            " -S SEED  random seed (default 1)\n"
+            " -h       show this help\n",
+            progname);
+    exit(code);
+}
+
+static void
+die(const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", progname, what, strerror(errno));
+    exit(1);
+}
+
+static void
+diex(const char *msg)
+{
+    fprintf(stderr, "%s: %s\n", progname, msg);
+    exit(1);
+}
+
+static int64
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+parsesize(char *s)
+{
+    char *end;
+
+    if (strncmp(s, "exp:", 4) == 0) {
+        sizekind = 'e';
+        size0 = size1 = strtol(s + 4, &end, 10);
+    } else {
+        size0 = size1 = strtol(s, &end, 10);
+        if (*end == '-') {
+            sizekind = 'u';
+            size1 = strtol(end + 1, &end, 10);
+        }
+    }
+    if (*end || size0 < 0 || size1 < size0)
+        diex("bad body size");
+}
+
+// bodysize picks the size of the next body. Every body holds
+// at least the due time of its job.
+static int
+bodysize(void)
+{
+    double v = size0;
+
+    if (sizekind == 'u')
+        v = size0 + drand48() * (size1 - size0 + 1);
+    else if (sizekind == 'e')
+        v = -size0 * log(1 - drand48());
+    if (v < Stampsize)
+        return Stampsize;
+    if (v > Maxbody)
+        return Maxbody;
+    return v;
+}
+
+static void
+grow(char **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+        return;
+    while (*cap < need)
+        *cap = *cap ? *cap * 2 : 4096;
+    *buf = realloc(*buf, *cap);
+    if (!*buf)
+        die("realloc");
+}
+
+static void
+emit(Client *c, const char *s, size_t n)
+{
+    grow(&c->out, &c->capout, c->nout + n);
+    memcpy(c->out + c->nout, s, n);
+    c->nout += n;
+}
+
+static void
+pushdue(Client *c, int64 due)
+{
+    if (c->ndue == c->capdue) {
+        size_t i, cap = c->capdue ? c->capdue * 2 : 64;
+        int64 *d = malloc(cap * sizeof *d);
+        if (!d)
+            die("malloc");
+        for (i = 0; i < c->ndue; i++)
+            d[i] = c->due[(c->head + i) % c->capdue];
+        free(c->due);
+        c->due = d;
+        c->head = 0;
+        c->capdue = cap;
+    }
+    c->due[(c->head + c->ndue++) % c->capdue] = due;
+}
+
+static int64
+popdue(Client *c)
+{
+    int64 due = c->due[c->head];
+
+    c->head = (c->head + 1) % c->capdue;
+    c->ndue--;
+    return due;
+}
+
+static void
+record(Hist *h, int64 *max, int64 v)
+{
+    if (v < 0)
+        v = 0;
+    hist_record(h, v);
+    if (v > *max)
+        *max = v;
+}
+
+static int
+dial(void)
+{
+    struct addrinfo hints = {0}, *ai;
+    int fd, r, on = 1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    r = getaddrinfo(host, port, &hints, &ai);
+    if (r != 0) {
+        fprintf(stderr, "%s: %s:%s: %s\n", progname, host, port,
+                gai_strerror(r));
+        exit(1);
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1)
+        die("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+        die("connect");
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    freeaddrinfo(ai);
+    return fd;
+}
+
+// setup sends cmd and checks that the reply starts with want.
+// It runs before the load starts, so it reads a byte at a time.
+static void
+setup(Client *c, const char *cmd, const char *want)
+{
+    char line[256], ch;
+    size_t i;
+
+    if (write(c->fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+        die("write");
+    for (i = 0; i < sizeof line - 1; i++) {
+        if (read(c->fd, &ch, 1) != 1)
+            die("read");
+        line[i] = ch;
+        if (ch == '\n')
+            break;
+    }
+    line[i] = '\0';
+    if (strncmp(line, want, strlen(want)) != 0) {
+        fprintf(stderr, "%s: setup: got %s\n", progname, line);
+        exit(1);
+    }
+}
+
+static void
+putjob(Client *c, int64 due)
+{
+    char hdr[64];
+    int n, size = bodysize();
+
+    n = snprintf(hdr, sizeof hdr, "put 0 0 %d %d\r\n%0*" PRId64,
+                 ttr, size, Stampsize, due);
+    emit(c, hdr, n);
+    grow(&c->out, &c->capout, c->nout + size - Stampsize + 2);
+    memset(c->out + c->nout, 'x', size - Stampsize);
+    c->nout += size - Stampsize;
+    emit(c, "\r\n", 2);
+    pushdue(c, due);
+    st.due++;
+}
+
+static void
+reserve(Client *c)
+{
+    static char cmd[] = "reserve-with-timeout 1\r\n";
+
+    emit(c, cmd, sizeof cmd - 1);
+}
+
+// finish decides what happens to a reserved job: it is deleted,
+// released, buried, or left to time out.
+static void
+finish(Client *c, uint64 id, int64 due)
+{
+    char cmd[64];
+    double r = drand48();
+    int n;
+
+    if (r < pexpire) {
+        st.expired++;
+        return;
+    }
+    r -= pexpire;
+    if (r < prelease) {
+        n = snprintf(cmd, sizeof cmd, "release %" PRIu64 " 0 0\r\n", id);
+    } else if (r - prelease < pbury) {
+        n = snprintf(cmd, sizeof cmd, "bury %" PRIu64 " 0\r\n", id);
+    } else {
+        n = snprintf(cmd, sizeof cmd, "delete %" PRIu64 "\r\n", id);
+    }
+    emit(c, cmd, n);
+    c->acting = 1;
+    c->actdue = due;
+}
+
+// reply handles one complete reply at the start of c->in and returns
+// its length, or 0 if the reply is not all there yet.
+static size_t
+reply(Client *c, int64 t)
+{
+    char *nl = memchr(c->in, '\n', c->nin);
+    size_t len;
+    uint64 id;
+    int size;
+
+    if (!nl)
+        return 0;
+    len = nl - c->in + 1;
+
+    if (!c->worker) {
+        if (strncmp(c->in, "INSERTED ", 9) == 0) {
+            st.inserted++;
+            record(&hput, &maxput, t - popdue(c));
+        } else {
+            st.puterr++;
+            popdue(c);
+        }
+        return len;
+    }
+
+    if (c->acting) {
+        c->acting = 0;
+        if (strncmp(c->in, "DELETED", 7) == 0) {
+            st.deleted++;
+            record(&hdone, &maxdone, t - c->actdue);
+        } else if (strncmp(c->in, "RELEASED", 8) == 0) {
+            st.released++;
+        } else if (strncmp(c->in, "BURIED", 6) == 0) {
+            st.buried++;
+            record(&hdone, &maxdone, t - c->actdue);
+        } else {
+            st.acterr++;
+        }
+        return len;
+    }
+
+    if (sscanf(c->in, "RESERVED %" SCNu64 " %d", &id, &size) == 2) {
+        if (c->nin < len + size + 2)
+            return 0;
+        int64 due = strtoll(c->in + len, NULL, 10);
+        st.reserved++;
+        record(&hreserve, &maxreserve, t - due);
+        finish(c, id, due);
+        reserve(c);
+        return len + size + 2;
+    }
+    if (strncmp(c->in, "DEADLINE_SOON", 13) == 0) {
+        st.deadline++;
+        c->retry = t + Retry;
+    } else {
+        if (strncmp(c->in, "TIMED_OUT", 9) == 0)
+            st.timedout++;
+        else
+            st.acterr++;
+        reserve(c);
+    }
+    return len;
+}
+
+static void
+readall(Client *c)
+{
+    ssize_t r;
+    size_t n;
+    int64 t;
+
+    for (;;) {
+        grow(&c->in, &c->capin, c->nin + 65536);
+        r = read(c->fd, c->in + c->nin, c->capin - c->nin);
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (r == -1)
+            die("read");
+        if (r == 0)
+            diex("server closed the connection");
+        c->nin += r;
+    }
+    t = now();
+    while (c->nin && (n = reply(c, t))) {
+        memmove(c->in, c->in + n, c->nin - n);
+        c->nin -= n;
+    }
+}
+
+static void
+writeall(Client *c)
+{
+    ssize_t r;
+
+    while (c->nout) {
+        r = write(c->fd, c->out, c->nout);
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r == -1)
+            die("write");
+        memmove(c->out, c->out + r, c->nout - r);
+        c->nout -= r;
+    }
+}
+
+static void
+prlat(const char *name, Hist *h, int64 max)
+{
+    static const uint pcts[] = {500, 900, 990, 999};
+    static const char *names[] = {"p50", "p90", "p99", "p999"};
+    size_t i;
+
+    for (i = 0; i < sizeof pcts / sizeof pcts[0]; i++) {
+        printf("  \"%s-%s-ns\": %" PRIu64 ",\n", name, names[i],
+               hist_percentile(h, pcts[i]));
+    }
+    printf("  \"%s-max-ns\": %" PRId64 ",\n", name, max);
+}
+
+static void
+report(double elapsed, int drained)
+{
+    printf("{\n");
+    printf("  \"rate\": %g,\n", rate);
+    printf("  \"duration-s\": %g,\n", duration);
+    printf("  \"producers\": %d,\n", nprod);
+    printf("  \"workers\": %d,\n", nwork);
+    printf("  \"tubes\": %d,\n", ntube);
+    printf("  \"body-size\": \"%s\",\n", sizearg);
+    printf("  \"ttr\": %d,\n", ttr);
+    printf("  \"expire-fraction\": %g,\n", pexpire);
+    printf("  \"release-fraction\": %g,\n", prelease);
+    printf("  \"bury-fraction\": %g,\n", pbury);
+    printf("  \"elapsed-s\": %.3f,\n", elapsed);
+    printf("  \"drained\": %s,\n", drained ? "true" : "false");
+    printf("  \"puts-due\": %" PRId64 ",\n", st.due);
+    printf("  \"puts-inserted\": %" PRId64 ",\n", st.inserted);
+    printf("  \"put-errors\": %" PRId64 ",\n", st.puterr);
+    printf("  \"put-rate\": %.1f,\n", st.inserted / duration);
+    printf("  \"reserves\": %" PRId64 ",\n", st.reserved);
+    printf("  \"deletes\": %" PRId64 ",\n", st.deleted);
+    printf("  \"releases\": %" PRId64 ",\n", st.released);
+    printf("  \"buries\": %" PRId64 ",\n", st.buried);
+    printf("  \"expires\": %" PRId64 ",\n", st.expired);
+    printf("  \"reserve-timeouts\": %" PRId64 ",\n", st.timedout);
+    printf("  \"deadline-soon\": %" PRId64 ",\n", st.deadline);
+    printf("  \"worker-errors\": %" PRId64 ",\n", st.acterr);
+    prlat("put", &hput, maxput);
+    prlat("reserve", &hreserve, maxreserve);
+    prlat("done", &hdone, maxdone);
+    printf("  \"done-count\": %" PRIu64 "\n", hdone.count);
+    printf("}\n");
+}
+
+static double
+fraction(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    if (*end || v < 0 || v > 1)
+        diex("bad fraction");
+    return v;
+}
+
+static int
+count(const char *s)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    if (*end || v < 1 || v > 100000)
+        diex("bad count");
+    return v;
+}
+
+int
+main(int argc, char **argv)
+{
+    Client *cl;
+    struct pollfd *pfd;
+    char cmd[64];
+    int i, j, n, opt, nc, drained = 0;
+    int64 t0, t, end, stop, k = 0;
+
+    progname = argv[0];
+    while ((opt = getopt(argc, argv, "a:p:r:d:g:c:w:t:s:x:E:R:B:S:h")) != -1) {
+        switch (opt) {
+        case 'a': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'd': duration = strtod(optarg, NULL); break;
+        case 'g': grace = strtod(optarg, NULL); break;
+        case 'c': nprod = count(optarg); break;
+        case 'w': nwork = count(optarg); break;
+        case 't': ntube = count(optarg); break;
+        case 's': sizearg = optarg; break;
+        case 'x': ttr = count(optarg); break;
+        case 'E': pexpire = fraction(optarg); break;
+        case 'R': prelease = fraction(optarg); break;
+        case 'B': pbury = fraction(optarg); break;
+        case 'S': seed = strtol(optarg, NULL, 10); break;
+        case 'h': usage(0);
+        default: usage(2);
+        }
+    }
+    if (optind != argc)
+        usage(2);
+    if (rate <= 0 || duration <= 0 || grace < 0)
+        diex("rate and duration must be positive");
+    if (pexpire + prelease + pbury > 1)
+        diex("worker fractions add up to more than 1");
+    if (ntube > nprod)
+        diex("need at least one producer per tube");
+    parsesize(sizearg);
+    srand48(seed);
+
+    nc = nprod + nwork;
+    cl = calloc(nc, sizeof *cl);
+    pfd = calloc(nc, sizeof *pfd);
+    if (!cl || !pfd)
+        die("calloc");
+
+    // Producer i puts into tube i % ntube; workers watch every tube.
+    for (i = 0; i < nc; i++) {
+        Client *c = &cl[i];
+        c->fd = dial();
+        c->worker = i >= nprod;
+        if (!c->worker) {
+            snprintf(cmd, sizeof cmd, "use bsbench.%d\r\n", i % ntube);
+            setup(c, cmd, "USING ");
+        } else {
+            for (j = 0; j < ntube; j++) {
+                snprintf(cmd, sizeof cmd, "watch bsbench.%d\r\n", j);
+                setup(c, cmd, "WATCHING ");
+            }
+            setup(c, "ignore default\r\n", "WATCHING ");
+            reserve(c);
+        }
+        if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1)
+            die("fcntl");
+        pfd[i].fd = c->fd;
+    }
+
+    t0 = now();
+    end = t0 + (int64)(duration * 1e9);
+    stop = end + (int64)(grace * 1e9);
+    for (;;) {
+        t = now();
+        int64 next = stop;
+
+        // Queue every put that is due by now, on the next producer.
+        while (t < end) {
+            int64 due = t0 + (int64)(k * 1e9 / rate);
+            if (due >= end)
+                break;
+            if (due > t) {
+                next = due;
+                break;
+            }
+            putjob(&cl[k % nprod], due);
+            k++;
+        }
+
+        for (i = nprod; i < nc; i++) {
+            Client *c = &cl[i];
+            if (c->retry && c->retry <= t) {
+                c->retry = 0;
+                reserve(c);
+            }
+            if (c->retry && c->retry < next)
+                next = c->retry;
+        }
+
+        drained = t >= end && st.due == st.inserted + st.puterr &&
+                  st.deleted + st.buried == st.inserted;
+        if (drained || t >= stop)
+            break;
+
+        for (i = 0; i < nc; i++) {
+            writeall(&cl[i]);
+            pfd[i].events = POLLIN | (cl[i].nout ? POLLOUT : 0);
+        }
+        n = poll(pfd, nc, next > t ? (next - t + 999999) / 1000000 : 0);
+        if (n == -1 && errno != EINTR)
+            die("poll");
+        for (i = 0; i < nc && n > 0; i++) {
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                readall(&cl[i]);
+            if (pfd[i].revents & POLLOUT)
+                writeall(&cl[i]);
+        }
+    }
+
+    report((now() - t0) / 1e9, drained);
+    return 0;
+}
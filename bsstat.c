@@ -0,0 +1,181 @@
+// bsstat prints the stats file that beanstalkd writes with -S,
+// without connecting to the server. See Shmhdr in dat.h.
+
+#include "dat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// How many times to retry a copy torn by a concurrent write.
+#define TRIES 1000
+
+const char *progname;
+
+static void
+die(const char *what, const char *path)
+{
+    fprintf(stderr, "%s: %s %s: %s\n", progname, what, path, strerror(errno));
+    exit(1);
+}
+
+static void
+diex(const char *msg, const char *path)
+{
+    fprintf(stderr, "%s: %s: %s\n", progname, path, msg);
+    exit(1);
+}
+
+// snapshot copies a consistent view of the stats file at path
+// into a new buffer and returns it.
+static Shmhdr *
+snapshot(const char *path)
+{
+    int fd, i;
+    struct stat st;
+    size_t mapsize = 0, size;
+    Shmhdr *map = NULL, *copy = NULL;
+    uint64 seq;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        die("open", path);
+
+    for (i = 0; i < TRIES; i++) {
+        if (!map || map->size > mapsize) {
+            if (map)
+                munmap(map, mapsize);
+            if (fstat(fd, &st) == -1)
+                die("stat", path);
+            mapsize = st.st_size;
+            if (mapsize < sizeof(Shmhdr))
+                diex("not a stats file", path);
+            map = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+                die("mmap", path);
+            if (map->magic != Shmmagic)
+                diex("not a stats file", path);
+            if (map->version != Shmversion)
+                diex("unknown stats file version", path);
+            continue;
+        }
+
+        seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            usleep(10);
+            continue;
+        }
+        size = map->size;
+        if (size > mapsize)
+            continue;
+        free(copy);
+        copy = malloc(size);
+        if (!copy)
+            die("malloc", path);
+        memcpy(copy, map, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    if (i == TRIES)
+        diex("stats file keeps changing", path);
+
+    munmap(map, mapsize);
+    close(fd);
+    return copy;
+}
+
+static void
+pr(const char *name, uint64 v)
+{
+    printf("%s: %" PRIu64 "\n", name, v);
+}
+
+static void
+pri(const char *name, int64 v)
+{
+    printf("%s: %" PRId64 "\n", name, v);
+}
+
+int
+main(int argc, char **argv)
+{
+    Shmhdr *h;
+    struct timeval tv;
+    int64 now;
+    uint32 i;
+
+    progname = argv[0];
+    if (argc != 2) {
+        fprintf(stderr, "Use: %s FILE\n", progname);
+        return 2;
+    }
+    h = snapshot(argv[1]);
+    gettimeofday(&tv, 0);
+    now = (int64)tv.tv_sec * 1000000000 + (int64)tv.tv_usec * 1000;
+
+    printf("---\n");
+    pr("pid", h->pid);
+    pri("age-ms", (now - h->at) / 1000000);
+    pri("uptime", (h->at - h->started) / 1000000000);
+    pr("current-jobs-urgent", h->global.urgent);
+    pr("current-jobs-ready", h->global.ready);
+    pr("current-jobs-reserved", h->global.reserved);
+    pr("current-jobs-delayed", h->global.delayed);
+    pr("current-jobs-buried", h->global.buried);
+    pr("total-jobs", h->global.total_jobs);
+    pr("job-timeouts", h->global.timeouts);
+    pr("current-connections", h->global.conns);
+    pr("total-connections", h->global.total_conns);
+    pr("current-producers", h->global.producers);
+    pr("current-workers", h->global.workers);
+    pr("current-waiting", h->global.waiting);
+    pr("body-resident-bytes", h->global.body_resident);
+    printf("draining: %s\n", h->global.draining ? "true" : "false");
+    pri("binlog-oldest-index", h->wal.oldest);
+    pri("binlog-current-index", h->wal.current);
+    pri("binlog-records-written", h->wal.nrec);
+    pri("binlog-records-migrated", h->wal.nmig);
+    pri("binlog-writes", h->wal.nwrite);
+    pri("binlog-write-ns", h->wal.write_ns);
+    pri("binlog-syncs", h->wal.nsync);
+    pri("binlog-sync-ns", h->wal.sync_ns);
+    pri("binlog-compactions", h->wal.ncompact);
+    pri("binlog-compact-ns", h->wal.compact_ns);
+
+    printf("cmd:\n");
+    for (i = 1; i < h->nop && i < Shmops; i++) {
+        char *name = h->opname[i];
+        size_t n = strnlen(name, Shmopname);
+        if (n && name[n-1] == ' ')
+            n--;
+        printf("  %.*s: %" PRIu64 "\n", (int)n, name, h->op[i]);
+    }
+
+    printf("tubes:\n");
+    for (i = 0; i < h->ntube; i++) {
+        Shmtube *t = &h->tube[i];
+        printf("  %.*s:\n", (int)sizeof t->name, t->name);
+        printf("    current-jobs-urgent: %" PRIu64 "\n", t->urgent);
+        printf("    current-jobs-ready: %" PRIu64 "\n", t->ready);
+        printf("    current-jobs-reserved: %" PRIu64 "\n", t->reserved);
+        printf("    current-jobs-delayed: %" PRIu64 "\n", t->delayed);
+        printf("    current-jobs-buried: %" PRIu64 "\n", t->buried);
+        printf("    total-jobs: %" PRIu64 "\n", t->total_jobs);
+        printf("    current-using: %" PRIu64 "\n", t->using);
+        printf("    current-watching: %" PRIu64 "\n", t->watching);
+        printf("    current-waiting: %" PRIu64 "\n", t->waiting);
+        printf("    cmd-delete: %" PRIu64 "\n", t->deletes);
+        printf("    cmd-pause-tube: %" PRIu64 "\n", t->pauses);
+        printf("    pause-time-left: %" PRId64 "\n", t->pause_left / 1000000000);
+    }
+    free(h);
+    return 0;
+}
@@ -120,7 +120,14 @@ conntickat(Conn *c)
     int margin = 0, should_timeout = 0;
     int64 t = INT64_MAX;
 
-    if (conn_waiting(c)) {
+    // a kick in progress goes on at the next tick
+    if (c->kick_left) {
+        return nanoseconds();
+    }
+
+    // only a reserve is told of deadlines, not a subscribed
+    // connection waiting for pushes between commands
+    if (conn_waiting(c) && c->state == STATE_WAIT) {
         margin = SAFETY_MARGIN;
     }
 
@@ -183,12 +190,21 @@ connsoonestjob(Conn *c)
 
 void
 conn_reserve_job(Conn *c, Job *j) {
+    int64 now = nanoseconds();
+
     j->tube->stat.reserved_ct++;
+    if (!j->r.reserve_ct)
+        tube_record(j->tube, Histwait, now - j->r.created_at);
     j->r.reserve_ct++;
 
-    j->r.deadline_at = nanoseconds() + j->r.ttr;
+    j->reserved_at = now;
+    trace(Trreserve, c->sock.fd, j->r.id);
+    PROBE4(reserve, j->r.id, j->tube->name, j->r.body_size - 2,
+           now - j->r.created_at);
+    j->r.deadline_at = now + j->r.ttr;
     j->r.state = Reserved;
     job_list_insert(&c->reserved_jobs, j);
+    c->nreserved++;
     j->reserver = c;
     c->pending_timeout = -1;
     conn_set_soonestjob(c, j);
@@ -237,6 +253,7 @@ conn_setpos(void *c, size_t i)
 void
 connclose(Conn *c)
 {
+    trace(Trclose, c->sock.fd, 0);
     sockwant(&c->sock, 0);
     close(c->sock.fd);
     if (verbose) {
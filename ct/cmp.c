@@ -0,0 +1,292 @@
+/* cmp compares two files of benchmark results written by ct -o.
+ *
+ * For every benchmark and unit found in both files, it prints the
+ * mean and spread of the old and new samples, the change in the mean,
+ * and the p-value of Welch's t-test that the means are equal. A change
+ * whose p-value is not below alpha (0.05 unless -a says otherwise) is
+ * shown as "~". Run each benchmark several times (ct -count) to give
+ * the test something to work with. */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Series Series;
+
+enum { MaxSample = 100 };
+
+struct Series {
+    char   name[128];
+    char   unit[32];
+    int    n[2];
+    double v[2][MaxSample];
+};
+
+static Series *series;
+static int nseries, capseries;
+static double alpha = 0.05;
+
+
+static void
+die(const char *msg, const char *path)
+{
+    fprintf(stderr, "cmp: %s: %s\n", path, msg);
+    exit(1);
+}
+
+
+static Series *
+lookup(const char *name, const char *unit)
+{
+    int i;
+
+    for (i = 0; i < nseries; i++) {
+        if (strcmp(series[i].name, name) == 0 &&
+            strcmp(series[i].unit, unit) == 0) {
+            return &series[i];
+        }
+    }
+    if (nseries == capseries) {
+        capseries = capseries ? capseries * 2 : 64;
+        series = realloc(series, capseries * sizeof *series);
+        if (!series) {
+            die(strerror(errno), "realloc");
+        }
+    }
+    Series *s = &series[nseries++];
+    memset(s, 0, sizeof *s);
+    snprintf(s->name, sizeof s->name, "%s", name);
+    snprintf(s->unit, sizeof s->unit, "%s", unit);
+    return s;
+}
+
+
+/* quoted reads the JSON string at *p, which has no escapes in
+ * files written by ct, into buf. */
+static int
+quoted(char **p, char *buf, size_t size)
+{
+    char *end;
+
+    *p += strspn(*p, " \t,{:");
+    if (**p != '"' || !(end = strchr(*p + 1, '"'))) {
+        return 0;
+    }
+    snprintf(buf, size, "%.*s", (int)(end - *p - 1), *p + 1);
+    *p = end + 1;
+    return 1;
+}
+
+
+/* load reads the results in path as sample k of each series. Each
+ * line is a flat object with the benchmark name and numeric results. */
+static void
+load(const char *path, int k)
+{
+    char line[4096], key[64], name[128];
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        die(strerror(errno), path);
+    }
+    while (fgets(line, sizeof line, f)) {
+        char *p = line;
+        if (!quoted(&p, key, sizeof key) || strcmp(key, "name") != 0 ||
+            !quoted(&p, name, sizeof name)) {
+            die("not a ct result line", path);
+        }
+        while (quoted(&p, key, sizeof key)) {
+            p += strspn(p, " \t:");
+            double v = strtod(p, &p);
+            if (strcmp(key, "n") == 0) {
+                continue;
+            }
+            Series *s = lookup(name, key);
+            if (s->n[k] < MaxSample) {
+                s->v[k][s->n[k]++] = v;
+            }
+        }
+    }
+    fclose(f);
+}
+
+
+static void
+stats(double *v, int n, double *mean, double *var)
+{
+    double sum = 0, sq = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += v[i];
+    }
+    *mean = sum / n;
+    for (i = 0; i < n; i++) {
+        sq += (v[i] - *mean) * (v[i] - *mean);
+    }
+    *var = n > 1 ? sq / (n - 1) : 0;
+}
+
+
+/* betacf evaluates the continued fraction for the incomplete beta
+ * function by the modified Lentz method. */
+static double
+betacf(double a, double b, double x)
+{
+    const double eps = 1e-12, tiny = 1e-300;
+    double c = 1, d = 1 - (a + b) * x / (a + 1), h;
+    int m;
+
+    if (fabs(d) < tiny) {
+        d = tiny;
+    }
+    d = 1 / d;
+    h = d;
+    for (m = 1; m <= 300; m++) {
+        int m2 = 2 * m;
+        double aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+        d = 1 + aa * d;
+        c = 1 + aa / c;
+        if (fabs(d) < tiny) d = tiny;
+        if (fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        h *= d * c;
+        aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+        d = 1 + aa * d;
+        c = 1 + aa / c;
+        if (fabs(d) < tiny) d = tiny;
+        if (fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        double del = d * c;
+        h *= del;
+        if (fabs(del - 1) < eps) {
+            break;
+        }
+    }
+    return h;
+}
+
+
+/* ibeta returns the regularized incomplete beta function I_x(a, b). */
+static double
+ibeta(double a, double b, double x)
+{
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    double bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+                    a * log(x) + b * log(1 - x));
+    if (x < (a + 1) / (a + b + 2)) {
+        return bt * betacf(a, b, x) / a;
+    }
+    return 1 - bt * betacf(b, a, 1 - x) / b;
+}
+
+
+/* welch returns the two-sided p-value of Welch's t-test for the
+ * means of s, or -1 if either side has fewer than two samples. */
+static double
+welch(Series *s)
+{
+    double m0, v0, m1, v1;
+    int n0 = s->n[0], n1 = s->n[1];
+
+    if (n0 < 2 || n1 < 2) {
+        return -1;
+    }
+    stats(s->v[0], n0, &m0, &v0);
+    stats(s->v[1], n1, &m1, &v1);
+    double e0 = v0 / n0, e1 = v1 / n1;
+    if (e0 + e1 == 0) {
+        return m0 == m1 ? 1 : 0;
+    }
+    double t = (m0 - m1) / sqrt(e0 + e1);
+    double df = (e0 + e1) * (e0 + e1) /
+                (e0 * e0 / (n0 - 1) + e1 * e1 / (n1 - 1));
+    return ibeta(df / 2, 0.5, df / (df + t * t));
+}
+
+
+/* fmtval formats the mean and relative spread of one side of s. */
+static void
+fmtval(char *buf, size_t size, double *v, int n)
+{
+    double mean, var;
+
+    stats(v, n, &mean, &var);
+    if (mean == 0 || n < 2) {
+        snprintf(buf, size, "%.4g", mean);
+    } else {
+        snprintf(buf, size, "%.4g ±%.0f%%", mean, 100 * sqrt(var) / fabs(mean));
+    }
+}
+
+
+static void
+report(const char *unit)
+{
+    char old[64], new[64], delta[64];
+    int i, header = 0;
+
+    for (i = 0; i < nseries; i++) {
+        Series *s = &series[i];
+        if (strcmp(s->unit, unit) != 0 || !s->n[0] || !s->n[1]) {
+            continue;
+        }
+        if (!header) {
+            printf("\n%-44s %20s %20s  %s\n", "name", "old", "new", unit);
+            header = 1;
+        }
+        double m0, m1, var;
+        stats(s->v[0], s->n[0], &m0, &var);
+        stats(s->v[1], s->n[1], &m1, &var);
+        fmtval(old, sizeof old, s->v[0], s->n[0]);
+        fmtval(new, sizeof new, s->v[1], s->n[1]);
+        double p = welch(s);
+        if (p < 0) {
+            snprintf(delta, sizeof delta, "? (n=%d+%d)", s->n[0], s->n[1]);
+        } else if (p >= alpha) {
+            snprintf(delta, sizeof delta, "~ (p=%.3f n=%d+%d)",
+                     p, s->n[0], s->n[1]);
+        } else if (m0 == 0) {
+            snprintf(delta, sizeof delta, "new (p=%.3f n=%d+%d)",
+                     p, s->n[0], s->n[1]);
+        } else {
+            snprintf(delta, sizeof delta, "%+.2f%% (p=%.3f n=%d+%d)",
+                     100 * (m1 - m0) / m0, p, s->n[0], s->n[1]);
+        }
+        printf("%-44s %20s %20s  %s\n", s->name, old, new, delta);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int i, j, a = 1;
+
+    if (argc == 5 && strcmp(argv[1], "-a") == 0) {
+        alpha = strtod(argv[2], NULL);
+        a = 3;
+    }
+    if (argc - a != 2 || alpha <= 0 || alpha >= 1) {
+        fprintf(stderr, "usage: %s [-a alpha] old new\n", argv[0]);
+        return 2;
+    }
+    load(argv[a], 0);
+    load(argv[a + 1], 1);
+
+    /* One table per unit, in the order the units first appear. */
+    for (i = 0; i < nseries; i++) {
+        for (j = 0; j < i; j++) {
+            if (strcmp(series[j].unit, series[i].unit) == 0) {
+                break;
+            }
+        }
+        if (j == i) {
+            report(series[i].unit);
+        }
+    }
+    return 0;
+}
@@ -25,6 +25,10 @@ int fail = 0; /* bool */
 static int64 bstart, bdur;
 static int btiming; /* bool */
 static int64 bbytes;
+static int nmetric;
+static Metric metric[MaxMetric];
+static int64 nalloc, balloc;
+static FILE *jsonout;
 enum { Second = 1000 * 1000 * 1000 };
 enum { BenchTime = Second };
 enum { MaxN = 1000 * 1000 * 1000 };
@@ -53,6 +57,54 @@ nstime()
 
 #endif
 
+#ifdef CT_WRAP_ALLOC
+
+/* The test binary is linked with -Wl,--wrap for malloc, calloc and
+ * realloc (see the Makefile), so the calls the code under test makes
+ * to them come here. While the benchmark timer runs, each call counts
+ * as one allocation of the bytes it asks for. So B/op and allocs/op
+ * measure allocation traffic, not memory in use: free is not counted,
+ * and neither are allocations made inside the C library or in other
+ * processes, such as a forked server. */
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *
+__wrap_malloc(size_t n)
+{
+    if (btiming) {
+        nalloc++;
+        balloc += n;
+    }
+    return __real_malloc(n);
+}
+
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    if (btiming) {
+        nalloc++;
+        balloc += n * size;
+    }
+    return __real_calloc(n, size);
+}
+
+
+void *
+__wrap_realloc(void *p, size_t n)
+{
+    if (btiming) {
+        nalloc++;
+        balloc += n;
+    }
+    return __real_realloc(p, n);
+}
+
+#endif
+
+
 void
 ctlogpn(const char *p, int n, const char *fmt, ...)
 {
@@ -93,6 +145,7 @@ ctresettimer(void)
 {
     bdur = 0;
     bstart = nstime();
+    nalloc = balloc = 0;
 }
 
 
@@ -123,6 +176,29 @@ ctsetbytes(int n)
 }
 
 
+/* ctmetric reports v, measured in unit, with the result of this
+ * benchmark. Reporting the same unit again replaces its value.
+ * A unit can be at most 15 chars. */
+void
+ctmetric(const char *unit, int64 v)
+{
+    int i;
+
+    for (i = 0; i < nmetric; i++) {
+        if (strcmp(metric[i].unit, unit) == 0) {
+            metric[i].v = v;
+            return;
+        }
+    }
+    if (nmetric == MaxMetric) {
+        return;
+    }
+    assert(strlen(unit) < sizeof metric[nmetric].unit);
+    strcpy(metric[nmetric].unit, unit);
+    metric[nmetric++].v = v;
+}
+
+
 static void
 die(int code, int err, const char *msg)
 {
@@ -329,6 +405,17 @@ runbenchn(Benchmark *b, int n)
         if (write(durfd, &bbytes, sizeof bbytes) != sizeof bbytes) {
             die(3, errno, "write");
         }
+        if (write(durfd, &nmetric, sizeof nmetric) != sizeof nmetric) {
+            die(3, errno, "write");
+        }
+        if (write(durfd, metric, nmetric * sizeof *metric) !=
+            (ssize_t)(nmetric * sizeof *metric)) {
+            die(3, errno, "write");
+        }
+        if (write(durfd, &nalloc, sizeof nalloc) != sizeof nalloc ||
+            write(durfd, &balloc, sizeof balloc) != sizeof balloc) {
+            die(3, errno, "write");
+        }
         exit(0);
     }
     setpgid(pid, pid);
@@ -357,6 +444,22 @@ runbenchn(Benchmark *b, int n)
         perror("read");
         b->status = 1;
     }
+    r = read(durfd, &b->nmetric, sizeof b->nmetric);
+    if (r != sizeof b->nmetric || b->nmetric < 0 || b->nmetric > MaxMetric) {
+        perror("read");
+        b->status = 1;
+        return;
+    }
+    r = read(durfd, b->metric, b->nmetric * sizeof *b->metric);
+    if (r != (int)(b->nmetric * sizeof *b->metric)) {
+        perror("read");
+        b->status = 1;
+    }
+    if (read(durfd, &b->nalloc, sizeof b->nalloc) != sizeof b->nalloc ||
+        read(durfd, &b->balloc, sizeof b->balloc) != sizeof b->balloc) {
+        perror("read");
+        b->status = 1;
+    }
 }
 
 
@@ -416,6 +519,41 @@ max(int a, int b)
 }
 
 
+/* mbps returns the throughput of n runs of b in megabytes per second. */
+static double
+mbps(Benchmark *b, int n)
+{
+    if (b->dur <= 0) {
+        return 0;
+    }
+    return ((double)b->bytes * (double)n / 1000000) / ((double)b->dur / Second);
+}
+
+
+/* writejson writes the result of b as one JSON object per line. */
+static void
+writejson(Benchmark *b, int n)
+{
+    int i;
+
+    fprintf(jsonout, "{\"name\": \"%s\", \"n\": %d, \"ns/op\": %.2f",
+            b->name, n, (double)b->dur / n);
+    if (b->bytes > 0) {
+        fprintf(jsonout, ", \"MB/s\": %.2f", mbps(b, n));
+    }
+#ifdef CT_WRAP_ALLOC
+    fprintf(jsonout, ", \"B/op\": %.2f, \"allocs/op\": %.2f",
+            (double)b->balloc / n, (double)b->nalloc / n);
+#endif
+    for (i = 0; i < b->nmetric; i++) {
+        fprintf(jsonout, ", \"%s\": %" PRId64, b->metric[i].unit,
+                b->metric[i].v);
+    }
+    fputs("}\n", jsonout);
+    fflush(jsonout);
+}
+
+
 static void
 runbench(Benchmark *b)
 {
@@ -443,16 +581,21 @@ runbench(Benchmark *b)
     if (b->status == 0) {
         printf("%8d\t%10" PRId64 " ns/op", n, b->dur/n);
         if (b->bytes > 0) {
-            double mbs = 0;
-            if (b->dur > 0) {
-                int64 sec = b->dur / 1000L / 1000L / 1000L;
-                int64 nsec = b->dur % 1000000000L;
-                double dur = (double)sec + (double)nsec*.0000000001;
-                mbs = ((double)b->bytes * (double)n / 1000000) / dur;
-            }
-            printf("\t%7.2f MB/s", mbs);
+            printf("\t%7.2f MB/s", mbps(b, n));
+        }
+#ifdef CT_WRAP_ALLOC
+        printf("\t%8" PRId64 " B/op\t%8" PRId64 " allocs/op",
+               b->balloc/n, b->nalloc/n);
+#endif
+        int i;
+        for (i = 0; i < b->nmetric; i++) {
+            printf("\t%10" PRId64 " %s", b->metric[i].v, b->metric[i].unit);
         }
         putchar('\n');
+        fflush(stdout);
+        if (jsonout) {
+            writejson(b, n);
+        }
     } else {
         if (failed(b->status)) {
             printf("failure");
@@ -470,11 +613,19 @@ runbench(Benchmark *b)
 }
 
 
+/* runallbench runs each benchmark whose name contains pat count times. */
 static void
-runallbench(Benchmark *b)
+runallbench(Benchmark *b, const char *pat, int count)
 {
+    int i;
+
     for (; b->f; b++) {
-        runbench(b);
+        if (!strstr(b->name, pat)) {
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            runbench(b);
+        }
     }
 }
 
@@ -557,9 +708,40 @@ writetokens(int n)
 }
 
 
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b [-count n] [-o file] [pattern]]\n", name);
+    exit(2);
+}
+
+
 int
 main(int argc, char **argv)
 {
+    int i, bench = 0, count = 1;
+    const char *pat = "", *out = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "-count") == 0 && i+1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            out = argv[++i];
+        } else if (argv[i][0] != '-') {
+            pat = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (count < 1 || ((out || *pat) && !bench)) {
+        usage(argv[0]);
+    }
+    if (out && !(jsonout = fopen(out, "w"))) {
+        die(1, errno, out);
+    }
+
     int n = readtokens();
     runalltest(ctmaintest, n);
     writetokens(n);
@@ -567,8 +749,11 @@ main(int argc, char **argv)
     if (code != 0) {
         return code;
     }
-    if (argc == 2 && strcmp(argv[1], "-b") == 0) {
-        runallbench(ctmainbench);
+    if (bench) {
+        runallbench(ctmainbench, pat, count);
+    }
+    if (jsonout) {
+        fclose(jsonout);
     }
     return 0;
 }
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 char *ctdir(void);
 void  ctfail(void);
 void  ctfailnow(void);
@@ -5,6 +7,7 @@ void  ctresettimer(void);
 void  ctstarttimer(void);
 void  ctstoptimer(void);
 void  ctsetbytes(int);
+void  ctmetric(const char *unit, int64_t v);
 void  ctlogpn(const char*, int, const char*, ...) __attribute__((format(printf, 3, 4)));
 #define ctlog(...) ctlogpn(__FILE__, __LINE__, __VA_ARGS__)
 #define assert(x) do if (!(x)) {\
@@ -5,6 +5,14 @@
 typedef int64_t int64;
 typedef struct Test Test;
 typedef struct Benchmark Benchmark;
+typedef struct Metric Metric;
+
+enum { MaxMetric = 8 };
+
+struct Metric {
+    char  unit[16];
+    int64 v;
+};
 
 struct Test {
     void (*f)(void);
@@ -22,6 +30,9 @@ struct Benchmark {
     int64 dur;
     int64 bytes;
     char  dir[sizeof TmpDirPat];
+    int   nmetric;
+    Metric metric[MaxMetric];
+    int64 nalloc, balloc; // allocations made while timing, and their bytes
 };
 
 extern Test ctmaintest[];
@@ -14,10 +14,14 @@ typedef struct Job    Job;
 typedef struct Tube   Tube;
 typedef struct Conn   Conn;
 typedef struct Heap   Heap;
+typedef struct Hist   Hist;
 typedef struct Jobrec Jobrec;
 typedef struct File   File;
 typedef struct Socket Socket;
 typedef struct Server Server;
+typedef struct Trace  Trace;
+typedef struct Shmhdr Shmhdr;
+typedef struct Shmtube Shmtube;
 typedef struct Wal    Wal;
 
 typedef void(*Handle)(void*, int rw);
@@ -44,10 +48,14 @@ typedef int(FAlloc)(int, int);
 // The name of a tube cannot be longer than MAX_TUBE_NAME_LEN-1
 #define MAX_TUBE_NAME_LEN 201
 
+// Size of the fixed header of a binary protocol request, see prot.c.
+#define BIN_REQ_SIZE 28
+
 // A command can be at most LINE_BUF_SIZE chars, including "\r\n". This value
-// MUST be enough to hold the longest possible command ("pause-tube a{200} 4294967295\r\n")
-// or reply line ("USING a{200}\r\n").
-#define LINE_BUF_SIZE (11 + MAX_TUBE_NAME_LEN + 12)
+// MUST be enough to hold the longest possible command
+// ("stats-tubes a{200} a{200} 4294967295 json\r\n", 431 chars),
+// binary request (header and a tube name) or reply line ("USING a{200}\r\n").
+#define LINE_BUF_SIZE (2 * MAX_TUBE_NAME_LEN + 29)
 
 #define min(a,b) ((a)<(b)?(a):(b))
 
@@ -68,6 +76,34 @@ typedef int(FAlloc)(int, int);
 // Use this macro to designate unused parameters in functions.
 #define UNUSED_PARAMETER(x) (void)(x)
 
+// USDT probes for bpftrace, perf and the like; build with
+// "make USE_SDT=yes" to get them. They cost a NOP until a tracer
+// attaches. Otherwise they compile to nothing, and their arguments
+// are not evaluated. The probes of provider beanstalkd are:
+//
+//   enqueue(id, tube, size, delay)      job made ready or delayed
+//   reserve(id, tube, size, age)        age is ns since the put
+//   delete(id, tube, size, held)        held is ns since the reserve
+//   bury(id, tube, size)
+//   walwrite(id, tube, size, state)     binlog record for a job
+//   fsync(seq, ns)                      binlog file seq was synced
+//   rotate(seq)                         binlog moved to file seq
+//   promote(n, ns)                      prottick made n delayed jobs ready
+//
+// Times are in nanoseconds; held is 0 if the job was not reserved.
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(n, a)          DTRACE_PROBE1(beanstalkd, n, a)
+#define PROBE2(n, a, b)       DTRACE_PROBE2(beanstalkd, n, a, b)
+#define PROBE3(n, a, b, c)    DTRACE_PROBE3(beanstalkd, n, a, b, c)
+#define PROBE4(n, a, b, c, d) DTRACE_PROBE4(beanstalkd, n, a, b, c, d)
+#else
+#define PROBE1(n, a)
+#define PROBE2(n, a, b)
+#define PROBE3(n, a, b, c)
+#define PROBE4(n, a, b, c, d)
+#endif
+
 // version is defined in vers.c, see vers.sh for details.
 extern const char version[];
 
@@ -108,6 +144,145 @@ struct Heap {
 };
 int   heapinsert(Heap *h, void *x);
 void* heapremove(Heap *h, size_t k);
+void  heapfree(Heap *h);
+
+extern size_t heap_bytes;
+
+
+// A log-bucketed histogram, see hist.c. The buckets are about 25% wide
+// and cover values up to 2^48, which is 78 hours in nanoseconds.
+#define HIST_BUCKETS 188
+
+struct Hist {
+    uint64 count;
+    uint64 bucket[HIST_BUCKETS];
+};
+void   hist_record(Hist *h, uint64 v);
+uint64 hist_percentile(Hist *h, uint permille);
+
+enum // the histograms kept for each tube and for the server
+{
+    Histwait,    // ns from put to first reserve
+    Histservice, // ns from reserve to delete
+    Histsize,    // body size of put jobs, in bytes
+    Nhist
+};
+
+
+// The flight recorder, see trace.c.
+enum
+{
+    Tracesize = 4096, // events kept; must be a power of two
+    Tracebinsize = 24, // bytes per event in the binary dump
+};
+
+enum // Trace.kind
+{
+    Traccept,    // fd is the new conn
+    Trclose,     // fd is the closed conn
+    Trput,       // id is the new job
+    Trreserve,   // id is the reserved job
+    Trdelete,    // id is the deleted job
+    Trtimeout,   // id is the job whose ttr ran out
+    Trrotate,    // id is the seq of the binlog file now written
+    Trsyncstart, // id is the seq of the binlog file synced
+    Trsyncend,   // as Trsyncstart
+    Trcompact,   // id is the job moved out of the oldest binlog file
+    Ntracekind
+};
+
+struct Trace {
+    int64  at; // when, in nsec
+    uint64 id;
+    int32  kind;
+    int32  fd; // the conn, or -1
+};
+void   trace(int kind, int fd, uint64 id);
+size_t tracesize(int binary);
+size_t tracefmt(char *buf, int binary);
+void   tracewrite(int fd);
+void   tracewant(int sig);
+int    tracedue(void);
+
+
+// The layout of the stats file, see -S and shm.c. All fields
+// are in host byte order. Readers must check magic and version,
+// and copy the file between two reads of an even, unchanged seq.
+enum
+{
+    Shmmagic   = 0x6b747362, // "bstk" when little-endian
+    Shmversion = 1,
+    Shmperiod  = 100000000, // write the file every 100ms
+    Shmops     = 64,        // room in Shmhdr.op
+    Shmopname  = 24,
+    Shmtubemin = 16,        // initial room for tubes
+};
+
+struct Shmtube {
+    char   name[208]; // NUL-terminated, MAX_TUBE_NAME_LEN padded
+    uint64 urgent;
+    uint64 ready;
+    uint64 reserved;
+    uint64 delayed;
+    uint64 buried;
+    uint64 total_jobs;
+    uint64 using;
+    uint64 watching;
+    uint64 waiting;
+    uint64 deletes;
+    uint64 pauses;
+    int64  pause_left; // nsec until the tube is unpaused, or 0
+};
+
+struct Shmhdr {
+    uint32 magic;
+    uint32 version;
+    uint64 seq;     // odd while the server writes
+    uint64 size;    // bytes in the file
+    int64  at;      // when last written, in nsec since the epoch
+    int64  started; // when the server started, likewise
+    uint32 pid;
+    uint32 nop;     // entries used in op and opname
+    uint32 ntube;   // entries used in tube
+    uint32 tubecap; // room in tube before the file must grow
+
+    struct {
+        uint64 urgent;
+        uint64 ready;
+        uint64 reserved;
+        uint64 delayed;
+        uint64 buried;
+        uint64 total_jobs;
+        uint64 timeouts;
+        uint64 conns;
+        uint64 total_conns;
+        uint64 producers;
+        uint64 workers;
+        uint64 waiting;
+        uint64 body_resident;
+        uint64 draining;
+    } global;
+
+    struct {
+        int64 oldest;   // index of the oldest binlog file
+        int64 current;  // index of the binlog file written
+        int64 nrec;
+        int64 nmig;
+        int64 nwrite;
+        int64 write_ns;
+        int64 nsync;
+        int64 sync_ns;
+        int64 ncompact;
+        int64 compact_ns;
+    } wal;
+
+    uint64 op[Shmops];
+    char   opname[Shmops][Shmopname];
+    Shmtube tube[];
+};
+int     shmopen(char *path);
+Shmhdr* shmbegin(uint32 ntube);
+void    shmend(Shmhdr *h);
 
 
 struct Socket {
@@ -163,6 +338,8 @@ int ms_remove(Ms *a, void *item);
 int ms_contains(Ms *a, void *item);
 void *ms_take(Ms *a);
 
+extern size_t ms_bytes;
+
 
 enum // Jobrec.state
 {
@@ -231,14 +408,27 @@ struct Job {
     Job *prev, *next;           // linked list of jobs
     Job *ht_next;               // Next job in a hash table list
     size_t heap_index;          // where is this job in its current heap
+    int64 reserved_at;          // when the job was last reserved, in nsec
     File *file;
     Job  *fnext;
     Job  *fprev;
     void *reserver;
     int walresv;
     int walused;
+    byte durability;            // Dur* class of its tube when it was put
+    int  bodyoff;               // where the body starts in file, or 0
+    Job  *cnext, *cprev;        // cold jobs with bodies, see job_body_trim
 
-    char *body;                 // written separately to the wal
+    char *body;                 // written separately to the wal;
+                                // NULL if dropped, see job_body_trim
+};
+
+enum // Tube.durability
+{
+    Durdefault,  // follow the -f and -F flags
+    Durnone,     // jobs are never written to the wal
+    Durbuffered, // jobs are written to the wal, but never cause an fsync
+    Durfsync     // every write of a job is followed by an fsync
 };
 
 struct Tube {
@@ -257,7 +447,13 @@ struct Tube {
     // unpause_at is a timestamp when to unpause the tube, in nsec.
     int64 unpause_at;
 
+    // durability is one of Dur* values; it applies to jobs put
+    // into the tube after it was set.
+    byte durability;
+
     Job buried;                 // linked list header
+
+    Hist *hist;                 // Nhist histograms, or NULL until first used
 };
 
 
@@ -283,6 +479,8 @@ void warn(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void warnx(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 char* fmtalloc(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void* zalloc(int n);
+char* fmtu64(char *p, uint64 v);
+char* fmti64(char *p, int64 v);
 #define new(T) zalloc(sizeof(T))
 void optparse(Server*, char**);
 
@@ -298,6 +496,8 @@ int   rawfalloc(int fd, int len);
 Job *allocate_job(int body_size);
 Job *make_job_with_id(uint pri, int64 delay, int64 ttr,
                       int body_size, Tube *tube, uint64 id);
+Job *make_job_on_disk(uint pri, int64 delay, int64 ttr,
+                      int body_size, Tube *tube, uint64 id);
 void job_free(Job *j);
 
 /* Lookup a job by job ID */
@@ -310,6 +510,15 @@ int job_delay_less(void *ja, void *jb);
 
 Job *job_copy(Job *j);
 
+extern size_t body_budget;
+extern size_t body_resident;
+extern uint64 body_hit_ct;
+extern uint64 body_miss_ct;
+extern uint64 body_evict_ct;
+int  job_body_drop(Job *j);
+void job_body_trim(Job *j);
+int  job_body_load(Job *j);
+
 const char * job_state(Job *j);
 
 void job_list_reset(Job *head);
@@ -320,6 +529,8 @@ void job_list_insert(Job *head, Job *j);
 /* for unit tests */
 size_t get_all_jobs_used(void);
 
+size_t job_hash_bytes(void);
+
 
 extern struct Ms tubes;
 
@@ -328,6 +539,11 @@ void  tube_dref(Tube *t);
 void  tube_iref(Tube *t);
 Tube *tube_find(const char *name);
 Tube *tube_find_or_make(const char *name);
+void  tube_setdurability(Tube *t, int d);
+void  tube_record(Tube *t, int k, uint64 v);
+extern Hist hist_all[Nhist];
+const char *durname(int d);
+int   durparse(const char *name);
 #define TUBE_ASSIGN(a,b) (tube_dref(a), (a) = (b), tube_iref(a))
 
 
@@ -343,9 +559,11 @@ extern size_t primes[];
 
 
 extern size_t job_data_size_limit;
+extern size_t mem_limit;
 
 void prot_init(void);
 int64 prottick(Server *s);
+void  prot_publish(Server *s);
 
 void remove_waiting_conn(Conn *c);
 
@@ -354,10 +572,23 @@ void enqueue_reserved_jobs(Conn *c);
 void enter_drain_mode(int sig);
 void h_accept(const int fd, const short which, Server *s);
 int  prot_replay(Server *s, Job *list);
+const char *prot_parse(const char *line, int size);
 
 
 int make_server_socket(char *host, char *port);
+int make_bin_socket(char *host, char *port);
+
 
+// Connection can be in one of these states:
+#define STATE_WANT_COMMAND  0  // conn expects a command from the client
+#define STATE_WANT_DATA     1  // conn expects a job data
+#define STATE_SEND_JOB      2  // conn sends job to the client
+#define STATE_SEND_WORD     3  // conn sends a line reply
+#define STATE_WAIT          4  // client awaits for the job reservation
+#define STATE_BITBUCKET     5  // conn discards content
+#define STATE_CLOSE         6  // conn should be closed
+#define STATE_WANT_ENDLINE  7  // skip until the end of a line
+#define STATE_KICK          8  // conn kicks jobs in chunks, see kick_chunk
 
 // CONN_TYPE_* are bit masks used to track the type of connection.
 // A put command adds the PRODUCER type, "reserve*" adds the WORKER type.
@@ -378,6 +609,7 @@ struct Conn {
     byte   in_conns;    // 1 if the conn is in srv->conns heap, 0 otherwise
     Job    *soonest_job;// memoization of the soonest job
     int    rw;          // currently want: 'r', 'w', or 'h'
+    byte   bin;         // 1 if the conn speaks the binary protocol
 
     // How long client should "wait" for the next job; -1 means forever.
     int    pending_timeout;
@@ -400,12 +632,24 @@ struct Conn {
     // remain to be thrown away.
     int64 in_job_read;
     Job   *in_job;              // a job to be read from the client
+    byte  in_op;                // the command in_job is read for
+    uint  in_count;             // number of jobs in a put-batch
 
     Job *out_job;               // a job to be sent to the client
     int out_job_sent;           // how many bytes of *out_job were sent already
 
     Ms  watch;                  // the set of watched tubes by the connection
     Job reserved_jobs;          // linked list header
+
+    // Progress of a kick done in chunks.
+    uint kick_left;             // jobs still to kick
+    uint kick_done;             // jobs kicked so far
+    byte kick_buried;           // kicking buried (1) or delayed (0) jobs
+
+    uint want_jobs;             // jobs wanted by a waiting reserve-many
+
+    uint nreserved;             // number of jobs in reserved_jobs
+    uint credits;               // most jobs pushed after subscribe, or 0
 };
 int  conn_less(void *ca, void *cb);
 void conn_setpos(void *c, size_t i);
@@ -424,7 +668,8 @@ void conn_reserve_job(Conn *c, Job *j);
 
 enum
 {
-    Filesizedef = (10 << 20)
+    Filesizedef = (10 << 20),
+    Maxwal = 256, // most binlog partitions, see -k
 };
 
 struct Wal {
@@ -440,17 +685,32 @@ struct Wal {
     int64  alive; // bytes in use
     int64  nmig;  // migrations
     int64  nrec;  // records written ever
+    int64  nwrite, write_ns;     // write calls and the time spent in them
+    int64  nsync, sync_ns;       // fsync calls and the time spent in them
+    int64  ncompact, compact_ns; // compactions and the time spent in them
     int    wantsync; // do we sync to disk?
     int64  syncrate; // how often we sync to disk, in nanoseconds
     int64  lastsync;
+    int    needsync; // records written since lastsync want a periodic fsync
+    int    syncnow;  // records written since lastsync want an fsync right away
+    int    batch;    // records are held in wbuf until the batch ends
+    char   *wbuf;    // records not yet written to cur, see walbatch
+    int    wlen;
+    int    wcap;
 };
 int  waldirlock(Wal*);
 void walinit(Wal*, Job *list);
 int  walwrite(Wal*, Job*);
 void walmaint(Wal*);
+void walbatch(Wal*, int on);
+int  walflush(Wal*);
+int  walbuffer(Wal*, void *buf, int len);
 int  walresvput(Wal*, Job*);
-int  walresvupdate(Wal*);
+int  walresvupdate(Wal*, Job*);
 void walgc(Wal*);
+int  walsavedur(Wal*);
+void walloaddur(Wal*);
+Wal* walpart(Wal*, int n);
 
 
 struct File {
@@ -459,6 +719,7 @@ struct File {
     int  seq;
     int  iswopen; // is open for writing
     int  fd;
+    int  rfd;     // open for reading bodies back, or -1
     int  free;
     int  resv;
     char *path;
@@ -472,6 +733,7 @@ void fileincref(File*);
 void filedecref(File*);
 void fileaddjob(File*, Job*);
 void filermjob(File*, Job*);
+int  filereadbody(File*, Job*, char *body);
 int  fileread(File*, Job *list);
 void filewopen(File*);
 void filewclose(File*);
@@ -481,17 +743,45 @@ int  filewrjobfull(File*, Job*);
 
 #define Portdef "11300"
 
+// Loopstat counts where the event loop of a server spends its time.
+// An iteration is busy for the time it does not wait in socknext.
+struct Loopstat {
+    uint64 iter;    // iterations
+    uint64 events;  // iterations that handled a socket event
+    uint64 slow;    // iterations busy for Slowloop or more
+    int64  busy_ns; // total busy time
+    int64  tick_ns; // total time in prottick
+    Hist   busy;    // busy time of each iteration, in nsec
+    Hist   tick;    // time of each prottick, in nsec
+};
+
+enum
+{
+    Slowloop = 1000000, // 1ms, see Loopstat.slow
+};
+
 struct Server {
     char *port;
     char *addr;
     char *user;
 
     Wal    wal;
+    int    nwal;  // number of binlog partitions, see -k
+    Wal    *wals; // the partitions; just &wal when nwal is 1
     Socket sock;
 
+    char   *binport; // port for the binary protocol, see -P
+    Socket binsock;
+
+    char   *shmpath; // stats file, see -S
+
     // Connections that must produce deadline or timeout, ordered by the time.
     Heap   conns;
+
+    struct Loopstat loop;
 };
 void srv_acquire_wal(Server *s);
+Wal* srvwal(Server *s, Job *j);
 void srvserve(Server *s);
 void srvaccept(Server *s, int ev);
+void srvacceptbin(Server *s, int ev);
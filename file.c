@@ -15,6 +15,8 @@
 static int  readrec(File*, Job *, int*);
 static int  readrec5(File*, Job *, int*);
 static int  readfull(File*, void*, int, int*, char*);
+static int  skipfull(File*, int, int*, char*);
+static void setdur(Job*);
 static void warnpos(File*, int, char*, ...)
 __attribute__((format(printf, 3, 4)));
 
@@ -150,6 +152,17 @@ fileread(File *f, Job *list)
 }
 
 
+// setdur gives j, read back from the binlog, the durability class
+// of its tube. The class j was put under is not in the binlog, but it
+// was not Durnone, or j would not be there.
+static void
+setdur(Job *j)
+{
+    if (j->tube->durability != Durnone)
+        j->durability = j->tube->durability;
+}
+
+
 // Readrec reads a record from f->fd into linked list l.
 // If an error occurs, it sets *err to 1.
 // Readrec returns the number of records read, either 1 or 0.
@@ -231,9 +244,10 @@ readrec(File *f, Job *l, int *err)
                 goto Error;
             }
             t = tube_find_or_make(tubename);
-            j = make_job_with_id(jr.pri, jr.delay, jr.ttr, jr.body_size,
+            j = make_job_on_disk(jr.pri, jr.delay, jr.ttr, jr.body_size,
                                  t, jr.id);
             job_list_reset(j);
+            setdur(j);
             j->r.created_at = jr.created_at;
         }
         j->r = jr;
@@ -246,7 +260,13 @@ readrec(File *f, Job *l, int *err)
                 warnpos(f, -r, "was %d, now %d", j->r.body_size, jr.body_size);
                 goto Error;
             }
-            r = readfull(f, j->body, j->r.body_size, err, "job body");
+            if (body_budget) {
+                // leave the body on disk until it is needed
+                j->bodyoff = lseek(f->fd, 0, SEEK_CUR);
+                r = skipfull(f, j->r.body_size, err, "job body");
+            } else {
+                r = readfull(f, j->body, j->r.body_size, err, "job body");
+            }
             if (!r) {
                 goto Error;
             }
@@ -257,6 +277,9 @@ readrec(File *f, Job *l, int *err)
             // file, if any
             filermjob(j->file, j);
             fileaddjob(f, j);
+            if (body_budget) {
+                job_body_drop(j);
+            }
         }
         j->walused += sz;
         f->w->alive += sz;
@@ -359,6 +382,7 @@ readrec5(File *f, Job *l, int *err)
             j = make_job_with_id(jr.pri, jr.delay, jr.ttr, jr.body_size,
                                  t, jr.id);
             job_list_reset(j);
+            setdur(j);
         }
         j->r.id = jr.id;
         j->r.pri = jr.pri;
@@ -438,6 +462,35 @@ readfull(File *f, void *c, int n, int *err, char *desc)
     return r;
 }
 
+// Skipfull moves past n bytes of f without reading them,
+// making sure they are all there.
+static int
+skipfull(File *f, int n, int *err, char *desc)
+{
+    off_t off;
+    struct stat st;
+
+    if (fstat(f->fd, &st) == -1) {
+        twarn("fstat");
+        warnpos(f, 0, "error skipping %s", desc);
+        *err = 1;
+        return 0;
+    }
+    off = lseek(f->fd, n, SEEK_CUR);
+    if (off == -1) {
+        twarn("lseek");
+        warnpos(f, 0, "error skipping %s", desc);
+        *err = 1;
+        return 0;
+    }
+    if (off > st.st_size) {
+        warnpos(f, 0, "unexpected EOF skipping %d bytes: %s", n, desc);
+        *err = 1;
+        return 0;
+    }
+    return n;
+}
+
 static void
 warnpos(File *f, int adj, char *fmt, ...)
 {
@@ -503,10 +556,20 @@ filewrite(File *f, Job *j, void *buf, int len)
 {
     int r;
 
-    r = write(f->fd, buf, len);
-    if (r != len) {
-        twarn("write");
+    // Within a batch, keep the record in memory if possible.
+    if (f->w->batch && walbuffer(f->w, buf, len)) {
+        r = len;
+    } else if (!walflush(f->w)) {
         return 0;
+    } else {
+        int64 t = nanoseconds();
+        r = write(f->fd, buf, len);
+        f->w->write_ns += nanoseconds() - t;
+        f->w->nwrite++;
+        if (r != len) {
+            twarn("write");
+            return 0;
+        }
     }
 
     f->w->resv -= r;
@@ -543,11 +606,46 @@ filewrjobfull(File *f, Job *j)
 
     fileaddjob(f, j);
     nl = strlen(j->tube->name);
-    return
-        filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, j->tube->name, nl) &&
-        filewrite(f, j, &j->r, sizeof j->r) &&
-        filewrite(f, j, j->body, j->r.body_size);
+    if (!(filewrite(f, j, &nl, sizeof nl) &&
+          filewrite(f, j, j->tube->name, nl) &&
+          filewrite(f, j, &j->r, sizeof j->r))) {
+        return 0;
+    }
+
+    // Everything written to f so far is neither free nor reserved.
+    j->bodyoff = f->w->filesize - f->free - f->resv;
+    return filewrite(f, j, j->body, j->r.body_size);
+}
+
+
+// Filereadbody reads the body of j, which f holds at j->bodyoff,
+// into body. Returns 1 on success, 0 on error.
+int
+filereadbody(File *f, Job *j, char *body)
+{
+    int r;
+
+    // the body might still wait in the batch buffer
+    if (f == f->w->cur && !walflush(f->w)) {
+        return 0;
+    }
+
+    if (f->rfd == -1) {
+        f->rfd = open(f->path, O_RDONLY);
+        if (f->rfd == -1) {
+            twarn("open %s", f->path);
+            return 0;
+        }
+    }
+    r = pread(f->rfd, body, j->r.body_size, j->bodyoff);
+    if (r != j->r.body_size) {
+        if (r == -1)
+            twarn("pread %s", f->path);
+        else
+            twarnx("%s: short read of job %"PRIu64" body", f->path, j->r.id);
+        return 0;
+    }
+    return 1;
 }
 
 
@@ -574,6 +672,7 @@ fileinit(File *f, Wal *w, int n)
 {
     f->w = w;
     f->seq = n;
+    f->rfd = -1;
     f->path = fmtalloc("%s/binlog.%d", w->dir, n);
     return !!f->path;
 }
@@ -68,6 +68,9 @@ siftup(Heap *h, size_t k)
 }
 
 
+// Bytes held by the data arrays of all heaps.
+size_t heap_bytes = 0;
+
 // Heapinsert inserts x into heap h according to h->less.
 // It returns 1 on success, otherwise 0.
 int
@@ -84,6 +87,7 @@ heapinsert(Heap *h, void *x)
 
         memcpy(ndata, h->data, sizeof(void*) * h->len);
         free(h->data);
+        heap_bytes += sizeof(void*) * (ncap - h->cap);
         h->data = ndata;
         h->cap = ncap;
     }
@@ -110,3 +114,14 @@ heapremove(Heap *h, size_t k)
     siftup(h, k);
     return x;
 }
+
+
+// Heapfree frees the elements array of h and leaves h empty.
+void
+heapfree(Heap *h)
+{
+    heap_bytes -= sizeof(void*) * h->cap;
+    free(h->data);
+    h->data = NULL;
+    h->cap = h->len = 0;
+}
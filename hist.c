@@ -0,0 +1,66 @@
+#include "dat.h"
+#include <stdint.h>
+
+// Values below HIST_SUB have a bucket each. Above that, each power
+// of two is split into HIST_SUB buckets, so a bucket is at most
+// 1/HIST_SUB of its values wide. Values from 2^48 up all go into
+// the last bucket.
+#define HIST_SUBBITS 2
+#define HIST_SUB (1 << HIST_SUBBITS)
+
+// hist_index returns the bucket for v.
+static int
+hist_index(uint64 v)
+{
+    int e, i;
+
+    if (v < HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    i = (e - HIST_SUBBITS + 1) * HIST_SUB +
+        ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// hist_high returns the highest value that goes into bucket i.
+static uint64
+hist_high(int i)
+{
+    int e;
+
+    if (i < HIST_SUB)
+        return i;
+    if (i == HIST_BUCKETS - 1)
+        return UINT64_MAX;
+    e = i / HIST_SUB + HIST_SUBBITS - 1;
+    return ((uint64)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUBBITS)) - 1;
+}
+
+void
+hist_record(Hist *h, uint64 v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+}
+
+// hist_percentile returns a value that at least permille/1000 of
+// the recorded values are less than or equal to, rounded up to the
+// highest value of its bucket, or 0 if nothing was recorded.
+uint64
+hist_percentile(Hist *h, uint permille)
+{
+    uint64 rank, n = 0;
+    int i;
+
+    if (!h->count)
+        return 0;
+    rank = (h->count * permille + 999) / 1000;
+    if (!rank)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        n += h->bucket[i];
+        if (n >= rank)
+            return hist_high(i);
+    }
+    return hist_high(HIST_BUCKETS - 1);
+}
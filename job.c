@@ -14,6 +14,20 @@ static size_t all_jobs_used = 0;
 
 static int hash_table_was_oom = 0;
 
+// Bodies of cold jobs can be dropped from memory and read back
+// from the wal on demand, see job_body_trim and job_body_load.
+// A job is cold if it is buried, or delayed for at least Colddelay.
+static const int64 Colddelay = 60 * 1000000000LL;
+
+// Cold jobs whose bodies are in memory, least recently used first.
+static Job cold = {.cnext = &cold, .cprev = &cold};
+
+size_t body_budget = 0;   // 0 means bodies always stay in memory
+size_t body_resident = 0; // bytes of job bodies in memory
+uint64 body_hit_ct = 0;
+uint64 body_miss_ct = 0;
+uint64 body_evict_ct = 0;
+
 static void rehash(int);
 
 static int
@@ -109,17 +123,61 @@ allocate_job(int body_size)
     return j;
 }
 
-Job *
-make_job_with_id(uint32 pri, int64 delay, int64 ttr,
-                 int body_size, Tube *tube, uint64 id)
+// Like allocate_job, but the body is allocated on its own,
+// so that it can be dropped while the job lives on.
+// If ondisk is set, the body is left to job_body_load.
+static Job *
+allocate_job_sep(int body_size, int ondisk)
+{
+    Job *j;
+
+    j = malloc(sizeof(Job));
+    if (!j) {
+        twarnx("OOM");
+        return (Job *) 0;
+    }
+
+    memset(j, 0, sizeof(Job));
+    if (!ondisk)
+        j->body = malloc(body_size);
+    if (!ondisk && !j->body) {
+        twarnx("OOM");
+        free(j);
+        return (Job *) 0;
+    }
+    j->r.created_at = nanoseconds();
+    j->r.body_size = body_size;
+    job_list_reset(j);
+    return j;
+}
+
+static int
+body_is_inline(Job *j)
+{
+    return j->body == (char *)j + sizeof(Job);
+}
+
+static void body_evict(void);
+
+static Job *
+new_job(uint32 pri, int64 delay, int64 ttr,
+        int body_size, Tube *tube, uint64 id, int ondisk)
 {
     Job *j;
 
-    j = allocate_job(body_size);
+    if (body_budget) {
+        j = allocate_job_sep(body_size, ondisk);
+    } else {
+        j = allocate_job(body_size);
+    }
     if (!j) {
         twarnx("OOM");
         return (Job *) 0;
     }
+    if (j->body) {
+        body_resident += body_size;
+        body_evict();
+    }
 
     if (id) {
         j->r.id = id;
@@ -138,6 +196,23 @@ make_job_with_id(uint32 pri, int64 delay, int64 ttr,
     return j;
 }
 
+Job *
+make_job_with_id(uint32 pri, int64 delay, int64 ttr,
+                 int body_size, Tube *tube, uint64 id)
+{
+    return new_job(pri, delay, ttr, body_size, tube, id, 0);
+}
+
+// make_job_on_disk is like make_job_with_id, but under a body budget
+// it leaves the body in the wal, at the file and offset the caller
+// must set, until job_body_load reads it.
+Job *
+make_job_on_disk(uint32 pri, int64 delay, int64 ttr,
+                 int body_size, Tube *tube, uint64 id)
+{
+    return new_job(pri, delay, ttr, body_size, tube, id, 1);
+}
+
 static void
 job_hash_free(Job *j)
 {
@@ -154,17 +229,115 @@ job_hash_free(Job *j)
     if (all_jobs_used < (all_jobs_cap >> 4)) rehash(0);
 }
 
+static void
+cold_remove(Job *j)
+{
+    if (!j->cnext) return;
+    j->cnext->cprev = j->cprev;
+    j->cprev->cnext = j->cnext;
+    j->cnext = j->cprev = NULL;
+}
+
 void
 job_free(Job *j)
 {
     if (j) {
+        cold_remove(j);
         TUBE_ASSIGN(j->tube, NULL);
-        if (j->r.state != Copy) job_hash_free(j);
+        if (j->r.state != Copy) {
+            job_hash_free(j);
+            if (j->body) body_resident -= j->r.body_size;
+        }
+        if (!body_is_inline(j)) free(j->body);
     }
 
     free(j);
 }
 
+static int
+job_is_cold(Job *j)
+{
+    if (j->r.state == Buried) return 1;
+    if (j->r.state != Delayed) return 0;
+    return j->r.deadline_at - nanoseconds() >= Colddelay;
+}
+
+// job_body_drop frees the body of j if it can be read back
+// from the wal later. Returns 1 if the body was dropped.
+int
+job_body_drop(Job *j)
+{
+    if (!j->body || body_is_inline(j)) return 0;
+    if (!j->file || !j->file->w->use || !j->bodyoff) return 0;
+
+    cold_remove(j);
+    free(j->body);
+    j->body = NULL;
+    body_resident -= j->r.body_size;
+    return 1;
+}
+
+// body_evict drops bodies of cold jobs, least recently used
+// first, until bodies take no more than body_budget bytes.
+// Jobs that are no longer cold just leave the list.
+static void
+body_evict()
+{
+    while (body_budget && body_resident > body_budget && cold.cnext != &cold) {
+        Job *j = cold.cnext;
+        cold_remove(j);
+        if (job_is_cold(j) && job_body_drop(j)) {
+            body_evict_ct++;
+        }
+    }
+}
+
+// job_body_trim is called when j is done with for now. If j is cold,
+// its body goes to the end of the list of bodies that can be dropped.
+// Then bodies are dropped, as body_evict, to keep within body_budget.
+void
+job_body_trim(Job *j)
+{
+    if (!body_budget) return;
+    if (j->body && !body_is_inline(j) && job_is_cold(j)) {
+        cold_remove(j);
+        j->cprev = cold.cprev;
+        j->cnext = &cold;
+        cold.cprev->cnext = j;
+        cold.cprev = j;
+    }
+    body_evict();
+}
+
+// job_body_load makes sure the body of j is in memory,
+// reading it back from the wal if it was dropped.
+// Returns 1 on success, 0 on error.
+int
+job_body_load(Job *j)
+{
+    char *body;
+
+    if (j->body) {
+        body_hit_ct++;
+        return 1;
+    }
+    body_miss_ct++;
+
+    body = malloc(j->r.body_size);
+    if (!body) {
+        twarnx("OOM");
+        return 0;
+    }
+    if (!filereadbody(j->file, j, body)) {
+        free(body);
+        return 0;
+    }
+    j->body = body;
+    body_resident += j->r.body_size;
+    body_evict();
+    return 1;
+}
+
 void
 job_setpos(void *j, size_t pos)
 {
@@ -197,14 +370,21 @@ job_copy(Job *j)
     if (!j)
         return NULL;
 
+    if (!job_body_load(j))
+        return NULL;
+
     Job *n = malloc(sizeof(Job) + j->r.body_size);
     if (!n) {
         twarnx("OOM");
         return (Job *) 0;
     }
 
-    memcpy(n, j, sizeof(Job) + j->r.body_size);
+    memcpy(n, j, sizeof(Job));
+    n->cnext = n->cprev = NULL;
+    n->body = (char *)n + sizeof(Job);
+    memcpy(n->body, j->body, j->r.body_size);
     job_list_reset(n);
+    job_body_trim(j);
 
     n->file = NULL; /* copies do not have refcnt on the wal */
 
@@ -273,3 +453,10 @@ get_all_jobs_used()
 {
     return all_jobs_used;
 }
+
+// job_hash_bytes returns the size of the job hash table.
+size_t
+job_hash_bytes()
+{
+    return all_jobs_cap * sizeof(Job *);
+}
@@ -68,6 +68,13 @@ set_sig_handlers()
         exit(111);
     }
 
+    sa.sa_handler = tracewant;
+    r = sigaction(SIGUSR2, &sa, 0);
+    if (r == -1) {
+        twarn("sigaction(SIGUSR2)");
+        exit(111);
+    }
+
     // Workaround for running the server with pid=1 in Docker.
     // Handle SIGTERM so the server is killed immediately and
     // not after 10 seconds timeout. See issue #527.
@@ -102,12 +109,26 @@ main(int argc, char **argv)
 
     srv.sock.fd = r;
 
+    if (srv.binport) {
+        r = make_bin_socket(srv.addr, srv.binport);
+        if (r == -1) {
+            twarnx("make_bin_socket()");
+            exit(111);
+        }
+        srv.binsock.fd = r;
+    }
+
     prot_init();
 
     if (srv.user)
         su(srv.user);
     set_sig_handlers();
 
+    if (srv.shmpath && !shmopen(srv.shmpath)) {
+        twarnx("failed to open stats file %s", srv.shmpath);
+        exit(111);
+    }
+
     srv_acquire_wal(&srv);
     srvserve(&srv);
     exit(0);
@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdlib.h>
 
+// Bytes held by the items arrays of all sets.
+size_t ms_bytes = 0;
+
 void
 ms_init(Ms *a, ms_event_fn oninsert, ms_event_fn onremove)
 {
@@ -26,6 +29,7 @@ grow(Ms *a)
 
     memcpy(nitems, a->items, a->len * sizeof(void *));
     free(a->items);
+    ms_bytes += (ncap - a->cap) * sizeof(void *);
     a->items = nitems;
     a->cap = ncap;
     return 1;
@@ -64,6 +68,7 @@ ms_clear(Ms *a)
 {
     while (ms_delete(a, 0));
     free(a->items);
+    ms_bytes -= a->cap * sizeof(void *);
     ms_init(a, a->oninsert, a->onremove);
 }
 
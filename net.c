@@ -259,3 +259,15 @@ make_server_socket(char *host, char *port)
         return make_inet_socket(host, port);
     }
 }
+
+// make_bin_socket returns a socket listening on the TCP port for the
+// binary protocol. If host names a unix socket, it listens on all
+// addresses. Unlike make_server_socket, it never uses systemd's socket.
+int
+make_bin_socket(char *host, char *port)
+{
+    if (host && !strncmp(host, "unix:", 5)) {
+        host = NULL;
+    }
+    return make_inet_socket(host, port);
+}
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/resource.h>
 #include <sys/uio.h>
 #include <sys/types.h>
@@ -19,6 +20,9 @@
 /* job body cannot be greater than this many bytes long */
 size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 
+/* puts are refused once this many bytes are in use; 0 means no limit */
+size_t mem_limit = 0;
+
 #define NAME_CHARS \
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
     "abcdefghijklmnopqrstuvwxyz" \
@@ -49,6 +53,20 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_STATS_TUBE "stats-tube "
 #define CMD_QUIT "quit"
 #define CMD_PAUSE_TUBE "pause-tube"
+#define CMD_SET_DURABILITY "set-durability "
+#define CMD_STATS_MEMORY "stats-memory"
+#define CMD_PUT_BATCH "put-batch "
+#define CMD_RESERVE_MANY "reserve-many "
+#define CMD_DELETE_MANY "delete-many "
+#define CMD_TOUCH_MANY "touch-many "
+#define CMD_RELEASE_MANY "release-many "
+#define CMD_DELETE_RESERVE "delete-reserve "
+#define CMD_RELEASE_RESERVE "release-reserve "
+#define CMD_BURY_RESERVE "bury-reserve "
+#define CMD_SUBSCRIBE "subscribe "
+#define CMD_STATS_TUBES "stats-tubes"
+#define CMD_STATS_LOOP "stats-loop"
+#define CMD_DUMP_TRACE "dump-trace"
 
 #define CONSTSTRLEN(m) (sizeof(m) - 1)
 
@@ -75,10 +93,27 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_LIST_TUBES_WATCHED_LEN CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
 #define CMD_STATS_TUBE_LEN CONSTSTRLEN(CMD_STATS_TUBE)
 #define CMD_PAUSE_TUBE_LEN CONSTSTRLEN(CMD_PAUSE_TUBE)
+#define CMD_SET_DURABILITY_LEN CONSTSTRLEN(CMD_SET_DURABILITY)
+#define CMD_STATS_MEMORY_LEN CONSTSTRLEN(CMD_STATS_MEMORY)
+#define CMD_PUT_BATCH_LEN CONSTSTRLEN(CMD_PUT_BATCH)
+#define CMD_RESERVE_MANY_LEN CONSTSTRLEN(CMD_RESERVE_MANY)
+#define CMD_DELETE_MANY_LEN CONSTSTRLEN(CMD_DELETE_MANY)
+#define CMD_TOUCH_MANY_LEN CONSTSTRLEN(CMD_TOUCH_MANY)
+#define CMD_RELEASE_MANY_LEN CONSTSTRLEN(CMD_RELEASE_MANY)
+#define CMD_DELETE_RESERVE_LEN CONSTSTRLEN(CMD_DELETE_RESERVE)
+#define CMD_RELEASE_RESERVE_LEN CONSTSTRLEN(CMD_RELEASE_RESERVE)
+#define CMD_BURY_RESERVE_LEN CONSTSTRLEN(CMD_BURY_RESERVE)
+#define CMD_SUBSCRIBE_LEN CONSTSTRLEN(CMD_SUBSCRIBE)
+#define CMD_STATS_TUBES_LEN CONSTSTRLEN(CMD_STATS_TUBES)
+#define CMD_STATS_LOOP_LEN CONSTSTRLEN(CMD_STATS_LOOP)
+#define CMD_DUMP_TRACE_LEN CONSTSTRLEN(CMD_DUMP_TRACE)
 
 #define MSG_FOUND "FOUND"
 #define MSG_NOTFOUND "NOT_FOUND\r\n"
 #define MSG_RESERVED "RESERVED"
+#define MSG_RESERVED_MANY "RESERVED_MANY"
+#define MSG_STATUS "STATUS"
+#define MSG_OK "OK"
 #define MSG_DEADLINE_SOON "DEADLINE_SOON\r\n"
 #define MSG_TIMED_OUT "TIMED_OUT\r\n"
 #define MSG_DELETED "DELETED\r\n"
@@ -87,7 +122,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_KICKED "KICKED\r\n"
 #define MSG_TOUCHED "TOUCHED\r\n"
 #define MSG_BURIED_FMT "BURIED %"PRIu64"\r\n"
-#define MSG_INSERTED_FMT "INSERTED %"PRIu64"\r\n"
+#define MSG_INSERTED "INSERTED"
 #define MSG_NOT_IGNORED "NOT_IGNORED\r\n"
 
 #define MSG_OUT_OF_MEMORY "OUT_OF_MEMORY\r\n"
@@ -98,15 +133,19 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_EXPECTED_CRLF "EXPECTED_CRLF\r\n"
 #define MSG_JOB_TOO_BIG "JOB_TOO_BIG\r\n"
 
-// Connection can be in one of these states:
-#define STATE_WANT_COMMAND  0  // conn expects a command from the client
-#define STATE_WANT_DATA     1  // conn expects a job data
-#define STATE_SEND_JOB      2  // conn sends job to the client
-#define STATE_SEND_WORD     3  // conn sends a line reply
-#define STATE_WAIT          4  // client awaits for the job reservation
-#define STATE_BITBUCKET     5  // conn discards content
-#define STATE_CLOSE         6  // conn should be closed
-#define STATE_WANT_ENDLINE  7  // skip until the end of a line
+// the most jobs kicked in one go, see kick_chunk
+#define KICK_CHUNK 1024
+
+// the most jobs in one put-batch, and the longest header line of each
+#define BATCH_MAX_JOBS 100000
+#define BATCH_LINE_MAX 64
+
+// the most jobs one reserve-many can return
+#define RESERVE_MANY_MAX 1000
+
+// the most bytes of records in one RESERVED_MANY reply;
+// the first job is sent whatever its size
+#define RESERVE_MANY_BYTES (64 << 20)
 
 #define OP_UNKNOWN 0
 #define OP_PUT 1
@@ -134,102 +173,44 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define OP_PAUSE_TUBE 23
 #define OP_KICKJOB 24
 #define OP_RESERVE_JOB 25
-#define TOTAL_OPS 26
-
-#define STATS_FMT "---\n" \
-    "current-jobs-urgent: %" PRIu64 "\n" \
-    "current-jobs-ready: %" PRIu64 "\n" \
-    "current-jobs-reserved: %" PRIu64 "\n" \
-    "current-jobs-delayed: %u\n" \
-    "current-jobs-buried: %" PRIu64 "\n" \
-    "cmd-put: %" PRIu64 "\n" \
-    "cmd-peek: %" PRIu64 "\n" \
-    "cmd-peek-ready: %" PRIu64 "\n" \
-    "cmd-peek-delayed: %" PRIu64 "\n" \
-    "cmd-peek-buried: %" PRIu64 "\n" \
-    "cmd-reserve: %" PRIu64 "\n" \
-    "cmd-reserve-with-timeout: %" PRIu64 "\n" \
-    "cmd-delete: %" PRIu64 "\n" \
-    "cmd-release: %" PRIu64 "\n" \
-    "cmd-use: %" PRIu64 "\n" \
-    "cmd-watch: %" PRIu64 "\n" \
-    "cmd-ignore: %" PRIu64 "\n" \
-    "cmd-bury: %" PRIu64 "\n" \
-    "cmd-kick: %" PRIu64 "\n" \
-    "cmd-touch: %" PRIu64 "\n" \
-    "cmd-stats: %" PRIu64 "\n" \
-    "cmd-stats-job: %" PRIu64 "\n" \
-    "cmd-stats-tube: %" PRIu64 "\n" \
-    "cmd-list-tubes: %" PRIu64 "\n" \
-    "cmd-list-tube-used: %" PRIu64 "\n" \
-    "cmd-list-tubes-watched: %" PRIu64 "\n" \
-    "cmd-pause-tube: %" PRIu64 "\n" \
-    "job-timeouts: %" PRIu64 "\n" \
-    "total-jobs: %" PRIu64 "\n" \
-    "max-job-size: %zu\n" \
-    "current-tubes: %zu\n" \
-    "current-connections: %u\n" \
-    "current-producers: %u\n" \
-    "current-workers: %u\n" \
-    "current-waiting: %" PRIu64 "\n" \
-    "total-connections: %u\n" \
-    "pid: %ld\n" \
-    "version: \"%s\"\n" \
-    "rusage-utime: %d.%06d\n" \
-    "rusage-stime: %d.%06d\n" \
-    "uptime: %u\n" \
-    "binlog-oldest-index: %d\n" \
-    "binlog-current-index: %d\n" \
-    "binlog-records-migrated: %" PRId64 "\n" \
-    "binlog-records-written: %" PRId64 "\n" \
-    "binlog-max-size: %d\n" \
-    "draining: %s\n" \
-    "id: %s\n" \
-    "hostname: %s\n" \
-    "os: \"%s\"\n" \
-    "platform: %s\n" \
-    "\r\n"
-
-#define STATS_TUBE_FMT "---\n" \
-    "name: %s\n" \
-    "current-jobs-urgent: %" PRIu64 "\n" \
-    "current-jobs-ready: %zu\n" \
-    "current-jobs-reserved: %" PRIu64 "\n" \
-    "current-jobs-delayed: %zu\n" \
-    "current-jobs-buried: %" PRIu64 "\n" \
-    "total-jobs: %" PRIu64 "\n" \
-    "current-using: %u\n" \
-    "current-watching: %u\n" \
-    "current-waiting: %" PRIu64 "\n" \
-    "cmd-delete: %" PRIu64 "\n" \
-    "cmd-pause-tube: %" PRIu64 "\n" \
-    "pause: %" PRIu64 "\n" \
-    "pause-time-left: %" PRId64 "\n" \
-    "\r\n"
-
-#define STATS_JOB_FMT "---\n" \
-    "id: %" PRIu64 "\n" \
-    "tube: %s\n" \
-    "state: %s\n" \
-    "pri: %u\n" \
-    "age: %" PRId64 "\n" \
-    "delay: %" PRId64 "\n" \
-    "ttr: %" PRId64 "\n" \
-    "time-left: %" PRId64 "\n" \
-    "file: %d\n" \
-    "reserves: %u\n" \
-    "timeouts: %u\n" \
-    "releases: %u\n" \
-    "buries: %u\n" \
-    "kicks: %u\n" \
-    "\r\n"
+#define OP_SET_DURABILITY 26
+#define OP_STATS_MEMORY 27
+#define OP_PUT_BATCH 28
+#define OP_RESERVE_MANY 29
+#define OP_DELETE_MANY 30
+#define OP_TOUCH_MANY 31
+#define OP_RELEASE_MANY 32
+#define OP_DELETE_RESERVE 33
+#define OP_RELEASE_RESERVE 34
+#define OP_BURY_RESERVE 35
+#define OP_SUBSCRIBE 36
+#define OP_STATS_TUBES 37
+#define OP_STATS_LOOP 38
+#define OP_DUMP_TRACE 39
+#define TOTAL_OPS 40
 
 // The size of the throw-away (BITBUCKET) buffer. Arbitrary.
 #define BUCKET_BUF_SIZE 1024
 
 static uint64 ready_ct = 0;
+static uint64 delayed_ct = 0;
 static uint64 timeout_ct = 0;
+static uint64 mem_reject_ct = 0;
 static uint64 op_ct[TOTAL_OPS] = {0};
+
+// op_hist has the time each command took to handle, by opcode,
+// and dispatched_op the opcode of the command being handled.
+static Hist op_hist[TOTAL_OPS];
+static byte dispatched_op;
+
+// dispatching is the conn whose command is being handled.
+static Conn *dispatching;
+
+// epollq_hist has the length of the epollq each time it was
+// applied and was not empty, and epollq_max the longest.
+static Hist epollq_hist;
+static uint64 epollq_max;
+
 static struct stats global_stat = {0};
 
 static Tube *default_tube;
@@ -276,9 +257,28 @@ static const char * op_names[] = {
     CMD_PAUSE_TUBE,
     CMD_KICKJOB,
     CMD_RESERVE_JOB,
+    CMD_SET_DURABILITY,
+    CMD_STATS_MEMORY,
+    CMD_PUT_BATCH,
+    CMD_RESERVE_MANY,
+    CMD_DELETE_MANY,
+    CMD_TOUCH_MANY,
+    CMD_RELEASE_MANY,
+    CMD_DELETE_RESERVE,
+    CMD_RELEASE_RESERVE,
+    CMD_BURY_RESERVE,
+    CMD_SUBSCRIBE,
+    CMD_STATS_TUBES,
+    CMD_STATS_LOOP,
+    CMD_DUMP_TRACE,
 };
 
 static Job *remove_buried_job(Job *j);
+static Job *remove_delayed_job(Job *j);
+static Job *remove_ready_job(Job *j);
+static Job *remove_reserved_job(Conn *c, Job *j);
+static int insert_job(Server *s, Job *j, int64 delay, char update_store);
+static int bury_job(Server *s, Job *j, char update_store);
 
 // epollq_add schedules connection c in the s->conns heap, adds c
 // to the epollq list to change expected operation in event notifications.
@@ -318,17 +318,24 @@ static void
 epollq_apply()
 {
     Conn *c;
+    uint64 n = 0;
 
     while (epollq) {
         c = epollq;
         epollq = epollq->next;
         c->next = NULL;
+        n++;
         int r = sockwant(&c->sock, c->rw);
         if (r == -1) {
             twarn("sockwant");
             connclose(c);
         }
     }
+    if (n) {
+        hist_record(&epollq_hist, n);
+        if (n > epollq_max)
+            epollq_max = n;
+    }
 }
 
 #define reply_msg(c, m) \
@@ -337,21 +344,172 @@ epollq_apply()
 #define reply_serr(c, e) \
     (twarnx("server error: %s", (e)), reply_msg((c), (e)))
 
+// The binary protocol. Integers are big-endian. A request is a header
+// of BIN_REQ_SIZE bytes followed by len bytes of data:
+//
+//   op:1 pad:3 len:4 id:8 pri:4 delay:4 ttr:4
+//
+// where op is one of the OP_* values. A reply is a header of
+// BIN_REPLY_SIZE bytes followed by len bytes of job body:
+//
+//   code:1 pad:3 len:4 id:8
+//
+// where code is one of the Bin* values below, each standing for
+// the text reply of the same name.
+#define BIN_REPLY_SIZE 16
+
+enum {
+    BinOK,
+    BinInserted,
+    BinBuried,
+    BinReserved,
+    BinFound,
+    BinDeleted,
+    BinReleased,
+    BinTouched,
+    BinKicked,
+    BinUsing,
+    BinWatching,
+    BinNotIgnored,
+    BinNotFound,
+    BinTimedOut,
+    BinDeadlineSoon,
+    BinExpectedCRLF,
+    BinJobTooBig,
+    BinDraining,
+    BinBadFormat,
+    BinUnknownCommand,
+    BinOutOfMemory,
+    BinInternalError,
+};
+
+static const char *bin_words[] = {
+    [BinOK] = "OK",
+    [BinInserted] = "INSERTED",
+    [BinBuried] = "BURIED",
+    [BinReserved] = "RESERVED",
+    [BinFound] = "FOUND",
+    [BinDeleted] = "DELETED",
+    [BinReleased] = "RELEASED",
+    [BinTouched] = "TOUCHED",
+    [BinKicked] = "KICKED",
+    [BinUsing] = "USING",
+    [BinWatching] = "WATCHING",
+    [BinNotIgnored] = "NOT_IGNORED",
+    [BinNotFound] = "NOT_FOUND",
+    [BinTimedOut] = "TIMED_OUT",
+    [BinDeadlineSoon] = "DEADLINE_SOON",
+    [BinExpectedCRLF] = "EXPECTED_CRLF",
+    [BinJobTooBig] = "JOB_TOO_BIG",
+    [BinDraining] = "DRAINING",
+    [BinBadFormat] = "BAD_FORMAT",
+    [BinUnknownCommand] = "UNKNOWN_COMMAND",
+    [BinOutOfMemory] = "OUT_OF_MEMORY",
+    [BinInternalError] = "INTERNAL_ERROR",
+};
+
+static uint32
+bin_u32(const char *p)
+{
+    const byte *b = (const byte *)p;
+    return (uint32)b[0]<<24 | (uint32)b[1]<<16 | (uint32)b[2]<<8 | b[3];
+}
+
+static uint64
+bin_u64(const char *p)
+{
+    return (uint64)bin_u32(p)<<32 | bin_u32(p + 4);
+}
+
 static void
-reply(Conn *c, char *line, int len, int state)
+bin_put32(char *p, uint32 v)
 {
-    if (!c)
-        return;
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// bin_header writes a binary reply header into buf
+// and returns its size.
+static int
+bin_header(char *buf, byte code, uint32 len, uint64 id)
+{
+    buf[0] = code;
+    buf[1] = buf[2] = buf[3] = 0;
+    bin_put32(buf + 4, len);
+    bin_put32(buf + 8, id >> 32);
+    bin_put32(buf + 12, id);
+    return BIN_REPLY_SIZE;
+}
+
+// bin_from_text writes the binary reply for the text reply line of
+// len bytes into buf, which may be line, and returns its size. The
+// numbers that follow the reply word go into the id field, except
+// that the last of two numbers, or the only number of OK, is len.
+static int
+bin_from_text(char *buf, const char *line, int len)
+{
+    size_t i, n;
+    uint64 num[2] = {0, 0};
+    int nnum = 0;
+    char *p;
+    byte code = BinInternalError;
+
+    n = strcspn(line, " \r");
+    for (i = 0; i < sizeof(bin_words) / sizeof(bin_words[0]); i++) {
+        if (strlen(bin_words[i]) == n && !memcmp(line, bin_words[i], n)) {
+            code = i;
+            break;
+        }
+    }
+    p = (char *)line + n;
+    while (nnum < 2 && p < line + len && p[0] == ' ' &&
+           '0' <= p[1] && p[1] <= '9') {
+        num[nnum++] = strtoull(p + 1, &p, 10);
+    }
+    if (nnum == 2 || code == BinOK) {
+        return bin_header(buf, code, num[nnum - 1], num[0]);
+    }
+    return bin_header(buf, code, 0, num[0]);
+}
 
+// send_reply sends the len bytes of line to c,
+// then puts c in the given state.
+static void
+send_reply(Conn *c, char *line, int len, int state)
+{
     epollq_add(c, 'w');
 
     c->reply = line;
     c->reply_len = len;
     c->reply_sent = 0;
     c->state = state;
+}
+
+// reply_bin sends a binary reply header to c.
+static void
+reply_bin(Conn *c, byte code, uint32 len, uint64 id, int state)
+{
+    send_reply(c, c->reply_buf, bin_header(c->reply_buf, code, len, id), state);
+}
+
+// reply sends the text reply line to c,
+// converted for connections that speak the binary protocol.
+static void
+reply(Conn *c, char *line, int len, int state)
+{
+    if (!c)
+        return;
+
     if (verbose >= 2) {
         printf(">%d reply %.*s\n", c->sock.fd, len-2, line);
     }
+    if (c->bin) {
+        len = bin_from_text(c->reply_buf, line, len);
+        line = c->reply_buf;
+    }
+    send_reply(c, line, len, state);
 }
 
 static void
@@ -379,15 +537,56 @@ reply_line(Conn *c, int state, const char *fmt, ...)
     reply(c, c->reply_buf, r, state);
 }
 
+// fmt_reply writes the reply line "<word> <a>\r\n", or with two
+// numbers "<word> <a> <b>\r\n", into buf and returns its length.
+// buf must have room for the word and 44 more bytes. Most replies
+// take this form, so it avoids printf.
+static int
+fmt_reply(char *buf, const char *word, int n, uint64 a, uint64 b)
+{
+    size_t len = strlen(word);
+    char *p = buf + len;
+
+    memcpy(buf, word, len);
+    *p++ = ' ';
+    p = fmtu64(p, a);
+    if (n == 2) {
+        *p++ = ' ';
+        p = fmtu64(p, b);
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buf;
+}
+
+// reply_nums replies with the line made by fmt_reply.
+static void
+reply_nums(Conn *c, int state, const char *word, int n, uint64 a, uint64 b)
+{
+    int len = fmt_reply(c->reply_buf, word, n, a, b);
+
+    c->reply_buf[len] = '\0';
+    reply(c, c->reply_buf, len, state);
+}
+
 // reply_job tells the connection c which job to send,
 // and replies with this line: <msg> <job_id> <job_size>.
 static void
 reply_job(Conn *c, Job *j, const char *msg)
 {
+    // copies always hold their body
+    if (j->r.state != Copy && !job_body_load(j)) {
+        reply_serr(c, MSG_INTERNAL_ERROR);
+        return;
+    }
     c->out_job = j;
     c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "%s %"PRIu64" %u\r\n",
-               msg, j->r.id, j->r.body_size - 2);
+    if (c->bin) {
+        reply_bin(c, msg[0] == 'R' ? BinReserved : BinFound,
+                  j->r.body_size - 2, j->r.id, STATE_SEND_JOB);
+        return;
+    }
+    reply_nums(c, STATE_SEND_JOB, msg, 2, j->r.id, j->r.body_size - 2);
 }
 
 // remove_waiting_conn unsets CONN_TYPE_WAITING for the connection,
@@ -451,6 +650,114 @@ next_awaited_job(int64 now)
     return j;
 }
 
+// next_watched_job returns the next ready job with the smallest
+// priority among the unpaused tubes watched by c, as next_awaited_job.
+static Job *
+next_watched_job(Conn *c, int64 now)
+{
+    size_t i;
+    Job *j = NULL;
+
+    for (i = 0; i < c->watch.len; i++) {
+        Tube *t = c->watch.items[i];
+        if (t->pause && t->unpause_at > now)
+            continue;
+        if (t->ready.len) {
+            Job *candidate = t->ready.data[0];
+            if (!j || job_pri_less(candidate, j)) {
+                j = candidate;
+            }
+        }
+    }
+    return j;
+}
+
+// unready_many puts the jobs in jobs[0:n], taken from their tubes
+// but not reserved, back in the ready queues.
+static void
+unready_many(Server *s, Job **jobs, uint n)
+{
+    uint i;
+
+    for (i = 0; i < n; i++) {
+        if (!insert_job(s, jobs[i], 0, 0))
+            bury_job(s, jobs[i], 0); /* out of memory, so bury it */
+    }
+}
+
+// reply_many takes up to c->want_jobs - 1 more ready jobs for c,
+// which just reserved j, and sends them all in one reply:
+// RESERVED_MANY <count> <bytes>, followed by <bytes> of
+// "RESERVED <id> <size>\r\n<data>\r\n" records.
+// It stops before a job that would take the reply past
+// RESERVE_MANY_BYTES. The extra jobs are reserved only once the
+// reply is made; if it can't be, they go back to their tubes
+// untouched, for process_queue to hand out again.
+static void
+reply_many(Conn *c, Job *j, int64 now)
+{
+    Job *jobs[RESERVE_MANY_MAX];
+    Job *out;
+    uint i, n = 0;
+    size_t size = 0, rec;
+    char *p;
+
+    while (j) {
+        rec = fmt_reply(c->reply_buf, MSG_RESERVED, 2,
+                        j->r.id, j->r.body_size - 2);
+        rec += j->r.body_size;
+        if (n && size + rec > RESERVE_MANY_BYTES)
+            break;
+        if (n)
+            remove_ready_job(j);
+        jobs[n++] = j;
+        if (!job_body_load(j)) {
+            unready_many(c->srv, jobs + 1, n - 1);
+            c->want_jobs = 0;
+            reply_serr(c, MSG_INTERNAL_ERROR);
+            return;
+        }
+        size += rec;
+        j = n < c->want_jobs ? next_watched_job(c, now) : NULL;
+    }
+    c->want_jobs = 0;
+
+    out = allocate_job(size + 2); /* fake job to hold the records */
+    if (!out) {
+        unready_many(c->srv, jobs + 1, n - 1);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    out->r.state = Copy;
+
+    p = out->body;
+    for (i = 0; i < n; i++) {
+        if (i) {
+            global_stat.reserved_ct++;
+            conn_reserve_job(c, jobs[i]);
+        }
+        p += fmt_reply(p, MSG_RESERVED, 2,
+                       jobs[i]->r.id, jobs[i]->r.body_size - 2);
+        memcpy(p, jobs[i]->body, jobs[i]->r.body_size);
+        p += jobs[i]->r.body_size;
+        job_body_trim(jobs[i]);
+    }
+    p[0] = '\r';
+    p[1] = '\n';
+
+    c->out_job = out;
+    c->out_job_sent = 0;
+    reply_nums(c, STATE_SEND_JOB, MSG_RESERVED_MANY, 2, n, size);
+}
+
+// subscribe_idle reports whether the subscribed connection c is
+// between commands: it wants a command and is not running one.
+static int
+subscribe_idle(Conn *c)
+{
+    return c->state == STATE_WANT_COMMAND && c != dispatching;
+}
+
 // process_queue performs reservation for every jobs that is awaited for.
 static void
 process_queue()
@@ -459,26 +766,61 @@ process_queue()
     int64 now = nanoseconds();
 
     while ((j = next_awaited_job(now))) {
+        Conn *c = ms_take(&j->tube->waiting_conns);
+        if (c == NULL) {
+            twarnx("waiting_conns is empty");
+            break;
+        }
+
+        // A subscribed connection stays waiting across its commands,
+        // but takes no push while it runs one or sends a reply.
+        // It waits again once it wants a command, see subscribe_wait.
+        if (c->credits && c->state != STATE_WAIT && !subscribe_idle(c)) {
+            remove_waiting_conn(c);
+            continue;
+        }
+
         heapremove(&j->tube->ready, j->heap_index);
         ready_ct--;
         if (j->r.pri < URGENT_THRESHOLD) {
             global_stat.urgent_ct--;
             j->tube->stat.urgent_ct--;
         }
+        global_stat.reserved_ct++;
 
-        Conn *c = ms_take(&j->tube->waiting_conns);
-        if (c == NULL) {
-            twarnx("waiting_conns is empty");
-            continue;
+        // a subscribed connection takes what its credits allow
+        if (c->credits && c->state != STATE_WAIT) {
+            c->want_jobs = c->credits - c->nreserved;
         }
-        global_stat.reserved_ct++;
 
         remove_waiting_conn(c);
         conn_reserve_job(c, j);
-        reply_job(c, j, MSG_RESERVED);
+        if (c->want_jobs) {
+            reply_many(c, j, now);
+        } else {
+            reply_job(c, j, MSG_RESERVED);
+        }
     }
 }
 
+// subscribe_wait makes the subscribed connection c, which is between
+// commands, wait for jobs if it has credits left. It stays ready to
+// read commands; the jobs are pushed to it by process_queue. It keeps
+// waiting while it runs commands, until a reply is sent while a job
+// is ready for it or its credits run out.
+static void
+subscribe_wait(Conn *c)
+{
+    if (!c->credits || conn_waiting(c) || !subscribe_idle(c))
+        return;
+    if (c->nreserved >= c->credits)
+        return;
+
+    enqueue_waiting_conn(c);
+    c->pending_timeout = -1;
+    process_queue();
+}
+
 // soonest_delayed_job returns the delayed job
 // with the smallest deadline_at among all tubes.
 static Job *
@@ -499,12 +841,13 @@ soonest_delayed_job()
     return j;
 }
 
-// enqueue_job inserts job j in the tube, returns 1 on success, otherwise 0.
+// insert_job inserts job j in the tube, returns 1 on success, otherwise 0.
 // If update_store then it writes an entry to WAL.
-// On success it processes the queue.
+// Unlike enqueue_job it does not process the queue, so callers that move
+// many jobs can do that once at the end.
 // BUG: If maintenance of WAL has failed, it is not reported as error.
 static int
-enqueue_job(Server *s, Job *j, int64 delay, char update_store)
+insert_job(Server *s, Job *j, int64 delay, char update_store)
 {
     int r;
 
@@ -515,6 +858,7 @@ enqueue_job(Server *s, Job *j, int64 delay, char update_store)
         if (!r)
             return 0;
         j->r.state = Delayed;
+        delayed_ct++;
     } else {
         r = heapinsert(&j->tube->ready, j);
         if (!r)
@@ -526,16 +870,24 @@ enqueue_job(Server *s, Job *j, int64 delay, char update_store)
             j->tube->stat.urgent_ct++;
         }
     }
+    PROBE4(enqueue, j->r.id, j->tube->name, j->r.body_size - 2, delay);
 
     if (update_store) {
-        if (!walwrite(&s->wal, j)) {
+        if (!walwrite(srvwal(s, j), j)) {
             return 0;
         }
-        walmaint(&s->wal);
+        walmaint(srvwal(s, j));
     }
+    job_body_trim(j);
+    return 1;
+}
 
-    // The call below makes this function do too much.
-    // TODO: refactor this call outside so the call is explicit (not hidden)?
+// enqueue_job is insert_job followed, on success, by process_queue.
+static int
+enqueue_job(Server *s, Job *j, int64 delay, char update_store)
+{
+    if (!insert_job(s, j, delay, update_store))
+        return 0;
     process_queue();
     return 1;
 }
@@ -544,7 +896,7 @@ static int
 bury_job(Server *s, Job *j, char update_store)
 {
     if (update_store) {
-        int z = walresvupdate(&s->wal);
+        int z = walresvupdate(srvwal(s, j), j);
         if (!z)
             return 0;
         j->walresv += z;
@@ -556,13 +908,15 @@ bury_job(Server *s, Job *j, char update_store)
     j->r.state = Buried;
     j->reserver = NULL;
     j->r.bury_ct++;
+    PROBE3(bury, j->r.id, j->tube->name, j->r.body_size - 2);
 
     if (update_store) {
-        if (!walwrite(&s->wal, j)) {
+        if (!walwrite(srvwal(s, j), j)) {
             return 0;
         }
-        walmaint(&s->wal);
+        walmaint(srvwal(s, j));
     }
+    job_body_trim(j);
 
     return 1;
 }
@@ -577,17 +931,20 @@ enqueue_reserved_jobs(Conn *c)
             bury_job(c->srv, j, 0);
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
+        c->nreserved--;
         c->soonest_job = NULL;
     }
 }
 
+// kick_buried_job and kick_delayed_job leave processing
+// the queue to the caller.
 static int
 kick_buried_job(Server *s, Job *j)
 {
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(srvwal(s, j), j);
     if (!z)
         return 0;
     j->walresv += z;
@@ -595,7 +952,7 @@ kick_buried_job(Server *s, Job *j)
     remove_buried_job(j);
 
     j->r.kick_ct++;
-    r = enqueue_job(s, j, 0, 1);
+    r = insert_job(s, j, 0, 1);
     if (r == 1)
         return 1;
 
@@ -604,39 +961,26 @@ kick_buried_job(Server *s, Job *j)
     return 0;
 }
 
-static uint
-get_delayed_job_ct()
-{
-    size_t i;
-    uint count = 0;
-
-    for (i = 0; i < tubes.len; i++) {
-        Tube *t = tubes.items[i];
-        count += t->delay.len;
-    }
-    return count;
-}
-
 static int
 kick_delayed_job(Server *s, Job *j)
 {
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(srvwal(s, j), j);
     if (!z)
         return 0;
     j->walresv += z;
 
-    heapremove(&j->tube->delay, j->heap_index);
+    remove_delayed_job(j);
 
     j->r.kick_ct++;
-    r = enqueue_job(s, j, 0, 1);
+    r = insert_job(s, j, 0, 1);
     if (r == 1)
         return 1;
 
     /* ready queue is full, so delay it again */
-    r = enqueue_job(s, j, j->r.delay, 0);
+    r = insert_job(s, j, j->r.delay, 0);
     if (r == 1)
         return 0;
 
@@ -674,12 +1018,50 @@ kick_delayed_jobs(Server *s, Tube *t, uint n)
     return i;
 }
 
-static uint
-kick_jobs(Server *s, Tube *t, uint n)
+// batch_wal starts (on=1) or ends (on=0) a batch of writes
+// in every wal partition, see walbatch.
+static void
+batch_wal(Server *s, int on)
+{
+    int i;
+
+    for (i = 0; i < s->nwal; i++) {
+        walbatch(&s->wals[i], on);
+    }
+}
+
+// kick_chunk kicks the next KICK_CHUNK jobs requested by c, writing
+// their wal records in one batch, and replies once all are kicked or
+// there are none left. Otherwise c waits in STATE_KICK and the next
+// chunk is kicked on the following tick, so that other clients are
+// served in between.
+static void
+kick_chunk(Conn *c)
 {
-    if (buried_job_p(t))
-        return kick_buried_jobs(s, t, n);
-    return kick_delayed_jobs(s, t, n);
+    Server *s = c->srv;
+    uint n = min(c->kick_left, KICK_CHUNK);
+    uint i;
+
+    batch_wal(s, 1);
+    if (c->kick_buried) {
+        i = kick_buried_jobs(s, c->use, n);
+    } else {
+        i = kick_delayed_jobs(s, c->use, n);
+    }
+    batch_wal(s, 0);
+    process_queue();
+
+    c->kick_done += i;
+    c->kick_left -= i;
+    if (i < n || !c->kick_left) {
+        c->kick_left = 0;
+        reply_line(c, STATE_SEND_WORD, "KICKED %u\r\n", c->kick_done);
+        return;
+    }
+
+    // only care if they hang up
+    c->state = STATE_KICK;
+    epollq_add(c, 'h');
 }
 
 // remove_buried_job returns non-NULL value if job j was in the buried state.
@@ -705,6 +1087,7 @@ remove_delayed_job(Job *j)
     if (!j || j->r.state != Delayed)
         return NULL;
     heapremove(&j->tube->delay, j->heap_index);
+    delayed_ct--;
 
     return j;
 }
@@ -742,6 +1125,117 @@ touch_job(Conn *c, Job *j)
     return false;
 }
 
+// delete_job deletes the job with the given id if c may delete it,
+// and returns the reply to the delete command.
+static char *
+delete_job(Conn *c, uint64 id)
+{
+    Job *j, *jf = job_find(id);
+    Wal *w;
+    int r;
+    int64 held = 0;
+
+    j = remove_reserved_job(c, jf);
+    if (j) {
+        held = nanoseconds() - j->reserved_at;
+        tube_record(j->tube, Histservice, held);
+    } else {
+        j = remove_ready_job(jf);
+    }
+    if (!j)
+        j = remove_buried_job(jf);
+    if (!j)
+        j = remove_delayed_job(jf);
+    if (!j)
+        return MSG_NOTFOUND;
+
+    j->tube->stat.total_delete_ct++;
+    trace(Trdelete, c->sock.fd, j->r.id);
+    PROBE4(delete, j->r.id, j->tube->name, j->r.body_size - 2, held);
+
+    j->r.state = Invalid;
+    w = srvwal(c->srv, j);
+    r = walwrite(w, j);
+    walmaint(w);
+    job_free(j);
+
+    if (!r)
+        return MSG_INTERNAL_ERROR;
+    return MSG_DELETED;
+}
+
+// release_job puts the job with the given id, reserved by c, back into
+// its tube with the new priority and delay, and returns the reply to the
+// release command. The caller must call process_queue.
+static char *
+release_job(Conn *c, uint64 id, uint32 pri, int64 delay)
+{
+    Job *j;
+    int r;
+
+    j = remove_reserved_job(c, job_find(id));
+    if (!j)
+        return MSG_NOTFOUND;
+
+    /* We want to update the delay deadline on disk, so reserve space for
+     * that. */
+    if (delay) {
+        int z = walresvupdate(srvwal(c->srv, j), j);
+        if (!z)
+            return MSG_OUT_OF_MEMORY;
+        j->walresv += z;
+    }
+
+    j->r.pri = pri;
+    j->r.delay = delay;
+    j->r.release_ct++;
+
+    r = insert_job(c->srv, j, delay, !!delay);
+    if (r < 0)
+        return MSG_INTERNAL_ERROR;
+    if (r == 1)
+        return MSG_RELEASED;
+
+    /* out of memory trying to grow the queue, so it gets buried */
+    bury_job(c->srv, j, 0);
+    return MSG_BURIED;
+}
+
+// warn_serr logs msg, one of the MSG_ constants, if it is a server error.
+static void
+warn_serr(char *msg)
+{
+    if (!strcmp(msg, MSG_OUT_OF_MEMORY) || !strcmp(msg, MSG_INTERNAL_ERROR)) {
+        twarnx("server error: %s", msg);
+    }
+}
+
+// bury_reserved_job buries the job with the given id, reserved by c,
+// with the new priority, and returns the reply to the bury command.
+static char *
+bury_reserved_job(Conn *c, uint64 id, uint32 pri)
+{
+    Job *j;
+
+    j = remove_reserved_job(c, job_find(id));
+    if (!j)
+        return MSG_NOTFOUND;
+
+    j->r.pri = pri;
+    if (!bury_job(c->srv, j, 1))
+        return MSG_INTERNAL_ERROR;
+    return MSG_BURIED;
+}
+
+// reply_word sends msg, one of the MSG_ constants,
+// and logs it if it is a server error.
+static void
+reply_word(Conn *c, char *msg)
+{
+    warn_serr(msg);
+    reply(c, msg, strlen(msg), STATE_SEND_WORD);
+}
+
 static void
 check_err(Conn *c, const char *s)
 {
@@ -756,6 +1250,28 @@ check_err(Conn *c, const char *s)
     c->state = STATE_CLOSE;
 }
 
+// bin_frame_len returns the size of the binary request at the start
+// of c->cmd, or 0 if it is incomplete. A tube name is part of the
+// request; a job body is not.
+static size_t
+bin_frame_len(Conn *c)
+{
+    byte op;
+    uint32 len;
+
+    if (c->cmd_read < BIN_REQ_SIZE)
+        return 0;
+    op = c->cmd[0];
+    len = bin_u32(c->cmd + 4);
+    if ((op == OP_USE || op == OP_WATCH || op == OP_IGNORE) &&
+        len < MAX_TUBE_NAME_LEN) {
+        if (c->cmd_read < BIN_REQ_SIZE + len)
+            return 0;
+        return BIN_REQ_SIZE + len;
+    }
+    return BIN_REQ_SIZE;
+}
+
 /* Scan the given string for the sequence "\r\n" and return the line length.
  * Always returns at least 2 if a match is found. Returns 0 if no match. */
 static size_t
@@ -774,39 +1290,111 @@ scan_line_end(const char *s, int size)
     return 0;
 }
 
+// scan_cmd_end returns the size of the complete command
+// at the start of c->cmd, or 0 if there is none yet.
+static size_t
+scan_cmd_end(Conn *c)
+{
+    if (c->bin)
+        return bin_frame_len(c);
+    return scan_line_end(c->cmd, c->cmd_read);
+}
+
 /* parse the command line */
 static int
-which_cmd(Conn *c)
+which_cmd(const char *cmd)
 {
+    // Switch on the first byte so that only the few commands
+    // sharing it are compared. Within a case, a command must come
+    // before any other command that is a prefix of it.
 #define TEST_CMD(s,c,o) if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o);
-    TEST_CMD(c->cmd, CMD_PUT, OP_PUT);
-    TEST_CMD(c->cmd, CMD_PEEKJOB, OP_PEEKJOB);
-    TEST_CMD(c->cmd, CMD_PEEK_READY, OP_PEEK_READY);
-    TEST_CMD(c->cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
-    TEST_CMD(c->cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
-    TEST_CMD(c->cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
-    TEST_CMD(c->cmd, CMD_RESERVE_JOB, OP_RESERVE_JOB);
-    TEST_CMD(c->cmd, CMD_RESERVE, OP_RESERVE);
-    TEST_CMD(c->cmd, CMD_DELETE, OP_DELETE);
-    TEST_CMD(c->cmd, CMD_RELEASE, OP_RELEASE);
-    TEST_CMD(c->cmd, CMD_BURY, OP_BURY);
-    TEST_CMD(c->cmd, CMD_KICK, OP_KICK);
-    TEST_CMD(c->cmd, CMD_KICKJOB, OP_KICKJOB);
-    TEST_CMD(c->cmd, CMD_TOUCH, OP_TOUCH);
-    TEST_CMD(c->cmd, CMD_STATSJOB, OP_STATSJOB);
-    TEST_CMD(c->cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
-    TEST_CMD(c->cmd, CMD_STATS, OP_STATS);
-    TEST_CMD(c->cmd, CMD_USE, OP_USE);
-    TEST_CMD(c->cmd, CMD_WATCH, OP_WATCH);
-    TEST_CMD(c->cmd, CMD_IGNORE, OP_IGNORE);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
-    TEST_CMD(c->cmd, CMD_QUIT, OP_QUIT);
-    TEST_CMD(c->cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
+    switch (cmd[0]) {
+    case 'b':
+        TEST_CMD(cmd, CMD_BURY_RESERVE, OP_BURY_RESERVE);
+        TEST_CMD(cmd, CMD_BURY, OP_BURY);
+        break;
+    case 'd':
+        TEST_CMD(cmd, CMD_DELETE_MANY, OP_DELETE_MANY);
+        TEST_CMD(cmd, CMD_DELETE_RESERVE, OP_DELETE_RESERVE);
+        TEST_CMD(cmd, CMD_DELETE, OP_DELETE);
+        TEST_CMD(cmd, CMD_DUMP_TRACE, OP_DUMP_TRACE);
+        break;
+    case 'i':
+        TEST_CMD(cmd, CMD_IGNORE, OP_IGNORE);
+        break;
+    case 'k':
+        TEST_CMD(cmd, CMD_KICK, OP_KICK);
+        TEST_CMD(cmd, CMD_KICKJOB, OP_KICKJOB);
+        break;
+    case 'l':
+        TEST_CMD(cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
+        TEST_CMD(cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
+        TEST_CMD(cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
+        break;
+    case 'p':
+        TEST_CMD(cmd, CMD_PUT, OP_PUT);
+        TEST_CMD(cmd, CMD_PUT_BATCH, OP_PUT_BATCH);
+        TEST_CMD(cmd, CMD_PEEKJOB, OP_PEEKJOB);
+        TEST_CMD(cmd, CMD_PEEK_READY, OP_PEEK_READY);
+        TEST_CMD(cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
+        TEST_CMD(cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
+        TEST_CMD(cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
+        break;
+    case 'q':
+        TEST_CMD(cmd, CMD_QUIT, OP_QUIT);
+        break;
+    case 'r':
+        TEST_CMD(cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
+        TEST_CMD(cmd, CMD_RESERVE_JOB, OP_RESERVE_JOB);
+        TEST_CMD(cmd, CMD_RESERVE_MANY, OP_RESERVE_MANY);
+        TEST_CMD(cmd, CMD_RESERVE, OP_RESERVE);
+        TEST_CMD(cmd, CMD_RELEASE_MANY, OP_RELEASE_MANY);
+        TEST_CMD(cmd, CMD_RELEASE_RESERVE, OP_RELEASE_RESERVE);
+        TEST_CMD(cmd, CMD_RELEASE, OP_RELEASE);
+        break;
+    case 's':
+        TEST_CMD(cmd, CMD_SUBSCRIBE, OP_SUBSCRIBE);
+        TEST_CMD(cmd, CMD_STATSJOB, OP_STATSJOB);
+        TEST_CMD(cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
+        TEST_CMD(cmd, CMD_STATS_MEMORY, OP_STATS_MEMORY);
+        TEST_CMD(cmd, CMD_STATS_TUBES, OP_STATS_TUBES);
+        TEST_CMD(cmd, CMD_STATS_LOOP, OP_STATS_LOOP);
+        TEST_CMD(cmd, CMD_STATS, OP_STATS);
+        TEST_CMD(cmd, CMD_SET_DURABILITY, OP_SET_DURABILITY);
+        break;
+    case 't':
+        TEST_CMD(cmd, CMD_TOUCH_MANY, OP_TOUCH_MANY);
+        TEST_CMD(cmd, CMD_TOUCH, OP_TOUCH);
+        break;
+    case 'u':
+        TEST_CMD(cmd, CMD_USE, OP_USE);
+        break;
+    case 'w':
+        TEST_CMD(cmd, CMD_WATCH, OP_WATCH);
+        break;
+    }
     return OP_UNKNOWN;
 }
 
+/* for unit tests and benchmarks */
+const char *
+prot_parse(const char *line, int size)
+{
+    size_t n = scan_line_end(line, size);
+
+    if (!n || memchr(line, '\0', n - 2))
+        return NULL;
+    return op_names[which_cmd(line)];
+}
+
+// in_job_size returns how many bytes of c->in_job come from the client.
+// A binary protocol client does not send the "\r\n" after the body.
+static int64
+in_job_size(Conn *c)
+{
+    return c->in_job->r.body_size - (c->bin ? 2 : 0);
+}
+
 /* Copy up to body_size trailing bytes into the job, then the rest into the cmd
  * buffer. If c->in_job exists, this assumes that c->in_job->body is empty.
  * This function is idempotent(). */
@@ -824,7 +1412,7 @@ fill_extra_data(Conn *c)
     int64 job_data_bytes = 0;
     /* how many bytes should we put into the job body? */
     if (c->in_job) {
-        job_data_bytes = min(extra_bytes, c->in_job->r.body_size);
+        job_data_bytes = min(extra_bytes, in_job_size(c));
         memcpy(c->in_job->body, c->cmd + c->cmd_len, job_data_bytes);
         c->in_job_read = job_data_bytes;
     } else if (c->in_job_read) {
@@ -892,7 +1480,8 @@ enqueue_incoming_job(Conn *c)
         reply_serr(c, MSG_INTERNAL_ERROR);
         return;
     }
-    j->walresv = walresvput(&c->srv->wal, j);
+    j->durability = j->tube->durability;
+    j->walresv = walresvput(srvwal(c->srv, j), j);
     if (!j->walresv) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
@@ -909,9 +1498,15 @@ enqueue_incoming_job(Conn *c)
 
     global_stat.total_jobs_ct++;
     j->tube->stat.total_jobs_ct++;
+    tube_record(j->tube, Histsize, j->r.body_size - 2);
+    trace(Trput, c->sock.fd, j->r.id);
 
     if (r == 1) {
-        reply_line(c, STATE_SEND_WORD, MSG_INSERTED_FMT, j->r.id);
+        if (c->bin) {
+            reply_bin(c, BinInserted, 0, j->r.id, STATE_SEND_WORD);
+        } else {
+            reply_nums(c, STATE_SEND_WORD, MSG_INSERTED, 1, j->r.id, 0);
+        }
         return;
     }
 
@@ -920,82 +1515,401 @@ enqueue_incoming_job(Conn *c)
     reply_line(c, STATE_SEND_WORD, MSG_BURIED_FMT, j->r.id);
 }
 
-static uint
+// The stats encoder appends "name: value\n" fields to stats_buf,
+// or with stats_json set, the members of a JSON object. All stats
+// replies reuse stats_buf, so that each reply is formatted in one
+// pass and without printf. It grows as needed and is freed after
+// a reply bigger than STATS_BUF_KEEP bytes.
+#define STATS_BUF_KEEP (64 * 1024)
+
+static char   *stats_buf;
+static size_t stats_cap;
+static size_t stats_len;
+static int    stats_oom;
+static int    stats_json;
+static uint   stats_nitem;      // items so far in the current JSON object or array
+
+// stats_room makes room for n more bytes in stats_buf and returns
+// where they go, or NULL if we are out of memory.
+static char *
+stats_room(size_t n)
+{
+    size_t cap;
+    char *b;
+
+    if (stats_oom)
+        return NULL;
+    if (stats_len + n > stats_cap) {
+        cap = stats_cap ? stats_cap * 2 : 4096;
+        if (cap < stats_len + n)
+            cap = stats_len + n;
+        b = realloc(stats_buf, cap);
+        if (!b) {
+            twarnx("OOM");
+            stats_oom = 1;
+            return NULL;
+        }
+        stats_buf = b;
+        stats_cap = cap;
+    }
+    return stats_buf + stats_len;
+}
+
+static void
+stats_raw(const char *s, size_t n)
+{
+    char *p = stats_room(n);
+    if (p) {
+        memcpy(p, s, n);
+        stats_len += n;
+    }
+}
+
+// stats_quote writes s to p as a JSON string, which takes
+// at most 6 bytes per byte of s plus 2, and returns its end.
+static char *
+stats_quote(char *p, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char ch;
+
+    *p++ = '"';
+    for (; (ch = *s); s++) {
+        if (ch == '"' || ch == '\\') {
+            *p++ = '\\';
+            *p++ = ch;
+        } else if (ch < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[ch >> 4];
+            p[5] = hex[ch & 15];
+            p += 6;
+        } else {
+            *p++ = ch;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+// stats_name starts the field name, leaving room for a value
+// of up to n bytes, and returns where the value goes.
+static char *
+stats_name(const char *name, size_t n)
+{
+    size_t len = strlen(name);
+    char *p = stats_room(len + 4 + n + 1);
+
+    if (!p)
+        return NULL;
+    if (stats_json) {
+        if (stats_nitem++)
+            *p++ = ',';
+        *p++ = '"';
+        memcpy(p, name, len);
+        p += len;
+        *p++ = '"';
+        *p++ = ':';
+    } else {
+        memcpy(p, name, len);
+        p += len;
+        *p++ = ':';
+        *p++ = ' ';
+    }
+    return p;
+}
+
+// stats_end ends the field whose value ends at p.
+static void
+stats_end(char *p)
+{
+    if (!stats_json)
+        *p++ = '\n';
+    stats_len = p - stats_buf;
+}
+
+static void
+stats_u64(const char *name, uint64 v)
+{
+    char *p = stats_name(name, 20);
+    if (p)
+        stats_end(fmtu64(p, v));
+}
+
+static void
+stats_i64(const char *name, int64 v)
+{
+    char *p = stats_name(name, 21);
+    if (p)
+        stats_end(fmti64(p, v));
+}
+
+static void
+stats_bool(const char *name, int v)
+{
+    char *p = stats_name(name, 5);
+    if (!p)
+        return;
+    memcpy(p, v ? "true" : "false", 5);
+    stats_end(p + (v ? 4 : 5));
+}
+
+// stats_str writes a string value. In YAML, it is in double
+// quotes if quote is set; JSON strings are always quoted.
+static void
+stats_str(const char *name, const char *s, int quote)
+{
+    size_t n = strlen(s);
+    char *p = stats_name(name, n * 6 + 2);
+    if (!p)
+        return;
+    if (stats_json) {
+        stats_end(stats_quote(p, s));
+        return;
+    }
+    if (quote)
+        *p++ = '"';
+    memcpy(p, s, n);
+    p += n;
+    if (quote)
+        *p++ = '"';
+    stats_end(p);
+}
+
+// stats_list writes a list of n strings.
+static void
+stats_list(const char *name, const char **s, int n)
+{
+    size_t size = 2;
+    char *p;
+    int i;
+
+    for (i = 0; i < n; i++)
+        size += strlen(s[i]) * 6 + 4;
+    p = stats_name(name, size);
+    if (!p)
+        return;
+    *p++ = '[';
+    for (i = 0; i < n; i++) {
+        if (i)
+            *p++ = ',';
+        if (stats_json) {
+            p = stats_quote(p, s[i]);
+        } else {
+            if (i)
+                *p++ = ' ';
+            memcpy(p, s[i], strlen(s[i]));
+            p += strlen(s[i]);
+        }
+    }
+    *p++ = ']';
+    stats_end(p);
+}
+
+// stats_rows starts a list of rows, see stats_row.
+static void
+stats_rows(const char *name)
+{
+    char *p = stats_name(name, 1);
+    if (!p)
+        return;
+    if (stats_json) {
+        *p++ = '[';
+        stats_nitem = 0;
+    } else {
+        p--; /* no space after the colon */
+    }
+    stats_end(p);
+}
+
+// stats_rows_end ends a list of n rows.
+static void
+stats_rows_end(uint n)
+{
+    if (stats_json) {
+        stats_raw("]", 1);
+        stats_nitem = 1;
+    } else if (!n) {
+        // an empty list must be written in flow style
+        stats_len--;
+        stats_raw(" []\n", 4);
+    }
+}
+
+// stats_row writes a row of the list started by stats_rows:
+// the YAML "- [name, v...]\n", or the JSON array ["name",v...].
+static void
+stats_row(const char *name, int64 *v, int n)
+{
+    char *p = stats_room(strlen(name) * 6 + 6 + n * (2 + 21) + 2);
+    int i;
+
+    if (!p)
+        return;
+    if (stats_json) {
+        if (stats_nitem++)
+            *p++ = ',';
+        *p++ = '[';
+        p = stats_quote(p, name);
+    } else {
+        *p++ = '-';
+        *p++ = ' ';
+        *p++ = '[';
+        memcpy(p, name, strlen(name));
+        p += strlen(name);
+    }
+    for (i = 0; i < n; i++) {
+        *p++ = ',';
+        if (!stats_json)
+            *p++ = ' ';
+        p = fmti64(p, v[i]);
+    }
+    *p++ = ']';
+    stats_end(p);
+}
+
+// stats_time writes a time value as seconds with six decimals.
+static void
+stats_time(const char *name, struct timeval *tv)
+{
+    char *p = stats_name(name, 20 + 7);
+    int i;
+    long us = tv->tv_usec;
+
+    if (!p)
+        return;
+    p = fmtu64(p, tv->tv_sec);
+    *p++ = '.';
+    for (i = 5; i >= 0; i--) {
+        p[i] = '0' + us % 10;
+        us /= 10;
+    }
+    stats_end(p + 6);
+}
+
+static uint
 uptime()
 {
     return (nanoseconds() - started_at) / 1000000000;
 }
 
-static int
-fmt_stats(char *buf, size_t size, void *x)
+// fmt_hists writes the percentiles of the histograms h, which
+// may be NULL if nothing was recorded yet.
+static void
+fmt_hists(Hist *h)
+{
+    static const char *names[Nhist][3] = {
+        [Histwait] = {"wait-p50-us", "wait-p90-us", "wait-p99-us"},
+        [Histservice] = {"service-p50-us", "service-p90-us", "service-p99-us"},
+        [Histsize] = {"body-size-p50", "body-size-p90", "body-size-p99"},
+    };
+    static const uint permille[3] = {500, 900, 990};
+    int k, i;
+    uint64 v;
+
+    for (k = 0; k < Nhist; k++) {
+        for (i = 0; i < 3; i++) {
+            v = h ? hist_percentile(&h[k], permille[i]) : 0;
+            if (k != Histsize)
+                v /= 1000;
+            stats_u64(names[k][i], v);
+        }
+    }
+}
+
+static void
+fmt_stats(void *x)
 {
     int whead = 0, wcur = 0;
+    int64 nmig = 0, nrec = 0;
+    int i;
     Server *s = x;
     struct rusage ru;
 
-    s = x;
-
-    if (s->wal.head) {
-        whead = s->wal.head->seq;
-    }
-
-    if (s->wal.cur) {
-        wcur = s->wal.cur->seq;
+    // With several partitions, report the oldest file still
+    // needed by any of them and the newest one being written.
+    for (i = 0; i < s->nwal; i++) {
+        Wal *w = &s->wals[i];
+        if (w->head && (!whead || w->head->seq < whead)) {
+            whead = w->head->seq;
+        }
+        if (w->cur && w->cur->seq > wcur) {
+            wcur = w->cur->seq;
+        }
+        nmig += w->nmig;
+        nrec += w->nrec;
     }
 
     getrusage(RUSAGE_SELF, &ru); /* don't care if it fails */
-    return snprintf(buf, size, STATS_FMT,
-                    global_stat.urgent_ct,
-                    ready_ct,
-                    global_stat.reserved_ct,
-                    get_delayed_job_ct(),
-                    global_stat.buried_ct,
-                    op_ct[OP_PUT],
-                    op_ct[OP_PEEKJOB],
-                    op_ct[OP_PEEK_READY],
-                    op_ct[OP_PEEK_DELAYED],
-                    op_ct[OP_PEEK_BURIED],
-                    op_ct[OP_RESERVE],
-                    op_ct[OP_RESERVE_TIMEOUT],
-                    op_ct[OP_DELETE],
-                    op_ct[OP_RELEASE],
-                    op_ct[OP_USE],
-                    op_ct[OP_WATCH],
-                    op_ct[OP_IGNORE],
-                    op_ct[OP_BURY],
-                    op_ct[OP_KICK],
-                    op_ct[OP_TOUCH],
-                    op_ct[OP_STATS],
-                    op_ct[OP_STATSJOB],
-                    op_ct[OP_STATS_TUBE],
-                    op_ct[OP_LIST_TUBES],
-                    op_ct[OP_LIST_TUBE_USED],
-                    op_ct[OP_LIST_TUBES_WATCHED],
-                    op_ct[OP_PAUSE_TUBE],
-                    timeout_ct,
-                    global_stat.total_jobs_ct,
-                    job_data_size_limit,
-                    tubes.len,
-                    count_cur_conns(),
-                    count_cur_producers(),
-                    count_cur_workers(),
-                    global_stat.waiting_ct,
-                    count_tot_conns(),
-                    (long) getpid(),
-                    version,
-                    (int) ru.ru_utime.tv_sec, (int) ru.ru_utime.tv_usec,
-                    (int) ru.ru_stime.tv_sec, (int) ru.ru_stime.tv_usec,
-                    uptime(),
-                    whead,
-                    wcur,
-                    s->wal.nmig,
-                    s->wal.nrec,
-                    s->wal.filesize,
-                    drain_mode ? "true" : "false",
-                    instance_hex,
-                    node_info.nodename,
-                    node_info.version,
-                    node_info.machine);
+    stats_u64("current-jobs-urgent", global_stat.urgent_ct);
+    stats_u64("current-jobs-ready", ready_ct);
+    stats_u64("current-jobs-reserved", global_stat.reserved_ct);
+    stats_u64("current-jobs-delayed", delayed_ct);
+    stats_u64("current-jobs-buried", global_stat.buried_ct);
+    stats_u64("cmd-put", op_ct[OP_PUT]);
+    stats_u64("cmd-peek", op_ct[OP_PEEKJOB]);
+    stats_u64("cmd-peek-ready", op_ct[OP_PEEK_READY]);
+    stats_u64("cmd-peek-delayed", op_ct[OP_PEEK_DELAYED]);
+    stats_u64("cmd-peek-buried", op_ct[OP_PEEK_BURIED]);
+    stats_u64("cmd-reserve", op_ct[OP_RESERVE]);
+    stats_u64("cmd-reserve-with-timeout", op_ct[OP_RESERVE_TIMEOUT]);
+    stats_u64("cmd-delete", op_ct[OP_DELETE]);
+    stats_u64("cmd-release", op_ct[OP_RELEASE]);
+    stats_u64("cmd-use", op_ct[OP_USE]);
+    stats_u64("cmd-watch", op_ct[OP_WATCH]);
+    stats_u64("cmd-ignore", op_ct[OP_IGNORE]);
+    stats_u64("cmd-bury", op_ct[OP_BURY]);
+    stats_u64("cmd-kick", op_ct[OP_KICK]);
+    stats_u64("cmd-touch", op_ct[OP_TOUCH]);
+    stats_u64("cmd-stats", op_ct[OP_STATS]);
+    stats_u64("cmd-stats-job", op_ct[OP_STATSJOB]);
+    stats_u64("cmd-stats-tube", op_ct[OP_STATS_TUBE]);
+    stats_u64("cmd-list-tubes", op_ct[OP_LIST_TUBES]);
+    stats_u64("cmd-list-tube-used", op_ct[OP_LIST_TUBE_USED]);
+    stats_u64("cmd-list-tubes-watched", op_ct[OP_LIST_TUBES_WATCHED]);
+    stats_u64("cmd-pause-tube", op_ct[OP_PAUSE_TUBE]);
+    stats_u64("cmd-set-durability", op_ct[OP_SET_DURABILITY]);
+    stats_u64("cmd-stats-memory", op_ct[OP_STATS_MEMORY]);
+    stats_u64("cmd-put-batch", op_ct[OP_PUT_BATCH]);
+    stats_u64("cmd-reserve-many", op_ct[OP_RESERVE_MANY]);
+    stats_u64("cmd-delete-many", op_ct[OP_DELETE_MANY]);
+    stats_u64("cmd-touch-many", op_ct[OP_TOUCH_MANY]);
+    stats_u64("cmd-release-many", op_ct[OP_RELEASE_MANY]);
+    stats_u64("cmd-delete-reserve", op_ct[OP_DELETE_RESERVE]);
+    stats_u64("cmd-release-reserve", op_ct[OP_RELEASE_RESERVE]);
+    stats_u64("cmd-bury-reserve", op_ct[OP_BURY_RESERVE]);
+    stats_u64("cmd-subscribe", op_ct[OP_SUBSCRIBE]);
+    stats_u64("cmd-stats-tubes", op_ct[OP_STATS_TUBES]);
+    stats_u64("cmd-stats-loop", op_ct[OP_STATS_LOOP]);
+    stats_u64("cmd-dump-trace", op_ct[OP_DUMP_TRACE]);
+    stats_u64("job-timeouts", timeout_ct);
+    stats_u64("total-jobs", global_stat.total_jobs_ct);
+    stats_u64("max-job-size", job_data_size_limit);
+    stats_u64("current-tubes", tubes.len);
+    stats_u64("current-connections", count_cur_conns());
+    stats_u64("current-producers", count_cur_producers());
+    stats_u64("current-workers", count_cur_workers());
+    stats_u64("current-waiting", global_stat.waiting_ct);
+    stats_u64("total-connections", count_tot_conns());
+    stats_i64("pid", getpid());
+    stats_str("version", version, 1);
+    stats_time("rusage-utime", &ru.ru_utime);
+    stats_time("rusage-stime", &ru.ru_stime);
+    stats_u64("uptime", uptime());
+    stats_i64("binlog-oldest-index", whead);
+    stats_i64("binlog-current-index", wcur);
+    stats_i64("binlog-records-migrated", nmig);
+    stats_i64("binlog-records-written", nrec);
+    stats_i64("binlog-max-size", s->wal.filesize);
+    stats_u64("body-resident-bytes", body_resident);
+    stats_u64("body-cache-hits", body_hit_ct);
+    stats_u64("body-cache-misses", body_miss_ct);
+    stats_u64("body-evictions", body_evict_ct);
+    fmt_hists(hist_all);
+    stats_bool("draining", drain_mode);
+    stats_str("id", instance_hex, 0);
+    stats_str("hostname", node_info.nodename, 0);
+    stats_str("os", node_info.version, 1);
+    stats_str("platform", node_info.machine, 0);
 }
 
 /* Read an integer from the given buffer and place it in num.
@@ -1077,6 +1991,42 @@ read_duration(int64 *duration, const char *buf, char **end)
     return 0;
 }
 
+// read_timeout reads an optional timeout in seconds from buf, which
+// must hold nothing else. A missing timeout is read as -1, wait forever.
+// Returns 0 on success, or nonzero on failure.
+static int
+read_timeout(int *timeout, const char *buf)
+{
+    char *end;
+    long n;
+
+    while (buf[0] == ' ')
+        buf++;
+    if (buf[0] == '\0') {
+        *timeout = -1;
+        return 0;
+    }
+    errno = 0;
+    n = strtol(buf, &end, 10);
+    if (errno || end == buf || end[0] != '\0' || n < INT_MIN || n > INT_MAX)
+        return -1;
+    *timeout = n;
+    return 0;
+}
+
+// read_format reads the optional format argument of the stats
+// commands at s: it returns 1 for " json", 0 if s is empty,
+// or -1 otherwise.
+static int
+read_format(const char *s)
+{
+    if (s[0] == '\0')
+        return 0;
+    if (strcmp(s, " json") == 0)
+        return 1;
+    return -1;
+}
+
 /* Read a tube name from the given buffer moving the buffer to the name start */
 static int
 read_tube_name(char **tubename, char *buf, char **end)
@@ -1095,11 +2045,15 @@ read_tube_name(char **tubename, char *buf, char **end)
     return 0;
 }
 
+// wait_for_job puts c in the waiting state until a job is ready or
+// timeout expires. If n is nonzero, c takes up to n jobs at once.
 static void
-wait_for_job(Conn *c, int timeout)
+wait_for_job(Conn *c, int timeout, uint n)
 {
     c->state = STATE_WAIT;
-    enqueue_waiting_conn(c);
+    c->want_jobs = n;
+    if (!conn_waiting(c)) /* a subscribed conn may be waiting already */
+        enqueue_waiting_conn(c);
 
     /* Set the pending timeout to the requested timeout amount */
     c->pending_timeout = timeout;
@@ -1108,15 +2062,47 @@ wait_for_job(Conn *c, int timeout)
     epollq_add(c, 'h');
 }
 
-typedef int(*fmt_fn)(char *, size_t, void *);
-
+// reserve_next makes c a worker waiting for up to n jobs, see
+// wait_for_job, unless it has a reserved job whose deadline is soon.
 static void
-do_stats(Conn *c, fmt_fn fmt, void *data)
+reserve_next(Conn *c, int timeout, uint n)
 {
-    int r, stats_len;
+    connsetworker(c);
 
-    /* first, measure how big a buffer we will need */
-    stats_len = fmt(NULL, 0, data) + 16;
+    if (conndeadlinesoon(c) && !conn_ready(c)) {
+        reply_msg(c, MSG_DEADLINE_SOON);
+        return;
+    }
+
+    /* try to get a new job for this guy */
+    wait_for_job(c, timeout, n);
+    process_queue();
+}
+
+typedef void(*fmt_fn)(void *);
+
+// do_stats formats the stats with fmt into stats_buf, as YAML or
+// if json is set as a JSON object, and replies with a copy of them.
+static void
+do_stats(Conn *c, fmt_fn fmt, void *data, int json)
+{
+    stats_len = 0;
+    stats_oom = 0;
+    stats_json = json;
+    stats_nitem = 0;
+    if (json) {
+        stats_raw("{", 1);
+        fmt(data);
+        stats_raw("}\r\n", 3);
+    } else {
+        stats_raw("---\n", 4);
+        fmt(data);
+        stats_raw("\r\n", 2);
+    }
+    if (stats_oom) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
 
     c->out_job = allocate_job(stats_len); /* fake job to hold stats data */
     if (!c->out_job) {
@@ -1126,18 +2112,38 @@ do_stats(Conn *c, fmt_fn fmt, void *data)
 
     /* Mark this job as a copy so it can be appropriately freed later on */
     c->out_job->r.state = Copy;
+    memcpy(c->out_job->body, stats_buf, stats_len);
+    if (stats_cap > STATS_BUF_KEEP) {
+        free(stats_buf);
+        stats_buf = NULL;
+        stats_cap = 0;
+    }
 
-    /* now actually format the stats data */
-    r = fmt(c->out_job->body, stats_len, data);
-    /* and set the actual body size */
-    c->out_job->r.body_size = r;
-    if (r > stats_len) {
-        reply_serr(c, MSG_INTERNAL_ERROR);
+    c->out_job_sent = 0;
+    reply_nums(c, STATE_SEND_JOB, MSG_OK, 1, c->out_job->r.body_size - 2, 0);
+}
+
+// do_dump_trace replies with the events in the flight recorder,
+// in text or binary form, see tracefmt.
+static void
+do_dump_trace(Conn *c, int binary)
+{
+    Job *j;
+    size_t n;
+
+    j = allocate_job(tracesize(binary) + 2);
+    if (!j) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
     }
+    j->r.state = Copy;
+    n = tracefmt(j->body, binary);
+    memcpy(j->body + n, "\r\n", 2);
+    j->r.body_size = n + 2;
 
+    c->out_job = j;
     c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "OK %d\r\n", r - 2);
+    reply_nums(c, STATE_SEND_JOB, MSG_OK, 1, n, 0);
 }
 
 static void
@@ -1174,11 +2180,11 @@ do_list_tubes(Conn *c, Ms *l)
     buf[1] = '\n';
 
     c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "OK %zu\r\n", resp_z - 2);
+    reply_nums(c, STATE_SEND_JOB, MSG_OK, 1, resp_z - 2, 0);
 }
 
-static int
-fmt_job_stats(char *buf, size_t size, Job *j)
+static void
+fmt_job_stats(Job *j)
 {
     int64 t;
     int64 time_left;
@@ -1193,25 +2199,24 @@ fmt_job_stats(char *buf, size_t size, Job *j)
     if (j->file) {
         file = j->file->seq;
     }
-    return snprintf(buf, size, STATS_JOB_FMT,
-            j->r.id,
-            j->tube->name,
-            job_state(j),
-            j->r.pri,
-            (t - j->r.created_at) / 1000000000,
-            j->r.delay / 1000000000,
-            j->r.ttr / 1000000000,
-            time_left,
-            file,
-            j->r.reserve_ct,
-            j->r.timeout_ct,
-            j->r.release_ct,
-            j->r.bury_ct,
-            j->r.kick_ct);
+    stats_u64("id", j->r.id);
+    stats_str("tube", j->tube->name, 0);
+    stats_str("state", job_state(j), 0);
+    stats_u64("pri", j->r.pri);
+    stats_i64("age", (t - j->r.created_at) / 1000000000);
+    stats_i64("delay", j->r.delay / 1000000000);
+    stats_i64("ttr", j->r.ttr / 1000000000);
+    stats_i64("time-left", time_left);
+    stats_i64("file", file);
+    stats_u64("reserves", j->r.reserve_ct);
+    stats_u64("timeouts", j->r.timeout_ct);
+    stats_u64("releases", j->r.release_ct);
+    stats_u64("buries", j->r.bury_ct);
+    stats_u64("kicks", j->r.kick_ct);
 }
 
-static int
-fmt_stats_tube(char *buf, size_t size, Tube *t)
+static void
+fmt_stats_tube(Tube *t)
 {
     uint64 time_left;
 
@@ -1220,21 +2225,491 @@ fmt_stats_tube(char *buf, size_t size, Tube *t)
     } else {
         time_left = 0;
     }
-    return snprintf(buf, size, STATS_TUBE_FMT,
-            t->name,
-            t->stat.urgent_ct,
-            t->ready.len,
-            t->stat.reserved_ct,
-            t->delay.len,
-            t->stat.buried_ct,
-            t->stat.total_jobs_ct,
-            t->using_ct,
-            t->watching_ct,
-            t->stat.waiting_ct,
-            t->stat.total_delete_ct,
-            t->stat.pause_ct,
-            t->pause / 1000000000,
-            time_left);
+    stats_str("name", t->name, 0);
+    stats_u64("current-jobs-urgent", t->stat.urgent_ct);
+    stats_u64("current-jobs-ready", t->ready.len);
+    stats_u64("current-jobs-reserved", t->stat.reserved_ct);
+    stats_u64("current-jobs-delayed", t->delay.len);
+    stats_u64("current-jobs-buried", t->stat.buried_ct);
+    stats_u64("total-jobs", t->stat.total_jobs_ct);
+    stats_u64("current-using", t->using_ct);
+    stats_u64("current-watching", t->watching_ct);
+    stats_u64("current-waiting", t->stat.waiting_ct);
+    stats_u64("cmd-delete", t->stat.total_delete_ct);
+    stats_u64("cmd-pause-tube", t->stat.pause_ct);
+    stats_u64("pause", t->pause / 1000000000);
+    stats_i64("pause-time-left", time_left);
+    stats_str("durability", durname(t->durability), 0);
+    fmt_hists(t->hist);
+}
+
+// A page of the stats-tubes table: up to limit tubes whose names
+// start with prefix and sort after the name after, in name order.
+// A limit of 0 means no limit.
+struct tubes_page {
+    const char *prefix;
+    const char *after;
+    uint32 limit;
+};
+
+static const char *stats_tubes_columns[] = {
+    "name", "current-jobs-urgent", "current-jobs-ready",
+    "current-jobs-reserved", "current-jobs-delayed", "current-jobs-buried",
+    "total-jobs", "current-using", "current-watching", "current-waiting",
+    "cmd-delete", "cmd-pause-tube", "pause", "pause-time-left",
+};
+
+static int
+tube_name_cmp(const void *a, const void *b)
+{
+    return strcmp((*(Tube **)a)->name, (*(Tube **)b)->name);
+}
+
+// fmt_stats_tubes writes the counters of stats-tube for a page of
+// tubes as a table, one row per tube, and in "next" the name of the
+// last tube if more tubes follow, or "" if this is the last page.
+// Paging by name rather than by position keeps the pages consistent
+// while tubes come and go.
+static void
+fmt_stats_tubes(struct tubes_page *pg)
+{
+    size_t i, n = 0, plen = strlen(pg->prefix);
+    const char *next = "";
+    int64 now = nanoseconds(), v[13];
+    Tube **sel;
+
+    sel = malloc((tubes.len + 1) * sizeof *sel);
+    if (!sel) {
+        stats_oom = 1;
+        return;
+    }
+    for (i = 0; i < tubes.len; i++) {
+        Tube *t = tubes.items[i];
+        if (strncmp(t->name, pg->prefix, plen) == 0 &&
+            strcmp(t->name, pg->after) > 0) {
+            sel[n++] = t;
+        }
+    }
+    qsort(sel, n, sizeof *sel, tube_name_cmp);
+    if (pg->limit && n > pg->limit) {
+        n = pg->limit;
+        next = sel[n - 1]->name;
+    }
+
+    stats_list("columns", stats_tubes_columns, 14);
+    stats_rows("tubes");
+    for (i = 0; i < n; i++) {
+        Tube *t = sel[i];
+        v[0] = t->stat.urgent_ct;
+        v[1] = t->ready.len;
+        v[2] = t->stat.reserved_ct;
+        v[3] = t->delay.len;
+        v[4] = t->stat.buried_ct;
+        v[5] = t->stat.total_jobs_ct;
+        v[6] = t->using_ct;
+        v[7] = t->watching_ct;
+        v[8] = t->stat.waiting_ct;
+        v[9] = t->stat.total_delete_ct;
+        v[10] = t->stat.pause_ct;
+        v[11] = t->pause / 1000000000;
+        v[12] = t->pause > 0 ? (t->unpause_at - now) / 1000000000 : 0;
+        stats_row(t->name, v, 13);
+    }
+    stats_rows_end(n);
+    stats_str("next", next, 1);
+    free(sel);
+}
+
+// prot_publish writes the counters of stats, stats-tube and
+// stats-loop to the stats file, see -S.
+void
+prot_publish(Server *s)
+{
+    Shmhdr *h;
+    size_t i;
+    int64 now = nanoseconds();
+
+    h = shmbegin(tubes.len);
+    if (!h)
+        return;
+
+    h->at = now;
+    h->started = started_at;
+    h->global.urgent = global_stat.urgent_ct;
+    h->global.ready = ready_ct;
+    h->global.reserved = global_stat.reserved_ct;
+    h->global.delayed = delayed_ct;
+    h->global.buried = global_stat.buried_ct;
+    h->global.total_jobs = global_stat.total_jobs_ct;
+    h->global.timeouts = timeout_ct;
+    h->global.conns = count_cur_conns();
+    h->global.total_conns = count_tot_conns();
+    h->global.producers = count_cur_producers();
+    h->global.workers = count_cur_workers();
+    h->global.waiting = global_stat.waiting_ct;
+    h->global.body_resident = body_resident;
+    h->global.draining = drain_mode;
+
+    memset(&h->wal, 0, sizeof h->wal);
+    for (i = 0; i < (size_t)s->nwal; i++) {
+        Wal *w = &s->wals[i];
+        if (w->head && (!h->wal.oldest || w->head->seq < h->wal.oldest))
+            h->wal.oldest = w->head->seq;
+        if (w->cur && w->cur->seq > h->wal.current)
+            h->wal.current = w->cur->seq;
+        h->wal.nrec += w->nrec;
+        h->wal.nmig += w->nmig;
+        h->wal.nwrite += w->nwrite;
+        h->wal.write_ns += w->write_ns;
+        h->wal.nsync += w->nsync;
+        h->wal.sync_ns += w->sync_ns;
+        h->wal.ncompact += w->ncompact;
+        h->wal.compact_ns += w->compact_ns;
+    }
+
+    h->nop = TOTAL_OPS;
+    for (i = 0; i < TOTAL_OPS; i++) {
+        h->op[i] = op_ct[i];
+        strncpy(h->opname[i], op_names[i], Shmopname - 1);
+    }
+
+    h->ntube = tubes.len;
+    for (i = 0; i < tubes.len; i++) {
+        Tube *t = tubes.items[i];
+        Shmtube *st = &h->tube[i];
+        strcpy(st->name, t->name);
+        st->urgent = t->stat.urgent_ct;
+        st->ready = t->ready.len;
+        st->reserved = t->stat.reserved_ct;
+        st->delayed = t->delay.len;
+        st->buried = t->stat.buried_ct;
+        st->total_jobs = t->stat.total_jobs_ct;
+        st->using = t->using_ct;
+        st->watching = t->watching_ct;
+        st->waiting = t->stat.waiting_ct;
+        st->deletes = t->stat.total_delete_ct;
+        st->pauses = t->stat.pause_ct;
+        st->pause_left = t->pause > 0 ? t->unpause_at - now : 0;
+    }
+    shmend(h);
+}
+
+// memused returns the number of bytes held by jobs, tubes,
+// connections and the structures that index them.
+static size_t
+memused()
+{
+    return get_all_jobs_used() * sizeof(Job) + body_resident +
+        job_hash_bytes() + heap_bytes + ms_bytes +
+        tubes.len * sizeof(Tube) + count_cur_conns() * sizeof(Conn);
+}
+
+static void
+fmt_stats_memory(void *x)
+{
+    UNUSED_PARAMETER(x);
+    stats_u64("limit", mem_limit);
+    stats_u64("used", memused());
+    stats_u64("jobs", get_all_jobs_used() * sizeof(Job));
+    stats_u64("job-bodies", body_resident);
+    stats_u64("job-hash", job_hash_bytes());
+    stats_u64("heaps", heap_bytes);
+    stats_u64("sets", ms_bytes);
+    stats_u64("tubes", tubes.len * sizeof(Tube));
+    stats_u64("conns", count_cur_conns() * sizeof(Conn));
+    stats_u64("rejected-puts", mem_reject_ct);
+}
+
+// stats_pcts writes the 50th, 90th and 99th percentiles of h
+// as name-p50-ns, name-p90-ns and name-p99-ns.
+static void
+stats_pcts(const char *name, Hist *h)
+{
+    static const char *suffix[3] = {"-p50-ns", "-p90-ns", "-p99-ns"};
+    static const uint permille[3] = {500, 900, 990};
+    char buf[64];
+    size_t n = strlen(name);
+    int i;
+
+    memcpy(buf, name, n);
+    for (i = 0; i < 3; i++) {
+        strcpy(buf + n, suffix[i]);
+        stats_u64(buf, hist_percentile(h, permille[i]));
+    }
+}
+
+static const char *stats_loop_columns[] = {
+    "name", "count", "p50-ns", "p90-ns", "p99-ns",
+};
+
+static void
+fmt_stats_loop(void *x)
+{
+    Server *s = x;
+    struct Loopstat *l = &s->loop;
+    int64 nwrite = 0, write_ns = 0, nsync = 0, sync_ns = 0;
+    int64 ncompact = 0, compact_ns = 0, v[4];
+    char name[32];
+    uint n = 0;
+    int i;
+
+    for (i = 0; i < s->nwal; i++) {
+        Wal *w = &s->wals[i];
+        nwrite += w->nwrite;
+        write_ns += w->write_ns;
+        nsync += w->nsync;
+        sync_ns += w->sync_ns;
+        ncompact += w->ncompact;
+        compact_ns += w->compact_ns;
+    }
+
+    stats_u64("loop-iterations", l->iter);
+    stats_u64("loop-events", l->events);
+    stats_u64("loop-slow", l->slow);
+    stats_u64("loop-slow-threshold-ns", Slowloop);
+    stats_i64("loop-busy-ns", l->busy_ns);
+    stats_pcts("loop-busy", &l->busy);
+    stats_i64("loop-tick-ns", l->tick_ns);
+    stats_pcts("loop-tick", &l->tick);
+    stats_u64("epollq-p50", hist_percentile(&epollq_hist, 500));
+    stats_u64("epollq-p99", hist_percentile(&epollq_hist, 990));
+    stats_u64("epollq-max", epollq_max);
+    stats_i64("binlog-writes", nwrite);
+    stats_i64("binlog-write-ns", write_ns);
+    stats_i64("binlog-syncs", nsync);
+    stats_i64("binlog-sync-ns", sync_ns);
+    stats_i64("binlog-compactions", ncompact);
+    stats_i64("binlog-compact-ns", compact_ns);
+
+    stats_list("columns", stats_loop_columns, 5);
+    stats_rows("ops");
+    for (i = 0; i < TOTAL_OPS; i++) {
+        Hist *h = &op_hist[i];
+        size_t len;
+
+        if (!h->count)
+            continue;
+        // the command names used for parsing may end in a space
+        len = strlen(op_names[i]);
+        if (op_names[i][len - 1] == ' ')
+            len--;
+        memcpy(name, op_names[i], len);
+        name[len] = '\0';
+        v[0] = h->count;
+        v[1] = hist_percentile(h, 500);
+        v[2] = hist_percentile(h, 900);
+        v[3] = hist_percentile(h, 990);
+        stats_row(name, v, 4);
+        n++;
+    }
+    stats_rows_end(n);
+}
+
+// read_batch_entry parses the put-batch entry at *p, which must end
+// before end: "<pri> <delay> <ttr> <bytes>\r\n<data>\r\n".
+// On success it fills in the fields, points *body at <data>, moves *p
+// past the entry and returns NULL. Otherwise it returns the reply.
+static char *
+read_batch_entry(char **p, char *end, uint32 *pri, int64 *delay,
+                 int64 *ttr, uint32 *size, char **body)
+{
+    char line[BATCH_LINE_MAX];
+    char *nl, *delay_buf, *ttr_buf, *size_buf, *end_buf;
+    size_t n;
+
+    nl = memchr(*p, '\n', min(end - *p, BATCH_LINE_MAX));
+    if (!nl || nl == *p || nl[-1] != '\r') {
+        return MSG_BAD_FORMAT;
+    }
+    n = nl - 1 - *p;
+    memcpy(line, *p, n);
+    line[n] = '\0';
+    if (read_u32(pri, line, &delay_buf) ||
+        read_duration(delay, delay_buf, &ttr_buf) ||
+        read_duration(ttr, ttr_buf, &size_buf) ||
+        read_u32(size, size_buf, &end_buf) ||
+        end_buf[0] != '\0') {
+        return MSG_BAD_FORMAT;
+    }
+    if (*size > job_data_size_limit) {
+        return MSG_JOB_TOO_BIG;
+    }
+    *body = nl + 1;
+    if (end - *body < (int64)*size + 2) {
+        return MSG_BAD_FORMAT;
+    }
+    if (memcmp(*body + *size, "\r\n", 2)) {
+        return MSG_EXPECTED_CRLF;
+    }
+    *p = *body + *size + 2;
+    return NULL;
+}
+
+// enqueue_incoming_batch inserts the jobs of a complete put-batch,
+// whose entries c->in_job holds. Nothing is inserted unless all the
+// entries are well formed. The binlog records of the jobs are written
+// in one batch and the queue is processed once.
+static void
+enqueue_incoming_batch(Conn *c)
+{
+    Job *b = c->in_job;
+    Job *j;
+    char *p, *end, *body, *msg;
+    uint32 i, pri, size;
+    int64 delay, ttr;
+    uint64 first = 0, last = 0;
+
+    c->in_job = NULL; /* the connection no longer owns the entries */
+    c->in_job_read = 0;
+
+    /* check if the trailer is present and correct */
+    end = b->body + b->r.body_size - 2;
+    if (memcmp(end, "\r\n", 2)) {
+        job_free(b);
+        reply_msg(c, MSG_EXPECTED_CRLF);
+        return;
+    }
+
+    if (drain_mode) {
+        job_free(b);
+        reply_serr(c, MSG_DRAINING);
+        return;
+    }
+
+    p = b->body;
+    for (i = 0; i < c->in_count; i++) {
+        msg = read_batch_entry(&p, end, &pri, &delay, &ttr, &size, &body);
+        if (msg) {
+            job_free(b);
+            reply(c, msg, strlen(msg), STATE_SEND_WORD);
+            return;
+        }
+    }
+    if (p != end) {
+        job_free(b);
+        reply_msg(c, MSG_BAD_FORMAT);
+        return;
+    }
+
+    // Make the jobs, reserve binlog space for them and insert them one
+    // at a time, so that each record is written to the binlog file its
+    // space was reserved in. If we run out of memory or binlog space,
+    // only the jobs made so far are inserted.
+    batch_wal(c->srv, 1);
+    p = b->body;
+    for (i = 0; i < c->in_count; i++) {
+        read_batch_entry(&p, end, &pri, &delay, &ttr, &size, &body);
+        if (ttr < 1000000000) {
+            ttr = 1000000000;
+        }
+        j = make_job(pri, delay, ttr, size + 2, c->use);
+        if (!j) {
+            twarnx("server error: " MSG_OUT_OF_MEMORY);
+            break;
+        }
+        memcpy(j->body, body, size + 2);
+        j->durability = j->tube->durability;
+        j->walresv = walresvput(srvwal(c->srv, j), j);
+        if (!j->walresv) {
+            twarnx("server error: " MSG_OUT_OF_MEMORY);
+            job_free(j);
+            break;
+        }
+        if (!first)
+            first = j->r.id;
+        last = j->r.id;
+
+        global_stat.total_jobs_ct++;
+        j->tube->stat.total_jobs_ct++;
+        tube_record(j->tube, Histsize, j->r.body_size - 2);
+        trace(Trput, c->sock.fd, j->r.id);
+        if (!insert_job(c->srv, j, j->r.delay, 1)) {
+            /* out of memory trying to grow the queue, so it gets buried */
+            bury_job(c->srv, j, 0);
+        }
+    }
+    batch_wal(c->srv, 0);
+    job_free(b);
+
+    if (!first) {
+        reply_msg(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    process_queue();
+
+    reply_nums(c, STATE_SEND_WORD, MSG_INSERTED, 2, first, last);
+}
+
+// enqueue_incoming_acks runs the delete-many, touch-many or
+// release-many command whose job ids c->in_job holds, writing the
+// binlog records in one batch. It replies STATUS <count> followed
+// by one character per id: the first letter of the reply that the
+// single-job command would give for it.
+static void
+enqueue_incoming_acks(Conn *c)
+{
+    Job *b = c->in_job;
+    char *p, *end, *msg;
+    uint64 id;
+    uint i;
+
+    /* check if the trailer is present and correct */
+    end = b->body + b->r.body_size - 2;
+    if (memcmp(end, "\r\n", 2)) {
+        job_free(c->in_job);
+        c->in_job = NULL;
+        c->in_job_read = 0;
+        reply_msg(c, MSG_EXPECTED_CRLF);
+        return;
+    }
+
+    // Ids are separated by spaces and the trailer stops the last one.
+    p = b->body;
+    for (i = 0; i < c->in_count; i++) {
+        if ((i && p[0] != ' ') || read_u64(NULL, p, &p)) {
+            break;
+        }
+    }
+    if (i < c->in_count || p != end) {
+        job_free(c->in_job);
+        c->in_job = NULL;
+        c->in_job_read = 0;
+        reply_msg(c, MSG_BAD_FORMAT);
+        return;
+    }
+
+    // Each id takes at least two bytes, so the status of an id
+    // can overwrite the body once the id is read.
+    p = b->body;
+    batch_wal(c->srv, 1);
+    for (i = 0; i < c->in_count; i++) {
+        read_u64(&id, p, &p);
+        switch (c->in_op) {
+        case OP_DELETE_MANY:
+            msg = delete_job(c, id);
+            break;
+        case OP_TOUCH_MANY:
+            msg = touch_job(c, job_find(id)) ? MSG_TOUCHED : MSG_NOTFOUND;
+            break;
+        default:
+            msg = release_job(c, id, b->r.pri, b->r.delay);
+        }
+        warn_serr(msg);
+        b->body[i] = msg[0];
+    }
+    batch_wal(c->srv, 0);
+    process_queue();
+
+    b->body[i] = '\r';
+    b->body[i + 1] = '\n';
+    b->r.body_size = i + 2;
+
+    /* the entries become the reply */
+    c->in_job = NULL;
+    c->in_job_read = 0;
+    c->out_job = b;
+    c->out_job_sent = 0;
+    reply_nums(c, STATE_SEND_JOB, MSG_STATUS, 1, i, 0);
 }
 
 static void
@@ -1243,8 +2718,17 @@ maybe_enqueue_incoming_job(Conn *c)
     Job *j = c->in_job;
 
     /* do we have a complete job? */
-    if (c->in_job_read == j->r.body_size) {
-        enqueue_incoming_job(c);
+    if (c->in_job_read == in_job_size(c)) {
+        if (c->bin) {
+            memcpy(j->body + c->in_job_read, "\r\n", 2);
+        }
+        if (c->in_op == OP_PUT_BATCH) {
+            enqueue_incoming_batch(c);
+        } else if (c->in_op != OP_PUT) {
+            enqueue_incoming_acks(c);
+        } else {
+            enqueue_incoming_job(c);
+        }
         return;
     }
 
@@ -1252,6 +2736,29 @@ maybe_enqueue_incoming_job(Conn *c)
     c->state = STATE_WANT_DATA;
 }
 
+// read_batch reads the size bytes of data, and the trailing "\r\n",
+// of a batch command of the given type and count into a fake job,
+// then runs the command. The fake job keeps pri and delay for
+// release-many.
+static void
+read_batch(Conn *c, byte type, uint count, uint32 size, uint32 pri, int64 delay)
+{
+    c->in_job = allocate_job(size + 2);
+    if (!c->in_job) {
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, (int64)size + 2, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    c->in_job->r.state = Copy;
+    c->in_job->r.pri = pri;
+    c->in_job->r.delay = delay;
+    c->in_op = type;
+    c->in_count = count;
+
+    fill_extra_data(c);
+    maybe_enqueue_incoming_job(c);
+}
+
 /* j can be NULL */
 static Job *
 remove_this_reserved_job(Conn *c, Job *j)
@@ -1261,6 +2768,7 @@ remove_this_reserved_job(Conn *c, Job *j)
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
         j->reserver = NULL;
+        c->nreserved--;
     }
     c->soonest_job = NULL;
     return j;
@@ -1283,6 +2791,158 @@ is_valid_tube(const char *name, size_t max)
         name[0] != '-';
 }
 
+// put_job starts reading the body of a new job of body_size bytes
+// for c. The job is put once the body is complete.
+static void
+put_job(Conn *c, uint32 pri, int64 delay, int64 ttr, uint32 body_size)
+{
+    /* the text protocol has "\r\n" after the body, the binary does not */
+    int64 n = (int64)body_size + (c->bin ? 0 : 2);
+
+    if (body_size > job_data_size_limit) {
+        /* throw away the job body and respond with JOB_TOO_BIG */
+        skip(c, n, MSG_JOB_TOO_BIG);
+        return;
+    }
+
+    connsetproducer(c);
+
+    if (ttr < 1000000000) {
+        ttr = 1000000000;
+    }
+
+    if (mem_limit && memused() + sizeof(Job) + body_size + 2 > mem_limit) {
+        /* refuse the job before allocating anything for it */
+        mem_reject_ct++;
+        skip(c, n, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
+    c->in_op = OP_PUT;
+
+    /* OOM? */
+    if (!c->in_job) {
+        /* throw away the job body and respond with OUT_OF_MEMORY */
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, n, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    maybe_enqueue_incoming_job(c);
+}
+
+static void
+peek_job(Conn *c, uint64 id)
+{
+    Job *j;
+
+    /* So, peek is annoying, because some other connection might free the
+     * job while we are still trying to write it out. So we copy it and
+     * free the copy when it's done sending, in the "conn_want_command" function. */
+    j = job_copy(job_find(id));
+
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+    reply_job(c, j, MSG_FOUND);
+}
+
+static void
+kick_job(Conn *c, uint64 id)
+{
+    Job *j;
+
+    j = job_find(id);
+    if (!j) {
+        reply_msg(c, MSG_NOTFOUND);
+        return;
+    }
+
+    if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
+        (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
+        process_queue();
+        reply_msg(c, MSG_KICKED);
+    } else {
+        reply_msg(c, MSG_NOTFOUND);
+    }
+}
+
+static void
+use_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    c->use->using_ct--;
+    TUBE_ASSIGN(c->use, t);
+    TUBE_ASSIGN(t, NULL);
+    c->use->using_ct++;
+
+    reply_line(c, STATE_SEND_WORD, "USING %s\r\n", c->use->name);
+}
+
+static void
+watch_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+    int r;
+
+    // a subscribed conn waits in the tubes it watched so far
+    remove_waiting_conn(c);
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    r = 1;
+    if (!ms_contains(&c->watch, t))
+        r = ms_append(&c->watch, t);
+    TUBE_ASSIGN(t, NULL);
+    if (!r) {
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+}
+
+static void
+ignore_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+    size_t i;
+
+    for (i = 0; i < c->watch.len; i++) {
+        t = c->watch.items[i];
+        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0)
+            break;
+        t = NULL;
+    }
+
+    if (t && c->watch.len < 2) {
+        reply_msg(c, MSG_NOT_IGNORED);
+        return;
+    }
+
+    // a subscribed conn waits in the tubes it watched so far
+    remove_waiting_conn(c);
+
+    if (t)
+        ms_remove(&c->watch, t); /* may free t if refcount => 0 */
+    reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+}
+
 static void
 dispatch_cmd(Conn *c)
 {
@@ -1291,7 +2951,7 @@ dispatch_cmd(Conn *c)
     uint count;
     Job *j = 0;
     byte type;
-    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name;
+    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name, *msg;
     uint32 pri;
     uint32 body_size;
     int64 delay, ttr;
@@ -1302,12 +2962,13 @@ dispatch_cmd(Conn *c)
     c->cmd[c->cmd_len - 2] = '\0';
 
     /* check for possible maliciousness */
-    if (strlen(c->cmd) != c->cmd_len - 2) {
+    if (memchr(c->cmd, '\0', c->cmd_len - 2)) {
         reply_msg(c, MSG_BAD_FORMAT);
         return;
     }
 
-    type = which_cmd(c);
+    type = which_cmd(c->cmd);
+    dispatched_op = type;
     if (verbose >= 2) {
         printf("<%d command %s\n", c->sock.fd, op_names[type]);
     }
@@ -1323,38 +2984,72 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        if (body_size > job_data_size_limit) {
-            /* throw away the job body and respond with JOB_TOO_BIG */
-            skip(c, (int64)body_size + 2, MSG_JOB_TOO_BIG);
+        /* don't allow trailing garbage */
+        if (body_size <= job_data_size_limit && end_buf[0] != '\0') {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
 
-        /* don't allow trailing garbage */
-        if (end_buf[0] != '\0') {
+        put_job(c, pri, delay, ttr, body_size);
+        return;
+
+    case OP_PUT_BATCH:
+        if (read_u32(&count, c->cmd + CMD_PUT_BATCH_LEN, &size_buf) ||
+            read_u32(&body_size, size_buf, &end_buf) ||
+            end_buf[0] != '\0' ||
+            count < 1 || count > BATCH_MAX_JOBS) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        op_ct[type]++;
+
+        /* each entry is a header line and a job body */
+        if (body_size > (uint64)count * (job_data_size_limit + BATCH_LINE_MAX + 2) ||
+            body_size > INT32_MAX - 2) {
+            skip(c, (int64)body_size + 2, MSG_JOB_TOO_BIG);
+            return;
+        }
 
         connsetproducer(c);
 
-        if (ttr < 1000000000) {
-            ttr = 1000000000;
+        if (mem_limit &&
+            memused() + body_size + count * sizeof(Job) > mem_limit) {
+            mem_reject_ct++;
+            skip(c, (int64)body_size + 2, MSG_OUT_OF_MEMORY);
+            return;
         }
 
-        c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
+        read_batch(c, type, count, body_size, 0, 0);
+        return;
 
-        /* OOM? */
-        if (!c->in_job) {
-            /* throw away the job body and respond with OUT_OF_MEMORY */
-            twarnx("server error: " MSG_OUT_OF_MEMORY);
-            skip(c, body_size + 2, MSG_OUT_OF_MEMORY);
+    case OP_DELETE_MANY:
+    case OP_TOUCH_MANY:
+    case OP_RELEASE_MANY:
+        pri = 0;
+        delay = 0;
+        size_buf = c->cmd + strlen(op_names[type]);
+        if (type == OP_RELEASE_MANY &&
+            (read_u32(&pri, size_buf, &delay_buf) ||
+             read_duration(&delay, delay_buf, &size_buf))) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        if (read_u32(&count, size_buf, &size_buf) ||
+            read_u32(&body_size, size_buf, &end_buf) ||
+            end_buf[0] != '\0' ||
+            count < 1 || count > BATCH_MAX_JOBS) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
 
-        fill_extra_data(c);
+        /* ids have at most 20 digits and are separated by one space */
+        if (body_size > count * 21 - 1) {
+            skip(c, (int64)body_size + 2, MSG_BAD_FORMAT);
+            return;
+        }
 
-        /* it's possible we already have a complete job */
-        maybe_enqueue_incoming_job(c);
+        read_batch(c, type, count, body_size, pri, delay);
         return;
 
     case OP_PEEK_READY:
@@ -1384,82 +3079,146 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        if (c->use->delay.len) {
-            j = job_copy(c->use->delay.data[0]);
-        }
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+        if (c->use->delay.len) {
+            j = job_copy(c->use->delay.data[0]);
+        }
+
+        if (!j) {
+            reply_msg(c, MSG_NOTFOUND);
+            return;
+        }
+        reply_job(c, j, MSG_FOUND);
+        return;
+
+    case OP_PEEK_BURIED:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_PEEK_BURIED_LEN + 2) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        if (buried_job_p(c->use))
+            j = job_copy(c->use->buried.next);
+        else
+            j = NULL;
+
+        if (!j) {
+            reply_msg(c, MSG_NOTFOUND);
+            return;
+        }
+        reply_job(c, j, MSG_FOUND);
+        return;
+
+    case OP_PEEKJOB:
+        if (read_u64(&id, c->cmd + CMD_PEEKJOB_LEN, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        peek_job(c, id);
+        return;
+
+    case OP_RESERVE_TIMEOUT:
+        errno = 0;
+        timeout = strtol(c->cmd + CMD_RESERVE_TIMEOUT_LEN, &end_buf, 10);
+        if (errno) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        /* Falls through */
+
+    case OP_RESERVE:
+        /* don't allow trailing garbage */
+        if (type == OP_RESERVE && c->cmd_len != CMD_RESERVE_LEN + 2) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        reserve_next(c, timeout, 0);
+        return;
+
+    case OP_SUBSCRIBE:
+        if (read_u32(&count, c->cmd + CMD_SUBSCRIBE_LEN, &end_buf) ||
+            end_buf[0] != '\0' || count > RESERVE_MANY_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        connsetworker(c);
+
+        c->credits = count;
+        if (c->nreserved >= count)
+            remove_waiting_conn(c);
+        reply_line(c, STATE_SEND_WORD, "SUBSCRIBED %u\r\n", count);
+        return;
+
+    case OP_DELETE_RESERVE:
+        if (read_u64(&id, c->cmd + CMD_DELETE_RESERVE_LEN, &end_buf) ||
+            read_timeout(&timeout, end_buf)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        msg = delete_job(c, id);
+        if (msg[0] != 'D') {
+            reply_word(c, msg);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reserve_next(c, timeout, 0);
         return;
 
-    case OP_PEEK_BURIED:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_PEEK_BURIED_LEN + 2) {
+    case OP_RELEASE_RESERVE:
+        if (read_u64(&id, c->cmd + CMD_RELEASE_RESERVE_LEN, &pri_buf) ||
+            read_u32(&pri, pri_buf, &delay_buf) ||
+            read_duration(&delay, delay_buf, &end_buf) ||
+            read_timeout(&timeout, end_buf)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
 
-        if (buried_job_p(c->use))
-            j = job_copy(c->use->buried.next);
-        else
-            j = NULL;
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+        msg = release_job(c, id, pri, delay);
+        if (msg[0] != 'R' && msg[0] != 'B') {
+            reply_word(c, msg);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reserve_next(c, timeout, 0);
         return;
 
-    case OP_PEEKJOB:
-        if (read_u64(&id, c->cmd + CMD_PEEKJOB_LEN, NULL)) {
+    case OP_BURY_RESERVE:
+        if (read_u64(&id, c->cmd + CMD_BURY_RESERVE_LEN, &pri_buf) ||
+            read_u32(&pri, pri_buf, &end_buf) ||
+            read_timeout(&timeout, end_buf)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
 
-        /* So, peek is annoying, because some other connection might free the
-         * job while we are still trying to write it out. So we copy it and
-         * free the copy when it's done sending, in the "conn_want_command" function. */
-        j = job_copy(job_find(id));
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
+        msg = bury_reserved_job(c, id, pri);
+        if (msg[0] != 'B') {
+            reply_word(c, msg);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reserve_next(c, timeout, 0);
         return;
 
-    case OP_RESERVE_TIMEOUT:
-        errno = 0;
-        timeout = strtol(c->cmd + CMD_RESERVE_TIMEOUT_LEN, &end_buf, 10);
-        if (errno) {
+    case OP_RESERVE_MANY:
+        if (read_u32(&count, c->cmd + CMD_RESERVE_MANY_LEN, &delay_buf) ||
+            count < 1 || count > RESERVE_MANY_MAX) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-        /* Falls through */
-
-    case OP_RESERVE:
-        /* don't allow trailing garbage */
-        if (type == OP_RESERVE && c->cmd_len != CMD_RESERVE_LEN + 2) {
+        errno = 0;
+        timeout = strtol(delay_buf, &end_buf, 10);
+        if (errno || end_buf == delay_buf || end_buf[0] != '\0') {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
-        connsetworker(c);
-
-        if (conndeadlinesoon(c) && !conn_ready(c)) {
-            reply_msg(c, MSG_DEADLINE_SOON);
-            return;
-        }
-
-        /* try to get a new job for this guy */
-        wait_for_job(c, timeout);
-        process_queue();
+        reserve_next(c, timeout, count);
         return;
 
     case OP_RESERVE_JOB:
@@ -1511,34 +3270,7 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        {
-            Job *jf = job_find(id);
-            j = remove_reserved_job(c, jf);
-            if (!j)
-                j = remove_ready_job(jf);
-            if (!j)
-                j = remove_buried_job(jf);
-            if (!j)
-                j = remove_delayed_job(jf);
-        }
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        j->tube->stat.total_delete_ct++;
-
-        j->r.state = Invalid;
-        r = walwrite(&c->srv->wal, j);
-        walmaint(&c->srv->wal);
-        job_free(j);
-
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
-        }
-        reply_msg(c, MSG_DELETED);
+        reply_word(c, delete_job(c, id));
         return;
 
     case OP_RELEASE:
@@ -1550,41 +3282,8 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        j = remove_reserved_job(c, job_find(id));
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        /* We want to update the delay deadline on disk, so reserve space for
-         * that. */
-        if (delay) {
-            int z = walresvupdate(&c->srv->wal);
-            if (!z) {
-                reply_serr(c, MSG_OUT_OF_MEMORY);
-                return;
-            }
-            j->walresv += z;
-        }
-
-        j->r.pri = pri;
-        j->r.delay = delay;
-        j->r.release_ct++;
-
-        r = enqueue_job(c->srv, j, delay, !!delay);
-        if (r < 0) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
-        }
-        if (r == 1) {
-            reply_msg(c, MSG_RELEASED);
-            return;
-        }
-
-        /* out of memory trying to grow the queue, so it gets buried */
-        bury_job(c->srv, j, 0);
-        reply_msg(c, MSG_BURIED);
+        reply_word(c, release_job(c, id, pri, delay));
+        process_queue();
         return;
 
     case OP_BURY:
@@ -1596,20 +3295,7 @@ dispatch_cmd(Conn *c)
 
         op_ct[type]++;
 
-        j = remove_reserved_job(c, job_find(id));
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        j->r.pri = pri;
-        r = bury_job(c->srv, j, 1);
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
-        }
-        reply_msg(c, MSG_BURIED);
+        reply_word(c, bury_reserved_job(c, id, pri));
         return;
 
     case OP_KICK:
@@ -1622,8 +3308,10 @@ dispatch_cmd(Conn *c)
 
         op_ct[type]++;
 
-        i = kick_jobs(c->srv, c->use, count);
-        reply_line(c, STATE_SEND_WORD, "KICKED %u\r\n", i);
+        c->kick_buried = buried_job_p(c->use);
+        c->kick_left = count;
+        c->kick_done = 0;
+        kick_chunk(c);
         return;
 
     case OP_KICKJOB:
@@ -1634,18 +3322,7 @@ dispatch_cmd(Conn *c)
 
         op_ct[type]++;
 
-        j = job_find(id);
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
-            (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
-            reply_msg(c, MSG_KICKED);
-        } else {
-            reply_msg(c, MSG_NOTFOUND);
-        }
+        kick_job(c, id);
         return;
 
     case OP_TOUCH:
@@ -1664,17 +3341,108 @@ dispatch_cmd(Conn *c)
 
     case OP_STATS:
         /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_STATS_LEN + 2) {
+        if ((r = read_format(c->cmd + CMD_STATS_LEN)) < 0) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        do_stats(c, fmt_stats, c->srv, r);
+        return;
+
+    case OP_STATS_LOOP:
+        /* don't allow trailing garbage */
+        if ((r = read_format(c->cmd + CMD_STATS_LOOP_LEN)) < 0) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        do_stats(c, fmt_stats_loop, c->srv, r);
+        return;
+
+    case OP_DUMP_TRACE:
+        name = c->cmd + CMD_DUMP_TRACE_LEN;
+        if (name[0] == '\0') {
+            r = 0;
+        } else if (strcmp(name, " binary") == 0) {
+            r = 1;
+        } else {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        do_dump_trace(c, r);
+        return;
+
+    case OP_STATS_MEMORY:
+        /* don't allow trailing garbage */
+        if ((r = read_format(c->cmd + CMD_STATS_MEMORY_LEN)) < 0) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        do_stats(c, fmt_stats_memory, NULL, r);
+        return;
+
+    case OP_STATS_TUBES: {
+        struct tubes_page pg = {"", "", 0};
+
+        // [<prefix> [<after> <limit> [json]]], where a prefix
+        // of "*" matches all tubes and <after> of "*" starts
+        // at the first one
+        r = 0;
+        name = c->cmd + CMD_STATS_TUBES_LEN;
+        if (name[0] == ' ') {
+            name++;
+            end_buf = name + strcspn(name, " ");
+            if (end_buf[0] == ' ') {
+                *end_buf++ = '\0';
+                msg = end_buf;
+                size_buf = msg + strcspn(msg, " ");
+                if (size_buf[0] != ' ') {
+                    reply_msg(c, MSG_BAD_FORMAT);
+                    return;
+                }
+                *size_buf = '\0';
+                if (read_u32(&pg.limit, size_buf + 1, &end_buf)) {
+                    reply_msg(c, MSG_BAD_FORMAT);
+                    return;
+                }
+                if (strcmp(msg, "*") != 0) {
+                    if (!is_valid_tube(msg, MAX_TUBE_NAME_LEN - 1)) {
+                        reply_msg(c, MSG_BAD_FORMAT);
+                        return;
+                    }
+                    pg.after = msg;
+                }
+            }
+            if ((r = read_format(end_buf)) < 0) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+            if (strcmp(name, "*") != 0) {
+                if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+                    reply_msg(c, MSG_BAD_FORMAT);
+                    return;
+                }
+                pg.prefix = name;
+            }
+        } else if (name[0] != '\0') {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         op_ct[type]++;
 
-        do_stats(c, fmt_stats, c->srv);
+        do_stats(c, (fmt_fn) fmt_stats_tubes, &pg, r);
         return;
+    }
 
     case OP_STATSJOB:
-        if (read_u64(&id, c->cmd + CMD_STATSJOB_LEN, NULL)) {
+        if (read_u64(&id, c->cmd + CMD_STATSJOB_LEN, &end_buf) ||
+            (r = read_format(end_buf)) < 0) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
@@ -1690,11 +3458,17 @@ dispatch_cmd(Conn *c)
             reply_serr(c, MSG_INTERNAL_ERROR);
             return;
         }
-        do_stats(c, (fmt_fn) fmt_job_stats, j);
+        do_stats(c, (fmt_fn) fmt_job_stats, j, r);
         return;
 
     case OP_STATS_TUBE:
         name = c->cmd + CMD_STATS_TUBE_LEN;
+        end_buf = name + strcspn(name, " ");
+        if ((r = read_format(end_buf)) < 0) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        end_buf[0] = '\0';
         if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
@@ -1706,7 +3480,7 @@ dispatch_cmd(Conn *c)
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        do_stats(c, (fmt_fn) fmt_stats_tube, t);
+        do_stats(c, (fmt_fn) fmt_stats_tube, t, r);
         t = NULL;
         return;
 
@@ -1748,18 +3522,7 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-
-        c->use->using_ct--;
-        TUBE_ASSIGN(c->use, t);
-        TUBE_ASSIGN(t, NULL);
-        c->use->using_ct++;
-
-        reply_line(c, STATE_SEND_WORD, "USING %s\r\n", c->use->name);
+        use_tube(c, name);
         return;
 
     case OP_WATCH:
@@ -1770,21 +3533,7 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-
-        r = 1;
-        if (!ms_contains(&c->watch, t))
-            r = ms_append(&c->watch, t);
-        TUBE_ASSIGN(t, NULL);
-        if (!r) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        watch_tube(c, name);
         return;
 
     case OP_IGNORE:
@@ -1795,23 +3544,7 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        t = NULL;
-        for (i = 0; i < c->watch.len; i++) {
-            t = c->watch.items[i];
-            if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0)
-                break;
-            t = NULL;
-        }
-
-        if (t && c->watch.len < 2) {
-            reply_msg(c, MSG_NOT_IGNORED);
-            return;
-        }
-
-        if (t)
-            ms_remove(&c->watch, t); /* may free t if refcount => 0 */
-        t = NULL;
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        ignore_tube(c, name);
         return;
 
     case OP_QUIT:
@@ -1850,6 +3583,146 @@ dispatch_cmd(Conn *c)
         reply_line(c, STATE_SEND_WORD, "PAUSED\r\n");
         return;
 
+    case OP_SET_DURABILITY:
+        if (read_tube_name(&name, c->cmd + CMD_SET_DURABILITY_LEN, &end_buf) ||
+            *end_buf != ' ') {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        *end_buf++ = '\0';
+        r = durparse(end_buf);
+        if (r == -1 || !is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        TUBE_ASSIGN(t, tube_find_or_make(name));
+        if (!t) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+
+        // The tube keeps its previous class if the new one
+        // cannot be persisted.
+        i = t->durability;
+        tube_setdurability(t, r);
+        if (!walsavedur(&c->srv->wal)) {
+            tube_setdurability(t, i);
+            TUBE_ASSIGN(t, NULL);
+            reply_serr(c, MSG_INTERNAL_ERROR);
+            return;
+        }
+        TUBE_ASSIGN(t, NULL);
+
+        reply_line(c, STATE_SEND_WORD, "DURABILITY %s\r\n", durname(r));
+        return;
+
+    default:
+        reply_msg(c, MSG_UNKNOWN_COMMAND);
+    }
+}
+
+// dispatch_bin runs the binary request at the start of c->cmd,
+// with the same semantics as the text command of the same op.
+static void
+dispatch_bin(Conn *c)
+{
+    byte type = c->cmd[0];
+    uint32 len = bin_u32(c->cmd + 4);
+    uint64 id = bin_u64(c->cmd + 8);
+    uint32 pri = bin_u32(c->cmd + 16);
+    uint32 delay = bin_u32(c->cmd + 20);
+    uint32 ttr = bin_u32(c->cmd + 24);
+    char name[MAX_TUBE_NAME_LEN];
+
+    dispatched_op = type < TOTAL_OPS ? type : OP_UNKNOWN;
+    if (verbose >= 2 && type < TOTAL_OPS) {
+        printf("<%d bin %s\n", c->sock.fd, op_names[type]);
+    }
+
+    if (type == OP_USE || type == OP_WATCH || type == OP_IGNORE) {
+        if (len >= MAX_TUBE_NAME_LEN) {
+            skip(c, len, MSG_BAD_FORMAT);
+            return;
+        }
+        memcpy(name, c->cmd + BIN_REQ_SIZE, len);
+        name[len] = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+    } else if (type != OP_PUT && len) {
+        skip(c, len, MSG_BAD_FORMAT);
+        return;
+    }
+
+    switch (type) {
+    case OP_PUT:
+        op_ct[type]++;
+        put_job(c, pri, delay * 1000000000LL, ttr * 1000000000LL, len);
+        return;
+
+    case OP_RESERVE:
+        op_ct[type]++;
+        reserve_next(c, -1, 0);
+        return;
+
+    case OP_RESERVE_TIMEOUT:
+        op_ct[type]++;
+        reserve_next(c, min(delay, INT_MAX), 0);
+        return;
+
+    case OP_DELETE:
+        op_ct[type]++;
+        reply_word(c, delete_job(c, id));
+        return;
+
+    case OP_RELEASE:
+        op_ct[type]++;
+        reply_word(c, release_job(c, id, pri, delay * 1000000000LL));
+        process_queue();
+        return;
+
+    case OP_BURY:
+        op_ct[type]++;
+        reply_word(c, bury_reserved_job(c, id, pri));
+        return;
+
+    case OP_TOUCH:
+        op_ct[type]++;
+        if (touch_job(c, job_find(id))) {
+            reply_msg(c, MSG_TOUCHED);
+        } else {
+            reply_msg(c, MSG_NOTFOUND);
+        }
+        return;
+
+    case OP_PEEKJOB:
+        op_ct[type]++;
+        peek_job(c, id);
+        return;
+
+    case OP_KICKJOB:
+        op_ct[type]++;
+        kick_job(c, id);
+        return;
+
+    case OP_USE:
+        op_ct[type]++;
+        use_tube(c, name);
+        return;
+
+    case OP_WATCH:
+        op_ct[type]++;
+        watch_tube(c, name);
+        return;
+
+    case OP_IGNORE:
+        op_ct[type]++;
+        ignore_tube(c, name);
+        return;
+
     default:
         reply_msg(c, MSG_UNKNOWN_COMMAND);
     }
@@ -1866,11 +3739,14 @@ dispatch_cmd(Conn *c)
 static void
 conn_timeout(Conn *c)
 {
-    int should_timeout = 0;
+    int should_timeout = 0, timedout = 0;
     Job *j;
 
+    if (c->state == STATE_KICK)
+        kick_chunk(c);
+
     /* Check if the client was trying to reserve a job. */
-    if (conn_waiting(c) && conndeadlinesoon(c))
+    if (conn_waiting(c) && c->state == STATE_WAIT && conndeadlinesoon(c))
         should_timeout = 1;
 
     /* Check if any reserved jobs have run out of time. We should do this
@@ -1889,10 +3765,12 @@ conn_timeout(Conn *c)
 
         timeout_ct++; /* stats */
         j->r.timeout_ct++;
+        trace(Trtimeout, c->sock.fd, j->r.id);
         int r = enqueue_job(c->srv, remove_this_reserved_job(c, j), 0, 0);
         if (r < 1)
             bury_job(c->srv, j, 0); /* out of memory, so bury it */
         connsched(c);
+        timedout = 1;
     }
 
     if (should_timeout) {
@@ -1903,6 +3781,10 @@ conn_timeout(Conn *c)
         remove_waiting_conn(c);
         reply_msg(c, MSG_TIMED_OUT);
     }
+
+    /* timed out jobs give their credits back */
+    if (timedout)
+        subscribe_wait(c);
 }
 
 void
@@ -1924,13 +3806,14 @@ conn_want_command(Conn *c)
 
     c->reply_sent = 0; /* now that we're done, reset this */
     c->state = STATE_WANT_COMMAND;
+    subscribe_wait(c);
 }
 
 static void
 conn_process_io(Conn *c)
 {
     int r;
-    int64 to_read;
+    int64 to_read, size;
     Job *j;
     struct iovec iov[2];
 
@@ -1947,7 +3830,7 @@ conn_process_io(Conn *c)
         }
 
         c->cmd_read += r;
-        c->cmd_len = scan_line_end(c->cmd, c->cmd_read);
+        c->cmd_len = scan_cmd_end(c);
         if (c->cmd_len) {
             // We found complete command line. Bail out to h_conn.
             return;
@@ -2020,7 +3903,7 @@ conn_process_io(Conn *c)
     case STATE_WANT_DATA:
         j = c->in_job;
 
-        r = read(c->sock.fd, j->body + c->in_job_read, j->r.body_size -c->in_job_read);
+        r = read(c->sock.fd, j->body + c->in_job_read, in_job_size(c) - c->in_job_read);
         if (r == -1) {
             check_err(c, "read()");
             return;
@@ -2060,11 +3943,12 @@ conn_process_io(Conn *c)
         break;
     case STATE_SEND_JOB:
         j = c->out_job;
+        size = j->r.body_size - (c->bin ? 2 : 0); /* no "\r\n" in binary */
 
         iov[0].iov_base = (void *)(c->reply + c->reply_sent);
         iov[0].iov_len = c->reply_len - c->reply_sent; /* maybe 0 */
         iov[1].iov_base = j->body + c->out_job_sent;
-        iov[1].iov_len = j->r.body_size - c->out_job_sent;
+        iov[1].iov_len = size - c->out_job_sent;
 
         r = writev(c->sock.fd, iov, 2);
         if (r == -1) {
@@ -2083,10 +3967,10 @@ conn_process_io(Conn *c)
             c->reply_sent = c->reply_len;
         }
 
-        /* (c->out_job_sent > j->r.body_size) can't happen */
+        /* (c->out_job_sent > size) can't happen */
 
         /* are we done? */
-        if (c->out_job_sent == j->r.body_size) {
+        if (c->out_job_sent == size) {
             if (verbose >= 2) {
                 printf(">%d job %"PRIu64"\n", c->sock.fd, j->r.id);
             }
@@ -2126,9 +4010,19 @@ h_conn(const int fd, const short which, Conn *c)
     }
 
     conn_process_io(c);
-    while (cmd_data_ready(c) && (c->cmd_len = scan_line_end(c->cmd, c->cmd_read))) {
-        dispatch_cmd(c);
+    while (cmd_data_ready(c) && (c->cmd_len = scan_cmd_end(c))) {
+        int64 t = nanoseconds();
+
+        dispatched_op = OP_UNKNOWN;
+        dispatching = c;
+        if (c->bin) {
+            dispatch_bin(c);
+        } else {
+            dispatch_cmd(c);
+        }
         fill_extra_data(c);
+        dispatching = NULL;
+        hist_record(&op_hist[dispatched_op], nanoseconds() - t);
     }
     if (c->state == STATE_CLOSE) {
         epollq_rmconn(c);
@@ -2152,6 +4046,7 @@ prottick(Server *s)
     Tube *t;
     int64 period = 0x34630B8A000LL; /* 1 hour in nanoseconds */
     int64 d;
+    uint promoted = 0;
 
     now = nanoseconds();
 
@@ -2163,11 +4058,14 @@ prottick(Server *s)
             period = min(period, d);
             break;
         }
-        heapremove(&j->tube->delay, j->heap_index);
+        remove_delayed_job(j);
         int r = enqueue_job(s, j, 0, 0);
         if (r < 1)
             bury_job(s, j, 0);  /* out of memory */
+        promoted++;
     }
+    if (promoted)
+        PROBE2(promote, promoted, nanoseconds() - now);
 
     // Unpause every possible tube and process the queue.
     // Capture the smallest period from the soonest pause deadline.
@@ -2256,6 +4154,8 @@ h_accept(const int fd, const short which, Server *s)
     c->sock.x = c;
     c->sock.f = (Handle)prothandle;
     c->sock.fd = cfd;
+    c->bin = s->binport && fd == s->binsock.fd;
+    trace(Traccept, cfd, 0);
 
     r = sockwant(&c->sock, 'r');
     if (r == -1) {
@@ -2318,7 +4218,7 @@ prot_replay(Server *s, Job *list)
     for (j = list->next ; j != list ; j = nj) {
         nj = j->next;
         job_list_remove(j);
-        int z = walresvupdate(&s->wal);
+        int z = walresvupdate(srvwal(s, j), j);
         if (!z) {
             twarnx("failed to reserve space");
             return 0;
@@ -10,32 +10,96 @@ struct Server srv = {
         .wantsync = 1,
         .syncrate = DEFAULT_FSYNC_MS * 1000000,
     },
+    .nwal = 1,
+    .wals = &srv.wal,
 };
 
 // srv_acquire_wal tries to lock the wal dir specified by s->wal and
 // replay entries from it to initialize the s state with jobs.
+// If s->nwal is more than 1, the wal is split into that many
+// partitions, each locked and replayed in turn.
 // On errors it exits from the program.
 void srv_acquire_wal(Server *s) {
-    if (s->wal.use) {
-        // We want to make sure that only one beanstalkd tries
-        // to use the wal directory at a time. So acquire a lock
-        // now and never release it.
-        if (!waldirlock(&s->wal)) {
-            twarnx("failed to lock wal dir %s", s->wal.dir);
-            exit(10);
-        }
+    int i;
 
-        Job list = {.prev=NULL, .next=NULL};
-        list.prev = list.next = &list;
-        walinit(&s->wal, &list);
-        int ok = prot_replay(s, &list);
-        if (!ok) {
-            twarnx("failed to replay log");
-            exit(1);
+    if (!s->wal.use) {
+        s->nwal = 1;
+        s->wals = &s->wal;
+        return;
+    }
+
+    // We want to make sure that only one beanstalkd tries
+    // to use the wal directory at a time. So acquire a lock
+    // now and never release it.
+    if (!waldirlock(&s->wal)) {
+        twarnx("failed to lock wal dir %s", s->wal.dir);
+        exit(10);
+    }
+
+    s->wals = walpart(&s->wal, s->nwal);
+    if (!s->wals) {
+        twarnx("failed to partition wal dir %s", s->wal.dir);
+        exit(10);
+    }
+
+    walloaddur(&s->wal);
+
+    Job list = {.prev=NULL, .next=NULL};
+    list.prev = list.next = &list;
+    for (i = 0; i < s->nwal; i++) {
+        Wal *w = &s->wals[i];
+        if (w != &s->wal && !waldirlock(w)) {
+            twarnx("failed to lock wal dir %s", w->dir);
+            exit(10);
         }
+        walinit(w, &list);
     }
+    int ok = prot_replay(s, &list);
+    if (!ok) {
+        twarnx("failed to replay log");
+        exit(1);
+    }
+}
+
+
+// srvwal returns the wal partition that holds the records of j.
+// A job stays in the partition of its tube for its whole life.
+Wal *
+srvwal(Server *s, Job *j)
+{
+    uint h = 5381;
+    char *p;
+
+    if (s->nwal == 1)
+        return s->wals;
+    if (j->file)
+        return j->file->w;
+    for (p = j->tube->name; *p; p++)
+        h = h*33 + (byte)*p;
+    return &s->wals[h % s->nwal];
 }
 
+
+// srvcount records one iteration of the event loop, which spent
+// tick nanoseconds in prottick and busy nanoseconds in total
+// outside of socknext.
+static void
+srvcount(Server *s, int rw, int64 tick, int64 busy)
+{
+    struct Loopstat *l = &s->loop;
+
+    l->iter++;
+    if (rw)
+        l->events++;
+    if (busy >= Slowloop)
+        l->slow++;
+    l->busy_ns += busy;
+    l->tick_ns += tick;
+    hist_record(&l->busy, busy);
+    hist_record(&l->tick, tick);
+}
+
+
 void
 srvserve(Server *s)
 {
@@ -56,19 +120,46 @@ srvserve(Server *s)
         exit(2);
     }
 
+    if (s->binport) {
+        s->binsock.x = s;
+        s->binsock.f = (Handle)srvacceptbin;
+        if (sockwant(&s->binsock, 'r') == -1) {
+            twarn("sockwant");
+            exit(2);
+        }
+    }
+
 
+    int64 t0 = nanoseconds();
+    int64 published = 0;
     for (;;) {
         int64 period = prottick(s);
+        if (s->shmpath) {
+            if (t0 - published >= Shmperiod) {
+                prot_publish(s);
+                published = t0;
+            }
+            period = min(period, published + Shmperiod - t0);
+        }
+        int64 t1 = nanoseconds();
 
         int rw = socknext(&sock, period);
         if (rw == -1) {
             twarnx("socknext");
             exit(1);
         }
+        int64 t2 = nanoseconds();
 
         if (rw) {
             sock->f(sock->x, rw);
         }
+        if (tracedue()) {
+            tracewrite(2);
+        }
+        int64 t3 = nanoseconds();
+
+        srvcount(s, rw, t1 - t0, (t1 - t0) + (t3 - t2));
+        t0 = t3;
     }
 }
 
@@ -78,3 +169,10 @@ srvaccept(Server *s, int ev)
 {
     h_accept(s->sock.fd, ev, s);
 }
+
+
+void
+srvacceptbin(Server *s, int ev)
+{
+    h_accept(s->binsock.fd, ev, s);
+}
@@ -0,0 +1,104 @@
+#include "dat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The stats file given with -S. The server maps it shared and
+// rewrites it in place every Shmperiod, see prot_publish. Readers
+// map it too and use hdr->seq as a seqlock: it is odd while the
+// server writes, and changes with every write.
+
+static int fd = -1;
+static Shmhdr *hdr;
+static size_t mapsize;
+
+static size_t
+shmsize(uint32 tubecap)
+{
+    return sizeof(Shmhdr) + (size_t)tubecap * sizeof(Shmtube);
+}
+
+// shmmap sizes the file for tubecap tubes and maps it.
+// Returns 1 on success, 0 on error.
+static int
+shmmap(uint32 tubecap)
+{
+    size_t z = shmsize(tubecap);
+    void *p;
+
+    if (ftruncate(fd, z) == -1) {
+        twarn("ftruncate");
+        return 0;
+    }
+    p = mmap(NULL, z, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        twarn("mmap");
+        return 0;
+    }
+    if (hdr)
+        munmap(hdr, mapsize);
+    hdr = p;
+    mapsize = z;
+    hdr->tubecap = tubecap;
+    hdr->size = z;
+    return 1;
+}
+
+// shmopen creates or truncates the stats file at path and maps it.
+// Returns 1 on success, 0 on error.
+int
+shmopen(char *path)
+{
+    fd = open(path, O_RDWR|O_CREAT, 0644);
+    if (fd == -1) {
+        twarn("open %s", path);
+        return 0;
+    }
+    if (ftruncate(fd, 0) == -1 || !shmmap(Shmtubemin)) {
+        close(fd);
+        fd = -1;
+        return 0;
+    }
+    hdr->magic = Shmmagic;
+    hdr->version = Shmversion;
+    hdr->pid = getpid();
+    return 1;
+}
+
+// shmbegin starts a write of the stats file with room for ntube
+// tubes, growing the file if needed. It returns the header, or
+// NULL if there is no stats file or it could not grow. A
+// successful shmbegin must be followed by shmend.
+Shmhdr *
+shmbegin(uint32 ntube)
+{
+    uint64 seq;
+    uint32 cap;
+
+    if (!hdr)
+        return NULL;
+    seq = hdr->seq;
+    __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (ntube > hdr->tubecap) {
+        for (cap = hdr->tubecap; cap < ntube; cap *= 2)
+            ;
+        if (!shmmap(cap)) {
+            // leave the old contents for readers
+            __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+            return NULL;
+        }
+    }
+    return hdr;
+}
+
+// shmend finishes a write started by shmbegin.
+void
+shmend(Shmhdr *h)
+{
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,103 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "ct/ct.h"
+
+
+void
+cttest_hist_empty()
+{
+    Hist h = {0};
+
+    assertf(hist_percentile(&h, 500) == 0, "empty p50 should be 0");
+    assertf(hist_percentile(&h, 1000) == 0, "empty p100 should be 0");
+}
+
+void
+cttest_hist_small_values()
+{
+    Hist h = {0};
+    uint64 v;
+
+    for (v = 0; v < 4; v++)
+        hist_record(&h, v);
+    assertf(h.count == 4, "count is %llu", (unsigned long long)h.count);
+    assertf(hist_percentile(&h, 250) == 0, "p25 should be 0");
+    assertf(hist_percentile(&h, 500) == 1, "p50 should be 1");
+    assertf(hist_percentile(&h, 1000) == 3, "p100 should be 3");
+}
+
+void
+cttest_hist_bucket_bounds()
+{
+    Hist h = {0};
+
+    // 4..4, 5..5, ..., then 8..9, 10..11, ..., then 16..19, ...
+    hist_record(&h, 9);
+    assertf(hist_percentile(&h, 500) == 9, "9 is the top of its bucket");
+    h = (Hist){0};
+    hist_record(&h, 8);
+    assertf(hist_percentile(&h, 500) == 9, "8 goes in the 8..9 bucket");
+    h = (Hist){0};
+    hist_record(&h, 1000);
+    // 1000 is in 896..1023.
+    assertf(hist_percentile(&h, 500) == 1023, "got %llu",
+            (unsigned long long)hist_percentile(&h, 500));
+}
+
+void
+cttest_hist_relative_error()
+{
+    Hist h;
+    uint64 v, p;
+
+    for (v = 1; v < (1ull << 40); v = v * 3 + 1) {
+        h = (Hist){0};
+        hist_record(&h, v);
+        p = hist_percentile(&h, 500);
+        assertf(p >= v, "p50 %llu below %llu",
+                (unsigned long long)p, (unsigned long long)v);
+        assertf(p - v <= v / 4, "p50 %llu too far from %llu",
+                (unsigned long long)p, (unsigned long long)v);
+    }
+}
+
+void
+cttest_hist_percentiles()
+{
+    Hist h = {0};
+    uint64 v;
+
+    for (v = 1; v <= 1000; v++)
+        hist_record(&h, v);
+    v = hist_percentile(&h, 500);
+    assertf(v >= 500 && v <= 625, "p50 is %llu", (unsigned long long)v);
+    v = hist_percentile(&h, 990);
+    assertf(v >= 990 && v <= 1023, "p99 is %llu", (unsigned long long)v);
+}
+
+void
+cttest_hist_huge_value()
+{
+    Hist h = {0};
+
+    hist_record(&h, UINT64_MAX);
+    assertf(h.bucket[HIST_BUCKETS - 1] == 1, "should be in the last bucket");
+    assertf(hist_percentile(&h, 500) == UINT64_MAX, "top bucket is open");
+}
+
+void
+ctbench_hist_record(int n)
+{
+    Hist *h = calloc(1, sizeof *h);
+    int i;
+
+    assert(h);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        hist_record(h, (uint64)i * 7919);
+    }
+    ctstoptimer();
+    free(h);
+}
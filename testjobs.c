@@ -164,3 +164,95 @@ ctbench_job_free(int n)
 
     free(j);
 }
+
+// bench_job_find looks up n ids picked at random among njob jobs.
+static void
+bench_job_find(int n, int njob)
+{
+    int i;
+    uint64 x = 1;
+    Job **j = calloc(njob, sizeof *j);
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    for (i = 0; i < njob; i++) {
+        j[i] = make_job(0, 0, 1, 0, default_tube);
+        assert(j[i]);
+    }
+    uint64 base = j[0]->r.id;
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        if (!job_find(base + (x >> 33) % njob)) {
+            puts("job_find: job not found");
+            exit(1);
+        }
+    }
+    ctstoptimer();
+
+    for (i = 0; i < njob; i++) {
+        job_free(j[i]);
+    }
+    free(j);
+}
+
+void
+ctbench_job_find_1k(int n)
+{
+    bench_job_find(n, 1000);
+}
+
+void
+ctbench_job_find_100k(int n)
+{
+    bench_job_find(n, 100000);
+}
+
+void
+ctbench_job_find_1m(int n)
+{
+    bench_job_find(n, 1000000);
+}
+
+void
+ctbench_job_find_10m(int n)
+{
+    bench_job_find(n, 10000000);
+}
+
+// bench_job_churn frees the oldest of njob jobs and makes a new one,
+// n times, so the job table keeps its size and never rehashes.
+static void
+bench_job_churn(int n, int njob)
+{
+    int i;
+    Job **j = calloc(njob, sizeof *j);
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    for (i = 0; i < njob; i++) {
+        j[i] = make_job(0, 0, 1, 0, default_tube);
+        assert(j[i]);
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        job_free(j[i % njob]);
+        j[i % njob] = make_job(0, 0, 1, 0, default_tube);
+    }
+    ctstoptimer();
+
+    for (i = 0; i < njob; i++) {
+        job_free(j[i]);
+    }
+    free(j);
+}
+
+void
+ctbench_job_churn_1k(int n)
+{
+    bench_job_churn(n, 1000);
+}
+
+void
+ctbench_job_churn_1m(int n)
+{
+    bench_job_churn(n, 1000000);
+}
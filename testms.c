@@ -137,3 +137,78 @@ cttest_ms_take_sequence()
     free(a);
 }
 
+
+void
+ctbench_ms_append(int n)
+{
+    int i, x;
+    Ms a;
+    ms_init(&a, NULL, NULL);
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        ms_append(&a, &x);
+    }
+    ctstoptimer();
+
+    ms_clear(&a);
+}
+
+void
+ctbench_ms_take(int n)
+{
+    int i, x;
+    Ms a;
+    ms_init(&a, NULL, NULL);
+    for (i = 0; i < n; i++) {
+        ms_append(&a, &x);
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        ms_take(&a);
+    }
+    ctstoptimer();
+
+    ms_clear(&a);
+}
+
+// bench_ms_remove removes an item picked at random from a set of
+// size items and appends it again, n times, as a waiting connection
+// leaves and rejoins the waiting set of a tube.
+static void
+bench_ms_remove(int n, int size)
+{
+    int i;
+    uint64 x = 1;
+    int *v = calloc(size, sizeof *v);
+    Ms a;
+    ms_init(&a, NULL, NULL);
+    for (i = 0; i < size; i++) {
+        ms_append(&a, &v[i]);
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        int *item = &v[(x >> 33) % size];
+        ms_remove(&a, item);
+        ms_append(&a, item);
+    }
+    ctstoptimer();
+
+    ms_clear(&a);
+    free(v);
+}
+
+void
+ctbench_ms_remove_100(int n)
+{
+    bench_ms_remove(n, 100);
+}
+
+void
+ctbench_ms_remove_10k(int n)
+{
+    bench_ms_remove(n, 10000);
+}
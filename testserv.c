@@ -1,6 +1,7 @@
 #include "ct/ct.h"
 #include "dat.h"
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -18,6 +19,9 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <errno.h>
 
 static int srvpid, size;
@@ -261,37 +265,46 @@ mustforksrv_unix(void)
     exit(1); /* satisfy the compiler */
 }
 
+// mustwaitread waits until fd is readable, exiting on timeout.
+static void
+mustwaitread(int fd)
+{
+    fd_set rfd;
+    struct timeval tv;
+
+    FD_ZERO(&rfd);
+    FD_SET(fd, &rfd);
+    tv.tv_sec = timeout / 1000000000;
+    tv.tv_usec = (timeout/1000) % 1000000;
+    int r = select(fd+1, &rfd, NULL, NULL, &tv);
+    switch (r) {
+    case 1:
+        break;
+    case 0:
+        fputs("timeout", stderr);
+        exit(8);
+    case -1:
+        perror("select");
+        exit(1);
+    default:
+        fputs("unknown error", stderr);
+        exit(3);
+    }
+}
+
 static char *
 readline(int fd)
 {
     char c = 0, p = 0;
-    static char buf[1024];
-    fd_set rfd;
-    struct timeval tv;
+    static char buf[4096];
+    int r;
 
     printf("<%d ", fd);
     fflush(stdout);
 
     size_t i = 0;
     for (;;) {
-        FD_ZERO(&rfd);
-        FD_SET(fd, &rfd);
-        tv.tv_sec = timeout / 1000000000;
-        tv.tv_usec = (timeout/1000) % 1000000;
-        int r = select(fd+1, &rfd, NULL, NULL, &tv);
-        switch (r) {
-        case 1:
-            break;
-        case 0:
-            fputs("timeout", stderr);
-            exit(8);
-        case -1:
-            perror("select");
-            exit(1);
-        default:
-            fputs("unknown error", stderr);
-            exit(3);
-        }
+        mustwaitread(fd);
 
         // TODO: try reading into a buffer to improve performance.
         // See related issue #430.
@@ -352,6 +365,80 @@ mustsend(int fd, char *s)
     fflush(stdout);
 }
 
+static void
+put32(char *p, uint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// binlisten makes the forked server also listen for the binary
+// protocol and returns the port.
+static int
+binlisten(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    srv.binport = "0";
+    srv.binsock.fd = make_server_socket("127.0.0.1", "0");
+    if (srv.binsock.fd == -1 ||
+        getsockname(srv.binsock.fd, (struct sockaddr *)&addr, &len) == -1) {
+        puts("binlisten failed");
+        exit(1);
+    }
+    return ntohs(addr.sin_port);
+}
+
+// mustsendbin sends a binary request with data as its body or tube name.
+static void
+mustsendbin(int fd, int op, uint64 id, uint32 pri, uint32 delay, uint32 ttr,
+            char *data)
+{
+    char buf[BIN_REQ_SIZE + 256] = {0};
+    size_t n = strlen(data);
+
+    buf[0] = op;
+    put32(buf + 4, n);
+    put32(buf + 8, id >> 32);
+    put32(buf + 12, id);
+    put32(buf + 16, pri);
+    put32(buf + 20, delay);
+    put32(buf + 24, ttr);
+    memcpy(buf + BIN_REQ_SIZE, data, n);
+    writefull(fd, buf, BIN_REQ_SIZE + n);
+    printf(">%d bin %d %"PRIu64" %s\n", fd, op, id, data);
+    fflush(stdout);
+}
+
+// ckbin reads a binary reply and checks its code, id and body.
+static void
+ckbin(int fd, int code, uint64 id, char *body)
+{
+    char buf[16 + 256];
+    size_t n = 16 + strlen(body), i = 0;
+    uint64 rid;
+    int r;
+
+    while (i < n) {
+        mustwaitread(fd);
+        r = read(fd, buf + i, n - i);
+        if (r < 1) {
+            perror("read");
+            exit(1);
+        }
+        i += r;
+    }
+    rid = (uint64)ntohl(*(uint32 *)(buf + 8)) << 32 | ntohl(*(uint32 *)(buf + 12));
+    printf("<%d bin %d %"PRIu64" %.*s\n", fd, buf[0], rid, (int)(n - 16), buf + 16);
+    assertf(buf[0] == code, "code %d != %d", buf[0], code);
+    assertf(ntohl(*(uint32 *)(buf + 4)) == strlen(body), "wrong length");
+    assertf(rid == id, "wrong id %llu", (unsigned long long)rid);
+    assertf(!memcmp(buf + 16, body, n - 16), "wrong body");
+}
+
 static int
 filesize(char *path)
 {
@@ -584,6 +671,464 @@ cttest_bury_bad_format()
     ckresp(fd, "BAD_FORMAT\r\n");
 }
 
+void
+cttest_kick_in_chunks()
+{
+    char buf[64];
+    int i;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    for (i = 1; i <= 2500; i++) {
+        mustsend(fd, "put 0 100 100 1\r\n");
+        mustsend(fd, "a\r\n");
+        sprintf(buf, "INSERTED %d\r\n", i);
+        ckresp(fd, buf);
+    }
+
+    // the kick spans three chunks; the next command waits for it
+    mustsend(fd, "kick 3000\r\npeek-ready\r\n");
+    ckresp(fd, "KICKED 2500\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "kick 10\r\n");
+    ckresp(fd, "KICKED 0\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 2500\n");
+}
+
+void
+cttest_put_batch()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 2 27\r\n");
+    mustsend(fd, "0 0 10 1\r\na\r\n");
+    mustsend(fd, "5 0 10 2\r\nbc\r\n\r\n");
+    ckresp(fd, "INSERTED 1 2\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bc\r\n");
+
+    // a malformed entry rejects the whole batch
+    mustsend(fd, "put-batch 2 27\r\n");
+    mustsend(fd, "0 0 10 1\r\na\r\n");
+    mustsend(fd, "5 0 10 2\r\nbcd\r\r\n");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+    mustsend(fd, "put-batch 1 14\r\n");
+    mustsend(fd, "0 0 10 x\r\nab\r\n\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-batch 0 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    mustsend(fd, "put-batch 1 13\r\n");
+    mustsend(fd, "0 0 10 1\r\nd\r\n\r\n");
+    ckresp(fd, "INSERTED 3 3\r\n");
+}
+
+void
+cttest_put_batch_binlog()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 3 41\r\n");
+    mustsend(fd, "0 0 10 1\r\na\r\n");
+    mustsend(fd, "0 0 10 1\r\nb\r\n");
+    mustsend(fd, "0 100 10 1\r\nc\r\n\r\n");
+    ckresp(fd, "INSERTED 1 3\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 2\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "FOUND 3 1\r\n");
+    ckresp(fd, "c\r\n");
+}
+
+void
+cttest_reserve_many()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 5 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 1 0 100 2\r\n");
+    mustsend(fd, "bc\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 9 0 100 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    // jobs come in priority order
+    mustsend(fd, "reserve-many 2 0\r\n");
+    ckresp(fd, "RESERVED_MANY 2 35\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bc\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve-many 10 0\r\n");
+    ckresp(fd, "RESERVED_MANY 1 16\r\n");
+    ckresp(fd, "RESERVED 3 0\r\n");
+    ckresp(fd, "\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve-many 10 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+
+    mustsend(fd, "reserve-many 0 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-many 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_reserve_many_size_limit()
+{
+    int i, size = 40 << 20;
+    char *body = malloc(size + 2);
+    memset(body, 'a', size);
+    memcpy(body + size, "\r\n", 2);
+
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int other = mustdiallocal(port);
+    for (i = 0; i < 2; i++) {
+        mustsend(fd, "put 0 0 100 41943040\r\n");
+        writefull(fd, body, size + 2);
+    }
+    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    free(body);
+
+    // the second job would not fit in the reply,
+    // so it is left ready and was never reserved
+    mustsend(fd, "reserve-many 2 0\r\n");
+    ckrespsub(fd, "RESERVED_MANY 1 ");
+    mustsend(other, "stats-job 2\r\n");
+    ckrespsub(other, "OK ");
+    ckrespsub(other, "\nstate: ready\n");
+    mustsend(other, "stats-job 2\r\n");
+    ckrespsub(other, "OK ");
+    ckrespsub(other, "\nreserves: 0\n");
+    mustsend(other, "stats-job 1\r\n");
+    ckrespsub(other, "OK ");
+    ckrespsub(other, "\nreserves: 1\n");
+}
+
+void
+cttest_reserve_many_wait()
+{
+    int port = SERVER();
+    int worker = mustdiallocal(port);
+    int producer = mustdiallocal(port);
+
+    // the worker waits and gets the job that arrives
+    mustsend(worker, "reserve-many 5 10\r\n");
+    mustsend(producer, "put 0 0 100 1\r\n");
+    mustsend(producer, "a\r\n");
+    ckresp(producer, "INSERTED 1\r\n");
+    ckresp(worker, "RESERVED_MANY 1 17\r\n");
+    ckresp(worker, "RESERVED 1 1\r\n");
+    ckresp(worker, "a\r\n");
+    ckresp(worker, "\r\n");
+}
+
+void
+cttest_delete_many()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 3 42\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n");
+    mustsend(fd, "0 0 100 1\r\nb\r\n");
+    mustsend(fd, "0 0 100 1\r\nc\r\n\r\n");
+    ckresp(fd, "INSERTED 1 3\r\n");
+    mustsend(fd, "delete-many 3 5\r\n");
+    mustsend(fd, "1 9 3\r\n");
+    ckresp(fd, "STATUS 3\r\n");
+    ckresp(fd, "DND\r\n");
+
+    mustsend(fd, "delete-many 3 3\r\n");
+    mustsend(fd, "1 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-many 2 3\r\n");
+    mustsend(fd, "1x2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    mustsend(fd, "stats json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\"cmd-put-batch\":1,\"cmd-reserve-many\":0,"
+                  "\"cmd-delete-many\":3,");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 1\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+}
+
+void
+cttest_touch_release_many()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 2 28\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n");
+    mustsend(fd, "0 0 100 1\r\nb\r\n\r\n");
+    ckresp(fd, "INSERTED 1 2\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd, "touch-many 2 3\r\n");
+    mustsend(fd, "1 2\r\n");
+    ckresp(fd, "STATUS 2\r\n");
+    ckresp(fd, "TN\r\n");
+    // the ids arrive together with the command line
+    mustsend(fd, "release-many 7 0 2 3\r\n2 1\r\n");
+    ckresp(fd, "STATUS 2\r\n");
+    ckresp(fd, "NR\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\npri: 7\n");
+    mustsend(fd, "release-many 7 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_delete_reserve()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 2 28\r\n");
+    mustsend(fd, "0 0 100 1\r\na\r\n");
+    mustsend(fd, "0 0 100 1\r\nb\r\n\r\n");
+    ckresp(fd, "INSERTED 1 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd, "delete-reserve 1\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "delete-reserve 1 0\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "release-reserve 2 3 0 0\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "bury-reserve 2 0 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: buried\n");
+    mustsend(fd, "delete-reserve 2 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_subscribe()
+{
+    int port = SERVER();
+    int worker = mustdiallocal(port);
+    int producer = mustdiallocal(port);
+    mustsend(producer, "put-batch 3 42\r\n");
+    mustsend(producer, "0 0 100 1\r\na\r\n");
+    mustsend(producer, "0 0 100 1\r\nb\r\n");
+    mustsend(producer, "0 0 100 1\r\nc\r\n\r\n");
+    ckresp(producer, "INSERTED 1 3\r\n");
+
+    // two credits, so two jobs are pushed at once
+    mustsend(worker, "subscribe 2\r\n");
+    ckresp(worker, "SUBSCRIBED 2\r\n");
+    ckresp(worker, "RESERVED_MANY 2 34\r\n");
+    ckresp(worker, "RESERVED 1 1\r\n");
+    ckresp(worker, "a\r\n");
+    ckresp(worker, "RESERVED 2 1\r\n");
+    ckresp(worker, "b\r\n");
+    ckresp(worker, "\r\n");
+
+    // a delete gives a credit back
+    mustsend(worker, "delete 1\r\n");
+    ckresp(worker, "DELETED\r\n");
+    ckresp(worker, "RESERVED_MANY 1 17\r\n");
+    ckresp(worker, "RESERVED 3 1\r\n");
+    ckresp(worker, "c\r\n");
+    ckresp(worker, "\r\n");
+
+    // no credits are left, so the new job waits
+    mustsend(producer, "put 0 0 100 1\r\n");
+    mustsend(producer, "d\r\n");
+    ckresp(producer, "INSERTED 4\r\n");
+    mustsend(worker, "stats-job 4\r\n");
+    ckrespsub(worker, "OK ");
+    ckrespsub(worker, "\nstate: ready\n");
+    mustsend(worker, "delete-many 2 3\r\n");
+    mustsend(worker, "2 3\r\n");
+    ckresp(worker, "STATUS 2\r\n");
+    ckresp(worker, "DD\r\n");
+    ckresp(worker, "RESERVED_MANY 1 17\r\n");
+    ckresp(worker, "RESERVED 4 1\r\n");
+    ckresp(worker, "d\r\n");
+    ckresp(worker, "\r\n");
+
+    // after unsubscribing, jobs are no longer pushed
+    mustsend(worker, "subscribe 0\r\n");
+    ckresp(worker, "SUBSCRIBED 0\r\n");
+    mustsend(worker, "release 4 0 0\r\n");
+    ckresp(worker, "RELEASED\r\n");
+    mustsend(worker, "peek-ready\r\n");
+    ckresp(worker, "FOUND 4 1\r\n");
+    ckresp(worker, "d\r\n");
+}
+
+void
+cttest_subscribe_own_put()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // a job put by the subscribed conn is pushed after the reply,
+    // also when the body comes in the same read as the command
+    mustsend(fd, "subscribe 1\r\n");
+    ckresp(fd, "SUBSCRIBED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED_MANY 1 17\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "\r\n");
+
+    // jobs from a tube watched later are pushed too
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "ignore default\r\n");
+    ckresp(fd, "WATCHING 1\r\n");
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    ckresp(fd, "RESERVED_MANY 1 17\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    ckresp(fd, "\r\n");
+}
+
+void
+cttest_subscribe_deadline_soon()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    mustsend(fd, "subscribe 1\r\n");
+    ckresp(fd, "SUBSCRIBED 1\r\n");
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED_MANY 1 17\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "\r\n");
+
+    // an explicit reserve is still told of the deadline
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "DEADLINE_SOON\r\n");
+
+    // also when the deadline comes while the reserve waits
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put 0 0 2 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    ckresp(fd, "RESERVED_MANY 1 17\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve-with-timeout 10\r\n");
+    ckresp(fd, "DEADLINE_SOON\r\n");
+}
+
+void
+cttest_binary_protocol()
+{
+    int binport = binlisten();
+    int port = SERVER();
+    int fd = mustdiallocal(binport);
+
+    // ops: 1 put, 2 peek, 3 reserve, 4 delete, 11 use, 12 watch,
+    // 20 reserve-with-timeout, 21 touch. Reply codes are listed in
+    // doc/protocol.txt.
+    mustsendbin(fd, 11, 0, 0, 0, 0, "bin");
+    ckbin(fd, 9, 0, "");
+    mustsendbin(fd, 1, 0, 5, 0, 100, "hello");
+    ckbin(fd, 1, 1, "");
+    mustsendbin(fd, 12, 0, 0, 0, 0, "bin");
+    ckbin(fd, 10, 2, "");
+    mustsendbin(fd, 3, 0, 0, 0, 0, "");
+    ckbin(fd, 3, 1, "hello");
+    mustsendbin(fd, 21, 1, 0, 0, 0, "");
+    ckbin(fd, 7, 0, "");
+    mustsendbin(fd, 4, 1, 0, 0, 0, "");
+    ckbin(fd, 5, 0, "");
+    mustsendbin(fd, 4, 1, 0, 0, 0, "");
+    ckbin(fd, 12, 0, "");
+    mustsendbin(fd, 20, 0, 0, 0, 0, "");
+    ckbin(fd, 13, 0, "");
+    mustsendbin(fd, 8, 0, 0, 0, 0, "");
+    ckbin(fd, 19, 0, "");
+
+    // both protocols share the same jobs and tubes
+    mustsendbin(fd, 1, 0, 0, 0, 100, "x");
+    ckbin(fd, 1, 2, "");
+    int tfd = mustdiallocal(port);
+    mustsend(tfd, "peek 2\r\n");
+    ckresp(tfd, "FOUND 2 1\r\n");
+    ckresp(tfd, "x\r\n");
+    mustsend(tfd, "put 0 0 100 1\r\n");
+    mustsend(tfd, "y\r\n");
+    ckresp(tfd, "INSERTED 3\r\n");
+    mustsendbin(fd, 2, 3, 0, 0, 0, "");
+    ckbin(fd, 4, 3, "y");
+}
+
 void
 cttest_kickjob_bad_format()
 {
@@ -1519,27 +2064,83 @@ cttest_longest_command()
 }
 
 void
-cttest_binlog_empty_exit()
+cttest_stats_memory()
 {
-    srv.wal.dir = ctdir();
-    srv.wal.use = 1;
-    job_data_size_limit = 10;
-
     int port = SERVER();
-    kill_srvpid();
-
-    port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "stats-memory\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nlimit: 0\n");
+    mustsend(fd, "stats-memory foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_binlog_bury()
+cttest_mem_limit()
 {
-    srv.wal.dir = ctdir();
-    srv.wal.use = 1;
+    mem_limit = 1;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 5\r\n");
+    mustsend(fd, "hello\r\n");
+    ckresp(fd, "OUT_OF_MEMORY\r\n");
+    mustsend(fd, "stats-memory\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nrejected-puts: 1\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_set_durability()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "set-durability tubea\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "set-durability tubea sometimes\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "set-durability tubea none\r\n");
+    ckresp(fd, "DURABILITY none\r\n");
+
+    // The tube is kept while it has a durability class.
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: none\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: default\n");
+
+    mustsend(fd, "set-durability tubea default\r\n");
+    ckresp(fd, "DURABILITY default\r\n");
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "set-durability " STRING_LEN_200 " buffered\r\n");
+    ckresp(fd, "DURABILITY buffered\r\n");
+}
+
+void
+cttest_binlog_empty_exit()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = 10;
+
+    int port = SERVER();
+    kill_srvpid();
+
+    port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_binlog_bury()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
     job_data_size_limit = 10;
 
     int port = SERVER();
@@ -1608,6 +2209,40 @@ cttest_binlog_size_limit()
     free(b2);
 }
 
+void
+cttest_binlog_put_batch_rotate()
+{
+    static char entry[] = "0 0 100 50\r\n"
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n";
+    int i, n = sizeof entry - 1;
+    char buf[100 * (sizeof entry - 1)];
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+
+    // the batch spans several binlog files
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    for (i = 0; i < 100; i++)
+        memcpy(buf + i*n, entry, n);
+    mustsend(fd, "put-batch 100 6400\r\n");
+    writefull(fd, buf, sizeof buf);
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1 100\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 100\n");
+    mustsend(fd, "peek 100\r\n");
+    ckresp(fd, "FOUND 100 50\r\n");
+    ckresp(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+}
+
 void
 cttest_binlog_allocation()
 {
@@ -1683,6 +2318,250 @@ cttest_binlog_read()
     ckresp(fd, "NOT_FOUND\r\n");
 }
 
+void
+cttest_binlog_durability()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "set-durability cache none\r\n");
+    ckresp(fd, "DURABILITY none\r\n");
+    mustsend(fd, "set-durability orders fsync\r\n");
+    ckresp(fd, "DURABILITY fsync\r\n");
+    mustsend(fd, "use cache\r\n");
+    ckresp(fd, "USING cache\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use orders\r\n");
+    ckresp(fd, "USING orders\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-records-written: 1\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "stats-tube cache\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: none\n");
+    mustsend(fd, "stats-tube orders\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: fsync\n");
+}
+
+void
+cttest_binlog_durability_change()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    // a job keeps the class it was put under
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "set-durability default none\r\n");
+    ckresp(fd, "DURABILITY none\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "set-durability default fsync\r\n");
+    ckresp(fd, "DURABILITY fsync\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "set-durability default buffered\r\n");
+    ckresp(fd, "DURABILITY buffered\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-records-written: 2\n");
+    mustsend(fd, "stats-loop\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-syncs: 2\n");
+}
+
+void
+cttest_binlog_durability_rotate()
+{
+    static char entry[] = "0 0 100 50\r\n"
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n";
+    int i, n = sizeof entry - 1;
+    char buf[100 * (sizeof entry - 1)];
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+
+    // each file the batch fills is synced before it is closed
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "set-durability default fsync\r\n");
+    ckresp(fd, "DURABILITY fsync\r\n");
+    for (i = 0; i < 100; i++)
+        memcpy(buf + i*n, entry, n);
+    mustsend(fd, "put-batch 100 6400\r\n");
+    writefull(fd, buf, sizeof buf);
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1 100\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    char *p = strstr(readline(fd), "\nbinlog-current-index: ");
+    assert(p);
+    int nfile = atoi(p + 23);
+    assertf(nfile > 1, "binlog-current-index: %d", nfile);
+    mustsend(fd, "stats-loop\r\n");
+    ckrespsub(fd, "OK ");
+    p = strstr(readline(fd), "\nbinlog-syncs: ");
+    assert(p);
+    assertf(atoi(p + 15) == nfile, "binlog-syncs: %d, want %d",
+            atoi(p + 15), nfile);
+}
+
+void
+cttest_binlog_partitions()
+{
+    struct stat st;
+    char buf[1024];
+    int i;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.nwal = 3;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    for (i = 1; i <= 6; i++) {
+        sprintf(buf, "use t%d\r\n", i);
+        mustsend(fd, buf);
+        sprintf(buf, "USING t%d\r\n", i);
+        ckresp(fd, buf);
+        mustsend(fd, "put 0 0 100 1\r\n");
+        sprintf(buf, "%d\r\n", i);
+        mustsend(fd, buf);
+        sprintf(buf, "INSERTED %d\r\n", i);
+        ckresp(fd, buf);
+    }
+    mustsend(fd, "delete 3\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    kill_srvpid();
+
+    for (i = 0; i < 3; i++) {
+        sprintf(buf, "%s/%d", ctdir(), i);
+        assert(stat(buf, &st) == 0 && S_ISDIR(st.st_mode));
+    }
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 1; i <= 6; i++) {
+        sprintf(buf, "peek %d\r\n", i);
+        mustsend(fd, buf);
+        if (i == 3) {
+            ckresp(fd, "NOT_FOUND\r\n");
+            continue;
+        }
+        sprintf(buf, "FOUND %d 1\r\n", i);
+        ckresp(fd, buf);
+        sprintf(buf, "%d\r\n", i);
+        ckresp(fd, buf);
+    }
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 7\r\n");
+}
+
+void
+cttest_binlog_lazy_body()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    body_budget = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 5\r\n");
+    mustsend(fd, "hello\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 5\r\n");
+    ckresp(fd, "hello\r\n");
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-resident-bytes: 0\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 5\r\n");
+    ckresp(fd, "hello\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-cache-misses: 1\nbody-evictions: 2\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+
+    kill_srvpid();
+
+    // the body is read only when the job is reserved
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-resident-bytes: 0\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 5\r\n");
+    ckresp(fd, "hello\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-resident-bytes: 7\nbody-cache-hits: 0\nbody-cache-misses: 1\n");
+}
+
+void
+cttest_binlog_body_budget()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    body_budget = 10;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 5\r\n");
+    mustsend(fd, "hello\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 5\r\n");
+    ckresp(fd, "hello\r\n");
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    // within the budget, the buried body stays
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-resident-bytes: 7\n");
+
+    // a new job takes bodies over the budget, so it goes
+    mustsend(fd, "put 0 0 100 5\r\n");
+    mustsend(fd, "world\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-resident-bytes: 7\nbody-cache-hits: 1\n"
+              "body-cache-misses: 0\nbody-evictions: 1\n");
+}
+
 void
 cttest_binlog_disk_full()
 {
@@ -1987,50 +2866,370 @@ cttest_binlog_v5()
     ckrespsub(fd, "\nkicks: 0\n");
 }
 
-static void
-bench_put_delete_size(int n, int size, int walsize, int sync, int64 syncrate_ms)
+void
+cttest_stats_tubes()
 {
-    if (walsize > 0) {
-        srv.wal.dir = ctdir();
-        srv.wal.use = 1;
-        srv.wal.filesize = walsize;
-        srv.wal.syncrate = syncrate_ms * 1000000;
-        srv.wal.wantsync = sync;
-    }
-
-    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    char buf[50], put[50];
-    char body[size+1];
-    memset(body, 'a', size);
-    body[size] = 0;
-    ctsetbytes(size);
-    sprintf(put, "put 0 0 0 %d\r\n", size);
-    ctresettimer();
-    int i;
-    for (i = 0; i < n; i++) {
-        mustsend(fd, put);
-        mustsend(fd, body);
-        mustsend(fd, "\r\n");
-        ckrespsub(fd, "INSERTED ");
-        sprintf(buf, "delete %d\r\n", i + 1);
-        mustsend(fd, buf);
-        ckresp(fd, "DELETED\r\n");
-    }
-    ctstoptimer();
-}
+    mustsend(fd, "use app.a\r\n");
+    ckresp(fd, "USING app.a\r\n");
+    mustsend(fd, "put 0 100 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use app.b\r\n");
+    ckresp(fd, "USING app.b\r\n");
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "b\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
 
-void
-ctbench_put_delete_0008(int n)
-{
-    bench_put_delete_size(n, 8, 0, 0, 0);
-}
+    mustsend(fd, "stats-tubes app.a\r\n");
+    ckresp(fd, "OK 306\r\n");
+    ckresp(fd, "---\n"
+           "columns: [name, current-jobs-urgent, current-jobs-ready, "
+           "current-jobs-reserved, current-jobs-delayed, current-jobs-buried, "
+           "total-jobs, current-using, current-watching, current-waiting, "
+           "cmd-delete, cmd-pause-tube, pause, pause-time-left]\n"
+           "tubes:\n"
+           "- [app.a, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0]\n"
+           "next: \"\"\n"
+           "\r\n");
+
+    // one tube per page, in name order
+    mustsend(fd, "stats-tubes app. * 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\n- [app.a, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0]\n"
+              "next: \"app.a\"\n");
+    mustsend(fd, "stats-tubes app. app.a 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\n- [app.b, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0]\n"
+              "next: \"\"\n");
+    mustsend(fd, "stats-tubes * app.a 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\n- [default, ");
+    mustsend(fd, "stats-tubes nomatch\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntubes: []\nnext: \"\"\n");
+    // the longest stats-tubes command fits
+    char cmd[512], name[200];
+    memset(name, 'a', sizeof name);
+    snprintf(cmd, sizeof cmd, "stats-tubes %.200s %.200s 4294967295 json\r\n",
+             name, name);
+    mustsend(fd, cmd);
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\"tubes\":[],\"next\":\"\"}\r\n");
 
-void
-ctbench_put_delete_1024(int n)
-{
-    bench_put_delete_size(n, 1024, 0, 0, 0);
+    mustsend(fd, "stats-tubes app. 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tubes app. -a 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tubes -app\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tubesapp\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // the global delayed count follows the jobs
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+    mustsend(fd, "use app.a\r\n");
+    ckresp(fd, "USING app.a\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+
+    // a tube that goes away between pages does not move the others
+    mustsend(fd, "stats-tubes app. * 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nnext: \"app.a\"\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "use default\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "stats-tube app.a\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-tubes app. app.a 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\n- [app.b, ");
+}
+
+void
+cttest_stats_json()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats-job 1 json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "{\"id\":1,\"tube\":\"default\",\"state\":\"ready\",\"pri\":0,");
+    mustsend(fd, "stats-tube default json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, ",\"current-jobs-ready\":1,");
+    mustsend(fd, "stats json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, ",\"draining\":false,");
+    mustsend(fd, "stats-memory json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "{\"limit\":0,");
+    mustsend(fd, "stats-tubes * * 0 json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\"tubes\":[[\"default\",1,1,0,0,0,1,1,1,0,0,0,0,0]],\"next\":\"\"}\r\n");
+    mustsend(fd, "stats-tubes none * 0 json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\"tubes\":[],\"next\":\"\"}\r\n");
+
+    mustsend(fd, "stats yaml\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-job 1 json x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_stats_tube_hist()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use h\r\n");
+    ckresp(fd, "USING h\r\n");
+    mustsend(fd, "watch h\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "stats-tube h\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nwait-p50-us: 0\nwait-p90-us: 0\nwait-p99-us: 0\n"
+              "service-p50-us: 0\nservice-p90-us: 0\nservice-p99-us: 0\n"
+              "body-size-p50: 0\nbody-size-p90: 0\nbody-size-p99: 0\n");
+
+    mustsend(fd, "put 0 0 100 5\r\n");
+    mustsend(fd, "hello\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 5\r\n");
+    ckresp(fd, "hello\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    mustsend(fd, "stats-tube h\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-size-p50: 5\nbody-size-p90: 5\nbody-size-p99: 5\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-size-p50: 5\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbody-size-p50: 0\n");
+}
+
+void
+cttest_stats_loop()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "stats-loop\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nloop-slow-threshold-ns: 1000000\n");
+    mustsend(fd, "stats-loop\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncolumns: [name, count, p50-ns, p90-ns, p99-ns]\nops:\n- [put, 1, ");
+    mustsend(fd, "stats-loop json\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\"ops\":[[\"put\",1,");
+    mustsend(fd, "stats-loop x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_dump_trace()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    mustsend(fd, "dump-trace\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, " put ");
+    mustsend(fd, "dump-trace\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, " reserve ");
+    mustsend(fd, "dump-trace\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, " delete ");
+    mustsend(fd, "dump-trace x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // accept, put, reserve and delete; the data is left unread
+    mustsend(fd, "dump-trace binary\r\n");
+    ckrespsub(fd, "OK 96\r\n");
+}
+
+void
+cttest_stats_file()
+{
+    char *path = fmtalloc("%s/stats", ctdir());
+    struct stat st;
+    Shmhdr *h;
+    int fd, i;
+
+    srv.shmpath = path;
+    assert(shmopen(path));
+    int port = SERVER();
+    int cfd = mustdiallocal(port);
+    // enough tubes to make the file grow
+    for (i = 0; i < Shmtubemin + 4; i++) {
+        char line[32];
+        snprintf(line, sizeof line, "watch t%d\r\n", i);
+        mustsend(cfd, line);
+        snprintf(line, sizeof line, "WATCHING %d\r\n", i + 2);
+        ckresp(cfd, line);
+    }
+    mustsend(cfd, "put 0 0 100 1\r\n");
+    mustsend(cfd, "a\r\n");
+    ckresp(cfd, "INSERTED 1\r\n");
+    usleep(3 * Shmperiod / 1000);
+
+    fd = open(path, O_RDONLY);
+    assertf(fd != -1, "open %s", path);
+    assert(fstat(fd, &st) == 0);
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    assert(h != MAP_FAILED);
+    assertf(h->magic == Shmmagic, "magic %x", h->magic);
+    assertf(h->version == Shmversion, "version %u", h->version);
+    assertf(h->seq % 2 == 0, "not being written");
+    assertf(h->size == (uint64)st.st_size, "size %" PRIu64, h->size);
+    assertf(h->ntube == Shmtubemin + 5, "tubes %u", h->ntube);
+    assertf(h->tubecap >= h->ntube, "room for %u tubes", h->tubecap);
+    assertf(h->global.total_jobs == 1, "total jobs %" PRIu64,
+            h->global.total_jobs);
+    assertf(h->op[1] == 1, "put count %" PRIu64, h->op[1]);
+    assertf(strcmp(h->opname[1], "put ") == 0, "op 1 is %s", h->opname[1]);
+    munmap(h, st.st_size);
+    close(fd);
+}
+
+void
+cttest_parse_verbs()
+{
+    static const char *lines[][2] = {
+        {"put 0 0 10 1\r\n", "put "},
+        {"put-batch 2 10\r\n", "put-batch "},
+        {"peek 1\r\n", "peek "},
+        {"peek-ready\r\n", "peek-ready"},
+        {"peek-delayed\r\n", "peek-delayed"},
+        {"peek-buried\r\n", "peek-buried"},
+        {"pause-tube default 1\r\n", "pause-tube"},
+        {"reserve\r\n", "reserve"},
+        {"reserve-with-timeout 1\r\n", "reserve-with-timeout "},
+        {"reserve-job 1\r\n", "reserve-job "},
+        {"reserve-many 2\r\n", "reserve-many "},
+        {"release 1 0 0\r\n", "release "},
+        {"release-many 0 0 2 16\r\n", "release-many "},
+        {"release-reserve 1 0 0\r\n", "release-reserve "},
+        {"delete 1\r\n", "delete "},
+        {"delete-many 2 16\r\n", "delete-many "},
+        {"delete-reserve 1\r\n", "delete-reserve "},
+        {"bury 1 0\r\n", "bury "},
+        {"bury-reserve 1 0\r\n", "bury-reserve "},
+        {"kick 1\r\n", "kick "},
+        {"kick-job 1\r\n", "kick-job "},
+        {"touch 1\r\n", "touch "},
+        {"touch-many 2 16\r\n", "touch-many "},
+        {"stats\r\n", "stats"},
+        {"stats-job 1\r\n", "stats-job "},
+        {"stats-tube default\r\n", "stats-tube "},
+        {"stats-memory\r\n", "stats-memory"},
+        {"stats-tubes\r\n", "stats-tubes"},
+        {"stats-tubes * * 10\r\n", "stats-tubes"},
+        {"stats-loop json\r\n", "stats-loop"},
+        {"dump-trace binary\r\n", "dump-trace"},
+        {"set-durability default none\r\n", "set-durability "},
+        {"subscribe 10\r\n", "subscribe "},
+        {"use default\r\n", "use "},
+        {"watch default\r\n", "watch "},
+        {"ignore default\r\n", "ignore "},
+        {"list-tubes\r\n", "list-tubes"},
+        {"list-tube-used\r\n", "list-tube-used"},
+        {"list-tubes-watched\r\n", "list-tubes-watched"},
+        {"quit\r\n", "quit"},
+        {"\r\n", "<unknown>"},
+        {"frobnicate\r\n", "<unknown>"},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        const char *op = prot_parse(lines[i][0], strlen(lines[i][0]));
+        assertf(op && !strcmp(op, lines[i][1]), "line %zu: %s", i, op);
+    }
+
+    // incomplete lines
+    assert(!prot_parse("put 0 0 10 1\r", 13));
+    assert(!prot_parse("list-tubes-watched", 18));
+    assert(!prot_parse("list-tubes\rwatched\r\n", 20));
+
+    // a NUL anywhere before the end of the line, but not after it
+    assert(!prot_parse("list-tubes\0watched\r\n", 20));
+    assert(!prot_parse("\0ist-tubes-watched\r\n", 20));
+    assert(!prot_parse("list-tubes-watche\0\r\n", 20));
+    assert(prot_parse("stats\r\n\0", 8));
+}
+
+static void
+bench_put_delete_size(int n, int size, int walsize, int sync, int64 syncrate_ms)
+{
+    if (walsize > 0) {
+        srv.wal.dir = ctdir();
+        srv.wal.use = 1;
+        srv.wal.filesize = walsize;
+        srv.wal.syncrate = syncrate_ms * 1000000;
+        srv.wal.wantsync = sync;
+    }
+
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char buf[50], put[50];
+    char body[size+1];
+    memset(body, 'a', size);
+    body[size] = 0;
+    ctsetbytes(size);
+    sprintf(put, "put 0 0 0 %d\r\n", size);
+    ctresettimer();
+    int i;
+    for (i = 0; i < n; i++) {
+        mustsend(fd, put);
+        mustsend(fd, body);
+        mustsend(fd, "\r\n");
+        ckrespsub(fd, "INSERTED ");
+        sprintf(buf, "delete %d\r\n", i + 1);
+        mustsend(fd, buf);
+        ckresp(fd, "DELETED\r\n");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_put_delete_0008(int n)
+{
+    bench_put_delete_size(n, 8, 0, 0, 0);
+}
+
+void
+ctbench_put_delete_1024(int n)
+{
+    bench_put_delete_size(n, 1024, 0, 0, 0);
 }
 
 void
@@ -2092,3 +3291,979 @@ ctbench_put_delete_wal_8192_no_fsync(int n)
 {
     bench_put_delete_size(n, 8192, 512000, 0, 0);
 }
+
+void
+ctbench_stats(int n)
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int i;
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "stats\r\n");
+        ckrespsub(fd, "OK ");
+        ckrespsub(fd, "\nplatform: ");
+    }
+    ctstoptimer();
+}
+
+// The load benchmarks below fork producer and consumer processes against
+// one server. Clients talk through a Benchconn, a buffered reader without
+// the select and echo of readline, and record latencies into histograms
+// shared with the parent, which merges them and reports percentiles with
+// ctmetric. Every job body is a 20-digit timestamp, so a consumer can tell
+// how long a job took to reach it.
+
+enum { Benchbody = 20, Benchdepth = 16, Benchbatch = 1000 };
+
+enum // the histograms kept by each client
+{
+    Benchput, // ns from sending a put to its INSERTED
+    Benchrsv, // ns from asking for a job to its RESERVED
+    Benchage, // ns from the timestamp in the body to the RESERVED
+    Nbench
+};
+
+typedef struct Benchconn Benchconn;
+struct Benchconn {
+    int  fd;
+    int  len, off;
+    char buf[4096];
+};
+
+typedef struct Benchshm Benchshm;
+struct Benchshm {
+    volatile int   ready, go;
+    volatile int64 left;  // jobs not yet deleted by the consumers
+    int            nquit; // quit jobs to put when left reaches 0
+    Hist           hist[]; // Nbench per client
+};
+
+static int64
+benchnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void
+bcdial(Benchconn *b, int port)
+{
+    b->fd = mustdiallocal(port);
+    b->len = b->off = 0;
+}
+
+static void
+bcfill(Benchconn *b)
+{
+    if (b->off > 0) {
+        memmove(b->buf, b->buf + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+    if (b->len == sizeof b->buf) {
+        puts("bcfill: reply line too long");
+        exit(1);
+    }
+    int r = read(b->fd, b->buf + b->len, sizeof b->buf - b->len);
+    if (r <= 0) {
+        twarn("bcfill: read");
+        exit(1);
+    }
+    b->len += r;
+}
+
+// bcline reads one reply line into line, without the "\r\n".
+static void
+bcline(Benchconn *b, char *line, size_t max)
+{
+    char *p;
+
+    while (!(p = memchr(b->buf + b->off, '\n', b->len - b->off)))
+        bcfill(b);
+    size_t n = p - (b->buf + b->off) + 1;
+    if (n < 2 || n - 2 >= max) {
+        puts("bcline: bad reply line");
+        exit(1);
+    }
+    memcpy(line, b->buf + b->off, n - 2);
+    line[n - 2] = '\0';
+    b->off += n;
+}
+
+// bcread reads n bytes into p, or skips them if p is NULL.
+static void
+bcread(Benchconn *b, char *p, int n)
+{
+    while (n > 0) {
+        if (b->off == b->len)
+            bcfill(b);
+        int k = min(n, b->len - b->off);
+        if (p) {
+            memcpy(p, b->buf + b->off, k);
+            p += k;
+        }
+        b->off += k;
+        n -= k;
+    }
+}
+
+// bcexpect reads a reply line and exits unless it starts with prefix.
+static void
+bcexpect(Benchconn *b, char *line, size_t max, char *prefix)
+{
+    bcline(b, line, max);
+    if (strncmp(line, prefix, strlen(prefix)) != 0) {
+        printf("expected %s, got \"%s\"\n", prefix, line);
+        exit(1);
+    }
+}
+
+static Benchshm *
+benchshm(int nclient, int64 left)
+{
+    size_t size = sizeof(Benchshm) + nclient*Nbench*sizeof(Hist);
+    Benchshm *sh = mmap(0, size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) {
+        twarn("mmap");
+        exit(1);
+    }
+    sh->left = left;
+    return sh;
+}
+
+// benchfork forks a client. The child forgets srvpid, so only the
+// parent's exit handler kills the server, and finishes with _exit.
+static int
+benchfork(int *pids, int i)
+{
+    int pid = fork();
+    if (pid < 0) {
+        twarn("fork");
+        exit(1);
+    }
+    if (pid == 0)
+        srvpid = 0;
+    pids[i] = pid;
+    return pid;
+}
+
+static void
+benchready(Benchshm *sh)
+{
+    __sync_fetch_and_add(&sh->ready, 1);
+    while (!sh->go)
+        usleep(100);
+}
+
+// benchgo waits for n clients to be ready, then starts them all.
+static void
+benchgo(Benchshm *sh, int n)
+{
+    while (sh->ready < n)
+        usleep(100);
+    sh->go = 1;
+}
+
+static void
+benchwait(int *pids, int n)
+{
+    int i, status;
+
+    for (i = 0; i < n; i++) {
+        if (waitpid(pids[i], &status, 0) == -1) {
+            twarn("waitpid");
+            exit(1);
+        }
+        assertf(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                "client %d failed with status %d", i, status);
+    }
+}
+
+// benchpcts reports the median and 99th percentile of h
+// as name-p50-ns and name-p99-ns.
+static void
+benchpcts(Hist *h, char *name)
+{
+    char unit[16];
+
+    if (!h->count)
+        return;
+    snprintf(unit, sizeof unit, "%s-p50-ns", name);
+    ctmetric(unit, hist_percentile(h, 500));
+    snprintf(unit, sizeof unit, "%s-p99-ns", name);
+    ctmetric(unit, hist_percentile(h, 990));
+}
+
+// benchreport merges histogram kind of n clients and reports it.
+static void
+benchreport(Benchshm *sh, int n, int kind, char *name)
+{
+    Hist h = {0};
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        Hist *c = &sh->hist[i*Nbench + kind];
+        h.count += c->count;
+        for (j = 0; j < HIST_BUCKETS; j++)
+            h.bucket[j] += c->bucket[j];
+    }
+    benchpcts(&h, name);
+}
+
+static void
+benchrate(int64 n, int64 t0)
+{
+    int64 dt = benchnow() - t0;
+    if (dt > 0)
+        ctmetric("jobs/s", n * 1000000000 / dt);
+}
+
+// benchproducer puts njob jobs, keeping up to Benchdepth puts in
+// flight. With ntube > 1 it switches tubes before every put.
+static void
+benchproducer(Benchshm *sh, Hist *h, int port, int njob, int ntube)
+{
+    Benchconn b;
+    char cmd[128], line[64];
+    int64 sent[Benchdepth];
+    int nsent = 0, ndone = 0;
+
+    bcdial(&b, port);
+    benchready(sh);
+    while (ndone < njob) {
+        while (nsent < njob && nsent - ndone < Benchdepth) {
+            int n = 0;
+            if (ntube > 1)
+                n = sprintf(cmd, "use t%d\r\n", nsent % ntube);
+            sent[nsent % Benchdepth] = benchnow();
+            n += sprintf(cmd + n, "put 0 0 60 %d\r\n%0*" PRId64 "\r\n",
+                         Benchbody, Benchbody, sent[nsent % Benchdepth]);
+            writefull(b.fd, cmd, n);
+            nsent++;
+        }
+        if (ntube > 1)
+            bcexpect(&b, line, sizeof line, "USING ");
+        bcexpect(&b, line, sizeof line, "INSERTED ");
+        hist_record(&h[Benchput], benchnow() - sent[ndone % Benchdepth]);
+        ndone++;
+    }
+    _exit(0);
+}
+
+// benchquit puts the quit jobs, empty bodies that tell the other
+// consumers to stop, from a new connection after closing b.
+static void
+benchquit(Benchshm *sh, Benchconn *b, int port)
+{
+    char line[64];
+    int i;
+
+    close(b->fd);
+    bcdial(b, port);
+    for (i = 0; i < sh->nquit; i++) {
+        writefull(b->fd, "put 0 0 60 0\r\n\r\n", 16);
+        bcexpect(b, line, sizeof line, "INSERTED ");
+    }
+    _exit(0);
+}
+
+// benchconsumer reserves and deletes jobs, sending each delete along
+// with the next reserve, until all jobs are gone or it gets a quit job.
+static void
+benchconsumer(Benchshm *sh, Hist *h, int port, int ntube)
+{
+    Benchconn b;
+    char cmd[128], line[64], body[Benchbody+2];
+    uint64 id;
+    int i, n;
+
+    bcdial(&b, port);
+    for (i = 0; i < ntube && ntube > 1; i++) {
+        n = sprintf(cmd, "watch t%d\r\n", i);
+        writefull(b.fd, cmd, n);
+        bcexpect(&b, line, sizeof line, "WATCHING ");
+    }
+    benchready(sh);
+    int64 asked = benchnow();
+    writefull(b.fd, "reserve\r\n", 9);
+    for (;;) {
+        bcexpect(&b, line, sizeof line, "RESERVED ");
+        int64 now = benchnow();
+        if (sscanf(line, "RESERVED %" SCNu64 " %d", &id, &n) != 2 ||
+            (n != 0 && n != Benchbody)) {
+            printf("bad reply \"%s\"\n", line);
+            exit(1);
+        }
+        bcread(&b, body, n + 2);
+        if (n == 0)
+            _exit(0);
+        hist_record(&h[Benchrsv], now - asked);
+        body[n] = '\0';
+        int64 at = strtoll(body, NULL, 10);
+        if (at > 0)
+            hist_record(&h[Benchage], now > at ? now - at : 0);
+
+        asked = benchnow();
+        n = sprintf(cmd, "delete %" PRIu64 "\r\nreserve\r\n", id);
+        writefull(b.fd, cmd, n);
+        bcexpect(&b, line, sizeof line, "DELETED");
+        if (__sync_sub_and_fetch(&sh->left, 1) == 0)
+            benchquit(sh, &b, port);
+    }
+}
+
+// benchnofile raises the limit on open files to at least want,
+// if the hard limit allows it.
+static void
+benchnofile(rlim_t want)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        twarn("getrlimit");
+        exit(1);
+    }
+    if (rl.rlim_cur >= want)
+        return;
+    rl.rlim_cur = min(want, rl.rlim_max);
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        twarn("setrlimit");
+        exit(1);
+    }
+}
+
+// benchwaiters opens n connections blocked in a long reserve on
+// a tube that never gets a job.
+static void
+benchwaiters(int port, int n)
+{
+    static char req[] = "watch idle\r\nignore default\r\n"
+                        "reserve-with-timeout 600\r\n";
+    Benchconn b;
+    char line[64];
+    int i, *fds = malloc(n * sizeof *fds);
+
+    for (i = 0; i < n; i++) {
+        fds[i] = mustdiallocal(port);
+        writefull(fds[i], req, sizeof req - 1);
+    }
+    for (i = 0; i < n; i++) {
+        b.fd = fds[i];
+        b.len = b.off = 0;
+        bcexpect(&b, line, sizeof line, "WATCHING 2");
+        bcexpect(&b, line, sizeof line, "WATCHING 1");
+    }
+}
+
+// bench_load runs np producers and nc consumers moving n jobs through
+// ntube tubes, with nwait idle connections waiting on another tube.
+static void
+bench_load(int n, int np, int nc, int ntube, int nwait)
+{
+    int i, pids[np + nc];
+
+    if (nwait)
+        benchnofile(nwait + 256);
+    int port = SERVER();
+    if (nwait)
+        benchwaiters(port, nwait);
+
+    Benchshm *sh = benchshm(np + nc, n);
+    sh->nquit = nc - 1;
+    for (i = 0; i < np; i++) {
+        int njob = n/np + (i < n%np);
+        if (benchfork(pids, i) == 0)
+            benchproducer(sh, &sh->hist[i*Nbench], port, njob, ntube);
+    }
+    for (i = np; i < np + nc; i++) {
+        if (benchfork(pids, i) == 0)
+            benchconsumer(sh, &sh->hist[i*Nbench], port, ntube);
+    }
+
+    benchgo(sh, np + nc);
+    ctresettimer();
+    int64 t0 = benchnow();
+    benchwait(pids, np + nc);
+    ctstoptimer();
+    benchrate(n, t0);
+    benchreport(sh, np + nc, Benchput, "put");
+    benchreport(sh, np + nc, Benchage, "e2e");
+}
+
+// benchputmany puts n jobs with put-batch. Each body holds the time
+// the job becomes ready, or 0 if delay is 0. Returns the first such time.
+static int64
+benchputmany(int port, int n, int delay, int ttr)
+{
+    Benchconn b;
+    char line[64], hdr[64];
+    int i, k, len;
+    int64 first = 0;
+    char *buf = malloc(Benchbatch * 64);
+
+    bcdial(&b, port);
+    while (n > 0) {
+        k = min(n, Benchbatch);
+        int64 at = delay ? benchnow() + (int64)delay*1000000000 : 0;
+        if (!first)
+            first = at;
+        for (i = len = 0; i < k; i++) {
+            len += sprintf(buf + len, "0 %d %d %d\r\n%0*" PRId64 "\r\n",
+                           delay, ttr, Benchbody, Benchbody, at);
+        }
+        int h = sprintf(hdr, "put-batch %d %d\r\n", k, len);
+        writefull(b.fd, hdr, h);
+        writefull(b.fd, buf, len);
+        writefull(b.fd, "\r\n", 2);
+        bcexpect(&b, line, sizeof line, "INSERTED ");
+        n -= k;
+    }
+    free(buf);
+    close(b.fd);
+    return first;
+}
+
+static void
+benchsleepuntil(int64 at)
+{
+    int64 now = benchnow();
+    if (at > now)
+        usleep((at - now) / 1000);
+}
+
+// bench_delay_storm puts n jobs with a delay of one second, then times
+// nc consumers draining them as they come due. The age of a job is
+// how late after its due time it was reserved.
+static void
+bench_delay_storm(int n, int nc)
+{
+    int i, pids[nc];
+    int port = SERVER();
+    Benchshm *sh = benchshm(nc, n);
+
+    sh->nquit = nc - 1;
+    for (i = 0; i < nc; i++) {
+        if (benchfork(pids, i) == 0)
+            benchconsumer(sh, &sh->hist[i*Nbench], port, 1);
+    }
+    benchgo(sh, nc);
+    int64 due = benchputmany(port, n, 1, 60);
+    benchsleepuntil(due);
+
+    ctresettimer();
+    int64 t0 = benchnow();
+    benchwait(pids, nc);
+    ctstoptimer();
+    benchrate(n, t0);
+    benchreport(sh, nc, Benchrsv, "rsv");
+    benchreport(sh, nc, Benchage, "late");
+}
+
+// bench_ttr_storm has hog connections reserve n jobs with a TTR of one
+// second and never delete them, then times nc consumers draining the
+// jobs as their TTRs run out. Each hog takes a single reserve-many,
+// since with a TTR inside the safety margin the next one would get
+// DEADLINE_SOON.
+static void
+bench_ttr_storm(int n, int nc)
+{
+    int nhog = (n + Benchbatch - 1) / Benchbatch;
+    Benchconn *hog = malloc(sizeof *hog);
+    char line[64];
+    int i, k, nb, pids[nc];
+
+    benchnofile(nhog + 256);
+    int port = SERVER();
+    benchputmany(port, n, 0, 1);
+    // The hog connections stay open until the benchmark exits.
+    int64 t0 = benchnow();
+    for (i = 0; i < nhog; i++) {
+        bcdial(hog, port);
+        writefull(hog->fd, "reserve-many 1000 0\r\n", 21);
+        bcexpect(hog, line, sizeof line, "RESERVED_MANY ");
+        if (sscanf(line, "RESERVED_MANY %d %d", &k, &nb) != 2) {
+            printf("bad reply \"%s\"\n", line);
+            exit(1);
+        }
+        bcread(hog, NULL, nb + 2);
+    }
+
+    Benchshm *sh = benchshm(nc, n);
+    sh->nquit = nc - 1;
+    for (i = 0; i < nc; i++) {
+        if (benchfork(pids, i) == 0)
+            benchconsumer(sh, &sh->hist[i*Nbench], port, 1);
+    }
+    benchgo(sh, nc);
+    benchsleepuntil(t0 + 1000000000);
+
+    ctresettimer();
+    t0 = benchnow();
+    benchwait(pids, nc);
+    ctstoptimer();
+    benchrate(n, t0);
+    benchreport(sh, nc, Benchrsv, "rsv");
+    free(hog);
+}
+
+// benchsize picks the size of body i, spread evenly over size0..size1.
+static int
+benchsize(int i, int size0, int size1)
+{
+    return size0 + (int)((uint64)i * 2654435761u % (size1 - size0 + 1));
+}
+
+// benchlive tells whether job i is kept when live jobs out of every
+// 1000 are kept. The kept jobs are spread over the whole binlog.
+static int
+benchlive(int i, int live)
+{
+    return (uint64)i * 7919 % 1000 < (uint64)live;
+}
+
+// benchfill puts n jobs with bodies of size0..size1 bytes into a new
+// server, then deletes all but live out of every 1000 of them.
+static void
+benchfill(Benchconn *b, int n, int size0, int size1, int live)
+{
+    enum { Fillbytes = 1 << 20 };
+    char line[64], hdr[64];
+    char *buf = malloc(Fillbytes + size1 + 64);
+    int i, k, len, ndel;
+
+    for (i = 0; i < n; i += k) {
+        for (k = len = 0; i+k < n && k < Benchbatch && len < Fillbytes; k++) {
+            int size = benchsize(i + k, size0, size1);
+            len += sprintf(buf + len, "0 0 120 %d\r\n", size);
+            memset(buf + len, 'a', size);
+            memcpy(buf + len + size, "\r\n", 2);
+            len += size + 2;
+        }
+        int h = sprintf(hdr, "put-batch %d %d\r\n", k, len);
+        writefull(b->fd, hdr, h);
+        writefull(b->fd, buf, len);
+        writefull(b->fd, "\r\n", 2);
+        bcexpect(b, line, sizeof line, "INSERTED ");
+    }
+    for (i = 0; i < n; i += k) {
+        for (k = len = ndel = 0; i+k < n && k < Benchbatch; k++) {
+            if (!benchlive(i + k, live)) {
+                len += sprintf(buf + len, "delete %d\r\n", i + k + 1);
+                ndel++;
+            }
+        }
+        writefull(b->fd, buf, len);
+        while (ndel--)
+            bcexpect(b, line, sizeof line, "DELETED");
+    }
+    free(buf);
+}
+
+// benchstat sends a stats command and returns the number after key
+// in its reply, or -1 if the key is missing.
+static int64
+benchstat(Benchconn *b, char *cmd, char *key)
+{
+    char line[64];
+    int64 v = -1;
+
+    writefull(b->fd, cmd, strlen(cmd));
+    bcexpect(b, line, sizeof line, "OK ");
+    int n = atoi(line + 3);
+    char *body = malloc(n + 3);
+    bcread(b, body, n + 2);
+    body[n + 2] = '\0';
+    char *p = strstr(body, key);
+    if (p)
+        v = strtoll(p + strlen(key), NULL, 10);
+    free(body);
+    return v;
+}
+
+// benchputdel puts and deletes n jobs of size bytes one at a time,
+// recording the time of each put into h and the longest into *max.
+static void
+benchputdel(Benchconn *b, int n, int size, Hist *h, int64 *max)
+{
+    char put[64], del[64], line[64];
+    char *body = malloc(size + 2);
+    int i, np = sprintf(put, "put 0 0 120 %d\r\n", size);
+    uint64 id;
+
+    memset(body, 'a', size);
+    memcpy(body + size, "\r\n", 2);
+    for (i = 0; i < n; i++) {
+        int64 t = benchnow();
+        writefull(b->fd, put, np);
+        writefull(b->fd, body, size + 2);
+        bcexpect(b, line, sizeof line, "INSERTED ");
+        t = benchnow() - t;
+        hist_record(h, t);
+        if (t > *max)
+            *max = t;
+        sscanf(line, "INSERTED %" SCNu64, &id);
+        writefull(b->fd, del, sprintf(del, "delete %" PRIu64 "\r\n", id));
+        bcexpect(b, line, sizeof line, "DELETED");
+    }
+    free(body);
+}
+
+// bench_binlog_replay writes a binlog of n jobs with bodies of
+// size0..size1 bytes, live out of every 1000 of them not deleted,
+// then times how long a new server takes to replay it.
+static void
+bench_binlog_replay(int n, int size0, int size1, int live)
+{
+    Benchconn b;
+    int i, nlive = 0;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    bcdial(&b, port);
+    benchfill(&b, n, size0, size1, live);
+    close(b.fd);
+    kill_srvpid();
+
+    prot_init();
+    ctsetbytes((size0 + size1) / 2);
+    ctresettimer();
+    srv_acquire_wal(&srv);
+    ctstoptimer();
+
+    for (i = 0; i < n; i++)
+        nlive += benchlive(i, live);
+    assertf(tube_find("default")->ready.len == (size_t)nlive,
+            "replayed %zu jobs, want %d",
+            tube_find("default")->ready.len, nlive);
+    ctmetric("binlog-files", srv.wal.nfile);
+}
+
+// bench_binlog_compact keeps nlive jobs of size bytes in a binlog of
+// filesize byte files while it puts and deletes n more, so the live
+// jobs get moved out of old files to let them be removed.
+static void
+bench_binlog_compact(int n, int nlive, int size, int filesize)
+{
+    Benchconn b;
+    Hist h = {0};
+    int64 max = 0;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = filesize;
+    int port = SERVER();
+    bcdial(&b, port);
+    benchfill(&b, nlive, size, size, 1000);
+
+    ctsetbytes(size);
+    ctresettimer();
+    benchputdel(&b, n, size, &h, &max);
+    ctstoptimer();
+    benchpcts(&h, "put");
+    ctmetric("put-max-ns", max);
+    ctmetric("migrated",
+             benchstat(&b, "stats\r\n", "\nbinlog-records-migrated: "));
+    ctmetric("compact-ns",
+             benchstat(&b, "stats-loop\r\n", "\nbinlog-compact-ns: "));
+}
+
+// bench_binlog_rotate puts and deletes n jobs of size bytes in a
+// binlog of filesize byte files, to find how long a put can stall
+// when it has to start a new file.
+static void
+bench_binlog_rotate(int n, int size, int filesize)
+{
+    Benchconn b;
+    Hist h = {0};
+    int64 max = 0;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = filesize;
+    int port = SERVER();
+    bcdial(&b, port);
+
+    ctsetbytes(size);
+    ctresettimer();
+    benchputdel(&b, n, size, &h, &max);
+    ctstoptimer();
+    benchpcts(&h, "put");
+    ctmetric("put-max-ns", max);
+    ctmetric("files",
+             benchstat(&b, "stats\r\n", "\nbinlog-current-index: "));
+}
+
+void
+ctbench_load_1p1c(int n)
+{
+    bench_load(n, 1, 1, 1, 0);
+}
+
+void
+ctbench_load_4p4c(int n)
+{
+    bench_load(n, 4, 4, 1, 0);
+}
+
+void
+ctbench_load_16p16c(int n)
+{
+    bench_load(n, 16, 16, 1, 0);
+}
+
+void
+ctbench_load_4p4c_1000_tubes(int n)
+{
+    bench_load(n, 4, 4, 1000, 0);
+}
+
+void
+ctbench_load_1p1c_10000_waiters(int n)
+{
+    bench_load(n, 1, 1, 1, 10000);
+}
+
+void
+ctbench_delay_storm_4c(int n)
+{
+    bench_delay_storm(n, 4);
+}
+
+void
+ctbench_ttr_storm_4c(int n)
+{
+    bench_ttr_storm(n, 4);
+}
+
+void
+ctbench_binlog_replay_0064_all_live(int n)
+{
+    bench_binlog_replay(n, 64, 64, 1000);
+}
+
+void
+ctbench_binlog_replay_1024_10pct_live(int n)
+{
+    bench_binlog_replay(n, 1024, 1024, 100);
+}
+
+void
+ctbench_binlog_replay_mixed_50pct_live(int n)
+{
+    bench_binlog_replay(n, 16, 16384, 500);
+}
+
+void
+ctbench_binlog_compact_10000_live(int n)
+{
+    bench_binlog_compact(n, 10000, 256, 128 << 10);
+}
+
+void
+ctbench_binlog_rotate_064k(int n)
+{
+    bench_binlog_rotate(n, 1024, 64 << 10);
+}
+
+void
+ctbench_binlog_rotate_10m(int n)
+{
+    bench_binlog_rotate(n, 1024, 10 << 20);
+}
+
+static void
+bench_parse(int n, const char *line)
+{
+    int i, size = strlen(line);
+
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        if (!prot_parse(line, size)) {
+            puts("bench_parse: incomplete line");
+            exit(1);
+        }
+    }
+    ctstoptimer();
+}
+
+#define BENCH_PARSE(name, line) \
+    void ctbench_parse_##name(int n) { bench_parse(n, (line)); }
+
+BENCH_PARSE(put, "put 4294967295 0 120 65536\r\n")
+BENCH_PARSE(put_batch, "put-batch 100 1400\r\n")
+BENCH_PARSE(peek, "peek 123456\r\n")
+BENCH_PARSE(peek_ready, "peek-ready\r\n")
+BENCH_PARSE(peek_delayed, "peek-delayed\r\n")
+BENCH_PARSE(peek_buried, "peek-buried\r\n")
+BENCH_PARSE(pause_tube, "pause-tube default 10\r\n")
+BENCH_PARSE(reserve, "reserve\r\n")
+BENCH_PARSE(reserve_with_timeout, "reserve-with-timeout 10\r\n")
+BENCH_PARSE(reserve_job, "reserve-job 123456\r\n")
+BENCH_PARSE(reserve_many, "reserve-many 100 10\r\n")
+BENCH_PARSE(release, "release 123456 100 0\r\n")
+BENCH_PARSE(release_many, "release-many 100 0 100 1400\r\n")
+BENCH_PARSE(release_reserve, "release-reserve 123456 100 0 10\r\n")
+BENCH_PARSE(delete, "delete 123456\r\n")
+BENCH_PARSE(delete_many, "delete-many 100 1400\r\n")
+BENCH_PARSE(delete_reserve, "delete-reserve 123456 10\r\n")
+BENCH_PARSE(bury, "bury 123456 100\r\n")
+BENCH_PARSE(bury_reserve, "bury-reserve 123456 100 10\r\n")
+BENCH_PARSE(kick, "kick 100\r\n")
+BENCH_PARSE(kick_job, "kick-job 123456\r\n")
+BENCH_PARSE(touch, "touch 123456\r\n")
+BENCH_PARSE(touch_many, "touch-many 100 1400\r\n")
+BENCH_PARSE(stats, "stats\r\n")
+BENCH_PARSE(stats_job, "stats-job 123456\r\n")
+BENCH_PARSE(stats_tube, "stats-tube default\r\n")
+BENCH_PARSE(stats_memory, "stats-memory\r\n")
+BENCH_PARSE(stats_tubes, "stats-tubes app. app.x 100\r\n")
+BENCH_PARSE(stats_loop, "stats-loop\r\n")
+BENCH_PARSE(set_durability, "set-durability default buffered\r\n")
+BENCH_PARSE(subscribe, "subscribe 100\r\n")
+BENCH_PARSE(use, "use some-tube-name\r\n")
+BENCH_PARSE(watch, "watch some-tube-name\r\n")
+BENCH_PARSE(ignore, "ignore some-tube-name\r\n")
+BENCH_PARSE(list_tubes, "list-tubes\r\n")
+BENCH_PARSE(list_tube_used, "list-tube-used\r\n")
+BENCH_PARSE(list_tubes_watched, "list-tubes-watched\r\n")
+BENCH_PARSE(quit, "quit\r\n")
+BENCH_PARSE(unknown, "frobnicate the queue\r\n")
+
+// bench_tube_find looks up n names picked at random among ntube tubes.
+static void
+bench_tube_find(int n, int ntube)
+{
+    enum { Nname = 1024 };
+    static char names[Nname][MAX_TUBE_NAME_LEN];
+    char name[MAX_TUBE_NAME_LEN];
+    uint64 x = 1;
+    int i;
+
+    for (i = 0; i < ntube; i++) {
+        sprintf(name, "tube%d", i);
+        assert(tube_find_or_make(name));
+    }
+    for (i = 0; i < Nname; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        sprintf(names[i], "tube%d", (int)((x >> 33) % ntube));
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        if (!tube_find(names[i % Nname])) {
+            puts("tube_find: tube not found");
+            exit(1);
+        }
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_tube_find_10(int n)
+{
+    bench_tube_find(n, 10);
+}
+
+void
+ctbench_tube_find_1000(int n)
+{
+    bench_tube_find(n, 1000);
+}
+
+void
+ctbench_tube_find_100000(int n)
+{
+    bench_tube_find(n, 100000);
+}
+
+// bench_connsched gives one of nconn connections, picked at random,
+// a new reserve timeout and reschedules it, n times. The connections
+// are not real; only their place in srv.conns matters.
+static void
+bench_connsched(int n, int nconn)
+{
+    Tube *t = tube_find_or_make("default");
+    Conn **c = calloc(nconn, sizeof *c);
+    uint64 x = 1;
+    int i;
+
+    srv.conns.less = conn_less;
+    srv.conns.setpos = conn_setpos;
+    for (i = 0; i < nconn; i++) {
+        c[i] = make_conn(-1, STATE_WANT_COMMAND, t, t);
+        assert(c[i]);
+        c[i]->srv = &srv;
+        c[i]->pending_timeout = 1 + i % 3600;
+        connsched(c[i]);
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        Conn *k = c[(x >> 33) % nconn];
+        k->pending_timeout = 1 + (x >> 20) % 3600;
+        connsched(k);
+    }
+    ctstoptimer();
+    free(c);
+}
+
+void
+ctbench_connsched_10000(int n)
+{
+    bench_connsched(n, 10000);
+}
+
+// bench_prottick runs prottick with ntube tubes that each hold a job
+// delayed for an hour. Every tick then looks at each tube twice, in
+// soonest_delayed_job and for pauses, and has nothing else to do.
+static void
+bench_prottick(int n, int ntube)
+{
+    char name[MAX_TUBE_NAME_LEN];
+    int i;
+
+    srv.conns.less = conn_less;
+    srv.conns.setpos = conn_setpos;
+    for (i = 0; i < ntube; i++) {
+        sprintf(name, "tube%d", i);
+        Tube *t = tube_find_or_make(name);
+        Job *j = make_job(0, 3600000000000LL, 1, 0, t);
+        assert(t && j);
+        j->r.deadline_at = nanoseconds() + j->r.delay;
+        j->r.state = Delayed;
+        assert(heapinsert(&t->delay, j));
+    }
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        prottick(&srv);
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_prottick_10_tubes(int n)
+{
+    bench_prottick(n, 10);
+}
+
+void
+ctbench_prottick_1000_tubes(int n)
+{
+    bench_prottick(n, 1000);
+}
+
+void
+ctbench_prottick_100000_tubes(int n)
+{
+    bench_prottick(n, 100000);
+}
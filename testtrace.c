@@ -0,0 +1,84 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ct/ct.h"
+
+
+void
+cttest_trace_empty()
+{
+    char buf[1];
+
+    assertf(tracesize(0) == 0, "nothing recorded");
+    assertf(tracefmt(buf, 0) == 0, "nothing written");
+}
+
+void
+cttest_trace_text()
+{
+    char *buf, *p;
+    size_t n;
+
+    trace(Traccept, 5, 0);
+    trace(Trput, 5, 12);
+    trace(Trsyncstart, -1, 3);
+    buf = malloc(tracesize(0));
+    assert(buf);
+    n = tracefmt(buf, 0);
+    assertf(n <= tracesize(0), "%zu bytes, at most %zu", n, tracesize(0));
+    assertf(buf[n-1] == '\n', "should end in a newline");
+    buf[n-1] = '\0';
+
+    p = strchr(buf, ' ');
+    assertf(strncmp(p, " accept 5 0\n", 12) == 0, "got %s", p);
+    p = strchr(strchr(p, '\n'), ' ');
+    assertf(strncmp(p, " put 5 12\n", 10) == 0, "got %s", p);
+    p = strchr(strchr(p, '\n'), ' ');
+    assertf(strcmp(p, " sync-start -1 3") == 0, "got %s", p);
+    free(buf);
+}
+
+void
+cttest_trace_binary()
+{
+    unsigned char buf[Tracebinsize];
+
+    trace(Trdelete, 7, 0x0102030405060708ULL);
+    assertf(tracesize(1) == Tracebinsize, "one event");
+    assertf(tracefmt((char *)buf, 1) == Tracebinsize, "one event");
+    assertf(buf[8] == 1 && buf[15] == 8, "id is big-endian");
+    assertf(buf[19] == Trdelete, "kind is %d", buf[19]);
+    assertf(buf[23] == 7, "fd is %d", buf[23]);
+}
+
+void
+cttest_trace_wrap()
+{
+    char *buf;
+    size_t n;
+    int i;
+
+    for (i = 0; i < Tracesize + 10; i++) {
+        trace(Trreserve, 1, i);
+    }
+    assertf(tracesize(1) == Tracesize * Tracebinsize, "ring is full");
+    buf = malloc(tracesize(1));
+    assert(buf);
+    n = tracefmt(buf, 1);
+    assertf(n == Tracesize * Tracebinsize, "wrote %zu", n);
+    // the oldest event left is the 11th recorded
+    assertf((unsigned char)buf[15] == 10, "oldest id is %d", buf[15]);
+    free(buf);
+}
+
+void
+ctbench_trace(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        trace(Trput, 3, i);
+    }
+}
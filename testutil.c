@@ -1,6 +1,7 @@
 #include "ct/ct.h"
 #include "dat.h"
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,6 +18,37 @@ cttest_allocf()
     free(got);
 }
 
+void
+cttest_fmtu64()
+{
+    uint64 vals[] = {0, 1, 9, 10, 99, 100, 101, 999, 1000, 65535,
+                     4294967295u, 4294967296u, 10000000000000000000u,
+                     18446744073709551615u};
+    char got[24], want[24];
+    size_t i;
+
+    for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+        *fmtu64(got, vals[i]) = '\0';
+        sprintf(want, "%"PRIu64, vals[i]);
+        assertf(strcmp(want, got) == 0, "got \"%s\", want \"%s\"", got, want);
+    }
+}
+
+void
+cttest_fmti64()
+{
+    int64 vals[] = {0, 1, -1, 10, -10, 123456789, -123456789,
+                    INT64_MAX, INT64_MIN};
+    char got[24], want[24];
+    size_t i;
+
+    for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+        *fmti64(got, vals[i]) = '\0';
+        sprintf(want, "%"PRId64, vals[i]);
+        assertf(strcmp(want, got) == 0, "got \"%s\", want \"%s\"", got, want);
+    }
+}
+
 void
 cttest_opt_none()
 {
@@ -0,0 +1,148 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+// The flight recorder keeps the last Tracesize events in a ring.
+// Recording an event is a clock read and four stores, so it is
+// always on. Only the event loop records, so no locking is needed.
+
+static Trace ring[Tracesize];
+static uint64 nevent; // events recorded ever
+
+// Set by the SIGUSR2 handler, see tracewant.
+static volatile sig_atomic_t dumpnow = 0;
+
+static const char *kindnames[Ntracekind] = {
+    [Traccept] = "accept",
+    [Trclose] = "close",
+    [Trput] = "put",
+    [Trreserve] = "reserve",
+    [Trdelete] = "delete",
+    [Trtimeout] = "timeout",
+    [Trrotate] = "rotate",
+    [Trsyncstart] = "sync-start",
+    [Trsyncend] = "sync-end",
+    [Trcompact] = "compact",
+};
+
+// The longest line of the text form: three numbers,
+// a kind name, three spaces and a newline.
+#define LINE_MAX_LEN (21 + 21 + 20 + 10 + 3 + 1)
+
+void
+trace(int kind, int fd, uint64 id)
+{
+    Trace *e = &ring[nevent++ & (Tracesize - 1)];
+
+    e->at = nanoseconds();
+    e->id = id;
+    e->kind = kind;
+    e->fd = fd;
+}
+
+static uint64
+tracelen()
+{
+    return nevent < Tracesize ? nevent : Tracesize;
+}
+
+// tracesize returns the most bytes tracefmt can write.
+size_t
+tracesize(int binary)
+{
+    return tracelen() * (binary ? Tracebinsize : LINE_MAX_LEN);
+}
+
+static char *
+put32(char *p, uint32 v)
+{
+    *p++ = v >> 24;
+    *p++ = v >> 16;
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static char *
+put64(char *p, uint64 v)
+{
+    p = put32(p, v >> 32);
+    return put32(p, v);
+}
+
+// tracefmt writes the recorded events to buf, oldest first, and
+// returns the number of bytes written. The text form has one line
+// per event: "<at> <kind> <fd> <id>\n". The binary form has
+// Tracebinsize bytes per event: at:8 id:8 kind:4 fd:4, big-endian.
+size_t
+tracefmt(char *buf, int binary)
+{
+    uint64 i;
+    char *p = buf;
+
+    for (i = nevent - tracelen(); i < nevent; i++) {
+        Trace *e = &ring[i & (Tracesize - 1)];
+        if (binary) {
+            p = put64(p, e->at);
+            p = put64(p, e->id);
+            p = put32(p, e->kind);
+            p = put32(p, e->fd);
+            continue;
+        }
+        p = fmti64(p, e->at);
+        *p++ = ' ';
+        p = stpcpy(p, kindnames[e->kind]);
+        *p++ = ' ';
+        p = fmti64(p, e->fd);
+        *p++ = ' ';
+        p = fmtu64(p, e->id);
+        *p++ = '\n';
+    }
+    return p - buf;
+}
+
+// tracewrite writes the text form of the recorded events to fd.
+void
+tracewrite(int fd)
+{
+    char *buf, *p;
+    size_t n;
+    ssize_t r;
+
+    buf = malloc(tracesize(0));
+    if (!buf) {
+        twarnx("OOM");
+        return;
+    }
+    n = tracefmt(buf, 0);
+    for (p = buf; n > 0; p += r, n -= r) {
+        r = write(fd, p, n);
+        if (r == -1) {
+            twarn("write");
+            break;
+        }
+    }
+    free(buf);
+}
+
+// tracewant is the SIGUSR2 handler. It only sets a flag;
+// the event loop does the writing.
+void
+tracewant(int sig)
+{
+    UNUSED_PARAMETER(sig);
+    dumpnow = 1;
+}
+
+// tracedue reports whether a dump was asked for since the last call.
+int
+tracedue()
+{
+    if (!dumpnow)
+        return 0;
+    dumpnow = 0;
+    return 1;
+}
@@ -5,6 +5,9 @@
 
 struct Ms tubes;
 
+// hist_all has the histograms of all tubes together.
+Hist hist_all[Nhist];
+
 Tube *
 make_tube(const char *name)
 {
@@ -35,12 +38,28 @@ static void
 tube_free(Tube *t)
 {
     ms_remove(&tubes, t);
-    free(t->ready.data);
-    free(t->delay.data);
+    heapfree(&t->ready);
+    heapfree(&t->delay);
     ms_clear(&t->waiting_conns);
+    free(t->hist);
     free(t);
 }
 
+// tube_record adds v to histogram k of t and of all tubes.
+// The histograms of t are allocated the first time; if that
+// fails, only the histogram of all tubes gets v.
+void
+tube_record(Tube *t, int k, uint64 v)
+{
+    hist_record(&hist_all[k], v);
+    if (!t->hist) {
+        t->hist = calloc(Nhist, sizeof(Hist));
+        if (!t->hist)
+            return;
+    }
+    hist_record(&t->hist[k], v);
+}
+
 void
 tube_dref(Tube *t)
 {
@@ -103,3 +122,45 @@ tube_find_or_make(const char *name)
     return make_and_insert_tube(name);
 }
 
+
+static const char *durnames[] = {
+    "default",
+    "none",
+    "buffered",
+    "fsync",
+};
+
+const char *
+durname(int d)
+{
+    return durnames[d];
+}
+
+// durparse returns the Dur* value named by name, or -1.
+int
+durparse(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(durnames) / sizeof(durnames[0]); i++) {
+        if (strcmp(durnames[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// tube_setdurability sets the durability class of t to d.
+// A tube with a class other than Durdefault holds a reference
+// to itself, so the setting outlives the clients using the tube.
+// Setting Durdefault may free t.
+void
+tube_setdurability(Tube *t, int d)
+{
+    int old = t->durability;
+
+    t->durability = d;
+    if (old == Durdefault && d != Durdefault)
+        tube_iref(t);
+    if (old != Durdefault && d == Durdefault)
+        tube_dref(t);
+}
@@ -86,6 +86,57 @@ zalloc(int n)
 }
 
 
+// Pairs of decimal digits from "00" to "99", for fmtu64.
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Fmtu64 writes v in decimal to p, two digits at a time,
+// and returns a pointer just past the last digit.
+// It does not write a NUL. p must have room for 20 bytes.
+char*
+fmtu64(char *p, uint64 v)
+{
+    uint64 t;
+    int n = 1;
+    char *e;
+
+    for (t = v; t >= 100; t /= 100) n += 2;
+    if (t >= 10) n++;
+
+    e = p + n;
+    while (v >= 100) {
+        const char *d = digit_pairs + (v % 100) * 2;
+        v /= 100;
+        *--e = d[1];
+        *--e = d[0];
+    }
+    if (v >= 10) {
+        *--e = digit_pairs[v * 2 + 1];
+        *--e = digit_pairs[v * 2];
+    } else {
+        *--e = '0' + v;
+    }
+    return p + n;
+}
+
+
+// Fmti64 is like fmtu64 for a signed v.
+// p must have room for 21 bytes.
+char*
+fmti64(char *p, int64 v)
+{
+    if (v < 0) {
+        *p++ = '-';
+        return fmtu64(p, -(uint64)v);
+    }
+    return fmtu64(p, v);
+}
+
+
 static void
 warn_systemd_ignored_option(char *opt, char *arg)
 {
@@ -105,11 +156,20 @@ usage(int code)
             "\n"
             "Options:\n"
             " -b DIR   write-ahead log directory\n"
+            " -B BYTES keep at most BYTES of job bodies in memory; bodies of\n"
+            "          buried and long delayed jobs are read back from the\n"
+            "          write-ahead log when needed (default is no limit)\n"
             " -f MS    fsync at most once every MS milliseconds (default is %dms);\n"
             "          use -f0 for \"always fsync\"\n"
             " -F       never fsync\n"
+            " -k K     split the write-ahead log into K partitions by tube\n"
+            "          (default is 1)\n"
             " -l ADDR  listen on address (default is 0.0.0.0)\n"
+            " -m BYTES refuse new jobs once BYTES of memory are in use\n"
+            "          (default is no limit)\n"
             " -p PORT  listen on port (default is " Portdef ")\n"
+            " -P PORT  also listen on port for the binary protocol\n"
+            " -S FILE  write stats to FILE every 100ms, for bsstat\n"
             " -u USER  become user and group\n"
             " -z BYTES set the maximum job size in bytes (default is %d);\n"
             "          max allowed is %d bytes\n"
@@ -155,6 +215,7 @@ void
 optparse(Server *s, char **argv)
 {
     int64 ms;
+    size_t n;
     char *arg, *tmp;
 #   define EARGF(x) (*arg ? (tmp=arg,arg="",tmp) : *argv ? *argv++ : (x))
 
@@ -166,6 +227,9 @@ optparse(Server *s, char **argv)
                     s->port = EARGF(flagusage("-p"));
                     warn_systemd_ignored_option("-p", s->port);
                     break;
+                case 'P':
+                    s->binport = EARGF(flagusage("-P"));
+                    break;
                 case 'l':
                     s->addr = EARGF(flagusage("-l"));
                     warn_systemd_ignored_option("-l", s->addr);
@@ -194,6 +258,17 @@ optparse(Server *s, char **argv)
                 case 'F':
                     s->wal.wantsync = 0;
                     break;
+                case 'k':
+                    n = parse_size_t(EARGF(flagusage("-k")));
+                    if (n < 1 || n > Maxwal) {
+                        warnx("number of wal partitions must be 1 to %d", Maxwal);
+                        usage(5);
+                    }
+                    s->nwal = n;
+                    break;
+                case 'm':
+                    mem_limit = parse_size_t(EARGF(flagusage("-m")));
+                    break;
                 case 'u':
                     s->user = EARGF(flagusage("-u"));
                     break;
@@ -201,6 +276,12 @@ optparse(Server *s, char **argv)
                     s->wal.dir = EARGF(flagusage("-b"));
                     s->wal.use = 1;
                     break;
+                case 'B':
+                    body_budget = parse_size_t(EARGF(flagusage("-B")));
+                    break;
+                case 'S':
+                    s->shmpath = EARGF(flagusage("-S"));
+                    break;
                 case 'h':
                     usage(0);
                 case 'v':
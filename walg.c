@@ -63,6 +63,8 @@ walgc(Wal *w)
         }
 
         w->nfile--;
+        if (f->rfd != -1)
+            close(f->rfd);
         unlink(f->path);
         free(f->path);
         free(f);
@@ -70,20 +72,123 @@ walgc(Wal *w)
 }
 
 
+// Walflush writes the records held in w->wbuf to w->cur.
+// On failure, walflush disables w and returns 0; on success,
+// it returns 1.
+int
+walflush(Wal *w)
+{
+    int r;
+    char *p = w->wbuf;
+    int64 t;
+
+    while (w->wlen > 0) {
+        t = nanoseconds();
+        r = write(w->cur->fd, p, w->wlen);
+        w->write_ns += nanoseconds() - t;
+        w->nwrite++;
+        if (r == -1) {
+            twarn("write");
+            w->wlen = 0;
+            filewclose(w->cur);
+            w->use = 0;
+            return 0;
+        }
+        p += r;
+        w->wlen -= r;
+    }
+    return 1;
+}
+
+
+// Walbuffer appends len bytes of buf to the records waiting
+// in w->wbuf. Returns 1 on success, 0 if out of memory.
+int
+walbuffer(Wal *w, void *buf, int len)
+{
+    char *nbuf;
+    int ncap;
+
+    if (w->wlen + len > w->wcap) {
+        ncap = (w->wlen + len) * 2;
+        nbuf = realloc(w->wbuf, ncap);
+        if (!nbuf) {
+            return 0;
+        }
+        w->wbuf = nbuf;
+        w->wcap = ncap;
+    }
+    memcpy(w->wbuf + w->wlen, buf, len);
+    w->wlen += len;
+    return 1;
+}
+
+
+// Walbatch(w, 1) starts a batch: the records written to w are kept
+// in memory, and compaction and fsync are put off, until walbatch(w, 0)
+// writes them all at once and does the maintenance.
+void
+walbatch(Wal *w, int on)
+{
+    if (on) {
+        w->batch = 1;
+        return;
+    }
+    w->batch = 0;
+    if (w->use && walflush(w)) {
+        walmaint(w);
+    }
+}
+
+
+// Syncfile fsyncs f, which holds the records written since the
+// last fsync, and clears the pending sync.
+static void
+syncfile(Wal *w, File *f)
+{
+    int64 now;
+
+    now = nanoseconds();
+    w->lastsync = now;
+    w->needsync = 0;
+    w->syncnow = 0;
+    trace(Trsyncstart, -1, f->seq);
+    if (fsync(f->fd) == -1) {
+        twarn("fsync");
+    }
+    w->sync_ns += nanoseconds() - now;
+    w->nsync++;
+    trace(Trsyncend, -1, f->seq);
+    PROBE2(fsync, f->seq, nanoseconds() - now);
+}
+
+
 // returns 1 on success, 0 on error.
 static int
 usenext(Wal *w)
 {
     File *f;
 
+    if (!walflush(w)) {
+        return 0;
+    }
+
     f = w->cur;
     if (!f->next) {
         twarnx("there is no next wal file");
         return 0;
     }
 
+    // walsync only syncs w->cur, so records in f still waiting
+    // for an fsync must get it before f is closed.
+    if (w->syncnow || (w->wantsync && w->needsync)) {
+        syncfile(w, f);
+    }
+
     w->cur = f->next;
     filewclose(f);
+    trace(Trrotate, -1, w->cur->seq);
+    PROBE1(rotate, w->cur->seq);
     return 1;
 }
 
@@ -134,25 +239,38 @@ moveone(Wal *w)
         return;
     }
 
+    if (!job_body_load(j)) {
+        return;
+    }
+
     if (!walresvmigrate(w, j)) {
         // it will not fit, so we'll try again later
+        job_body_trim(j);
         return;
     }
 
     filermjob(w->head, j);
     w->nmig++;
+    trace(Trcompact, -1, j->r.id);
     walwrite(w, j);
+    job_body_trim(j);
 }
 
 
 static void
 walcompact(Wal *w)
 {
-    int r;
+    int r = ratio(w);
+    int64 t;
 
-    for (r=ratio(w); r>=2; r--) {
+    if (r < 2)
+        return;
+    t = nanoseconds();
+    for (; r>=2; r--) {
         moveone(w);
     }
+    w->compact_ns += nanoseconds() - t;
+    w->ncompact++;
 }
 
 
@@ -162,11 +280,26 @@ walsync(Wal *w)
     int64 now;
 
     now = nanoseconds();
-    if (w->wantsync && now >= w->lastsync+w->syncrate) {
-        w->lastsync = now;
-        if (fsync(w->cur->fd) == -1) {
-            twarn("fsync");
-        }
+    if (w->syncnow ||
+        (w->wantsync && w->needsync && now >= w->lastsync+w->syncrate)) {
+        syncfile(w, w->cur);
+    }
+}
+
+
+// Records how soon the record just written for j must reach the disk,
+// according to the durability class j was put under.
+static void
+wantsync(Wal *w, Job *j)
+{
+    switch (j->durability) {
+    case Durbuffered:
+        break;
+    case Durfsync:
+        w->syncnow = 1;
+        break;
+    default:
+        w->needsync = 1;
     }
 }
 
@@ -174,13 +307,14 @@ walsync(Wal *w)
 // Walwrite writes j to the log w (if w is enabled).
 // On failure, walwrite disables w and returns 0; on success, it returns 1.
 // Unlke walresv*, walwrite should never fail because of a full disk.
-// If w is disabled, then walwrite takes no action and returns 1.
+// If w is disabled or j was put under Durnone, then walwrite takes no action
+// and returns 1.
 int
 walwrite(Wal *w, Job *j)
 {
     int r = 0;
 
-    if (!w->use) return 1;
+    if (!w->use || j->durability == Durnone) return 1;
     if (w->cur->resv > 0 || usenext(w)) {
         if (j->file) {
             r = filewrjobshort(w->cur, j);
@@ -188,11 +322,14 @@ walwrite(Wal *w, Job *j)
             r = filewrjobfull(w->cur, j);
         }
     }
-    if (!r) {
+    if (!r && w->use) {
+        w->wlen = 0;
         filewclose(w->cur);
         w->use = 0;
     }
+    wantsync(w, j);
     w->nrec++;
+    PROBE4(walwrite, j->r.id, j->tube->name, j->r.body_size - 2, j->r.state);
     return r;
 }
 
@@ -200,7 +337,7 @@ walwrite(Wal *w, Job *j)
 void
 walmaint(Wal *w)
 {
-    if (w->use) {
+    if (w->use && !w->batch) {
         walcompact(w);
         walsync(w);
     }
@@ -368,6 +505,9 @@ walresvput(Wal *w, Job *j)
 {
     int z = 0;
 
+    // return value must be nonzero but is otherwise ignored
+    if (j->durability == Durnone) return 1;
+
     // reserve space for the initial job record
     z += sizeof(int);
     z += strlen(j->tube->name);
@@ -384,9 +524,13 @@ walresvput(Wal *w, Job *j)
 
 // Returns the number of bytes reserved or 0 on error.
 int
-walresvupdate(Wal *w)
+walresvupdate(Wal *w, Job *j)
 {
     int z = 0;
+
+    // return value must be nonzero but is otherwise ignored
+    if (j->durability == Durnone) return 1;
+
     z +=sizeof(int);
     z +=sizeof(Jobrec);
     return reserve(w, z);
@@ -474,6 +618,101 @@ walread(Wal *w, Job *list, int min)
 }
 
 
+// Writes the durability class of every tube that has one
+// to w->dir/durability, replacing the previous contents.
+// Returns 1 on success, 0 on error.
+int
+walsavedur(Wal *w)
+{
+    size_t i;
+    FILE *f;
+    char *path, *tmp;
+    int r = 0;
+
+    if (!w->use) return 1;
+
+    path = fmtalloc("%s/durability", w->dir);
+    tmp = fmtalloc("%s/durability.tmp", w->dir);
+    if (!path || !tmp) {
+        twarnx("OOM");
+        goto out;
+    }
+
+    f = fopen(tmp, "w");
+    if (!f) {
+        twarn("fopen %s", tmp);
+        goto out;
+    }
+    for (i = 0; i < tubes.len; i++) {
+        Tube *t = tubes.items[i];
+        if (t->durability != Durdefault) {
+            fprintf(f, "%s %s\n", durname(t->durability), t->name);
+        }
+    }
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1) {
+        twarn("write %s", tmp);
+        fclose(f);
+        goto out;
+    }
+    if (fclose(f) == EOF) {
+        twarn("close %s", tmp);
+        goto out;
+    }
+    if (rename(tmp, path) == -1) {
+        twarn("rename %s", tmp);
+        goto out;
+    }
+    r = 1;
+
+out:
+    free(path);
+    free(tmp);
+    return r;
+}
+
+
+// Reads w->dir/durability, if any, and applies
+// the durability classes to the tubes named there.
+void
+walloaddur(Wal *w)
+{
+    FILE *f;
+    char *path;
+    char dname[16], tname[MAX_TUBE_NAME_LEN];
+    int d;
+
+    path = fmtalloc("%s/durability", w->dir);
+    if (!path) {
+        twarnx("OOM");
+        exit(1);
+    }
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            twarn("fopen %s", path);
+        free(path);
+        return;
+    }
+
+    while (fscanf(f, "%15s %200s", dname, tname) == 2) {
+        d = durparse(dname);
+        if (d == -1) {
+            warnx("%s: unknown durability class: %s", path, dname);
+            continue;
+        }
+        Tube *t = tube_find_or_make(tname);
+        if (!t) {
+            twarnx("OOM");
+            exit(1);
+        }
+        tube_setdurability(t, d);
+    }
+    fclose(f);
+    free(path);
+}
+
+
 void
 walinit(Wal *w, Job *list)
 {
@@ -490,3 +729,87 @@ walinit(Wal *w, Job *list)
 
     w->cur = w->tail;
 }
+
+
+// Makes sure w->dir was not written with a different number
+// of partitions than n: it must not hold binlog files when
+// n > 1, nor partition directories numbered n or above.
+// Returns 1 if the layout is usable, 0 otherwise.
+static int
+walcheckparts(Wal *w, int n)
+{
+    static char base[] = "binlog.";
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    char *path, *p;
+    long i;
+    int ok = 1;
+
+    d = opendir(w->dir);
+    if (!d) return 1;
+
+    while (ok && (e = readdir(d))) {
+        if (n > 1 && strncmp(e->d_name, base, sizeof(base)-1) == 0) {
+            twarnx("%s holds an unpartitioned binlog", w->dir);
+            ok = 0;
+            continue;
+        }
+        i = strtol(e->d_name, &p, 10);
+        if (!*e->d_name || *p != '\0' || i < n) continue;
+        path = fmtalloc("%s/%s", w->dir, e->d_name);
+        if (!path) {
+            twarnx("OOM");
+            ok = 0;
+            continue;
+        }
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            twarnx("%s holds binlog partition %ld, but only %d in use",
+                   w->dir, i, n);
+            ok = 0;
+        }
+        free(path);
+    }
+
+    closedir(d);
+    return ok;
+}
+
+
+// Walpart splits w into n partitions, one in each of
+// the subdirectories w->dir/0 .. w->dir/n-1, creating them
+// if necessary. Each partition gets the settings of w and
+// has its own files, lock, compaction and sync.
+// When n is 1, the one partition is w itself.
+// Returns an array of n partitions, or NULL on error.
+Wal *
+walpart(Wal *w, int n)
+{
+    Wal *p;
+    int i;
+
+    if (!walcheckparts(w, n)) return NULL;
+    if (n == 1) return w;
+
+    p = zalloc(n * sizeof(Wal));
+    if (!p) {
+        twarnx("OOM");
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        p[i].filesize = w->filesize;
+        p[i].use = w->use;
+        p[i].wantsync = w->wantsync;
+        p[i].syncrate = w->syncrate;
+        p[i].dir = fmtalloc("%s/%d", w->dir, i);
+        if (!p[i].dir) {
+            twarnx("OOM");
+            return NULL;
+        }
+        if (mkdir(p[i].dir, 0700) == -1 && errno != EEXIST) {
+            twarn("mkdir %s", p[i].dir);
+            return NULL;
+        }
+    }
+    return p;
+}